@@ -0,0 +1,1219 @@
+#define _FILE_OFFSET_BITS 64
+#include "filetrans.h"
+#include "serial.h"
+#include "rt_tick.h"
+#include "lz.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "filetrans"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    buf[0] = value >> 24;
+    buf[1] = (value >> 16) & 0xFF;
+    buf[2] = (value >> 8) & 0xFF;
+    buf[3] = value & 0xFF;
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+    return ((uint32_t)buf[0] << 24) + ((uint32_t)buf[1] << 16) + ((uint32_t)buf[2] << 8) + buf[3];
+}
+
+/* CRC32 of IEEE 802.3 as zlib computes it, `crc` 0 to start, four bits at a time */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+
+    return ~crc;
+}
+
+static int map_test(const uint8_t *map, uint32_t seq)
+{
+    return map[seq >> 3] & (1 << (seq & 7));
+}
+
+uint8_t filetrans_compute_meta_length(agile_modbus_t *ctx, int function, agile_modbus_msg_type_t msg_type)
+{
+    int length;
+
+    (void)ctx;
+
+    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
+        length = 0;
+        if (function == AGILE_MODBUS_FC_TRANS_FILE)
+            length = 4;
+    } else {
+        /* MSG_CONFIRMATION */
+        length = 1;
+        if (function == AGILE_MODBUS_FC_TRANS_FILE)
+            length = 4;
+    }
+
+    return length;
+}
+
+int filetrans_compute_data_length(agile_modbus_t *ctx, uint8_t *msg, int msg_length, agile_modbus_msg_type_t msg_type)
+{
+    int function = msg[ctx->backend->header_length];
+    int length;
+
+    (void)msg_length;
+
+    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
+        length = 0;
+        if (function == AGILE_MODBUS_FC_TRANS_FILE)
+            length = (msg[ctx->backend->header_length + 3] << 8) + msg[ctx->backend->header_length + 4];
+    } else {
+        /* MSG_CONFIRMATION */
+        length = 0;
+        if (function == AGILE_MODBUS_FC_TRANS_FILE)
+            length = msg[ctx->backend->header_length + 4];
+    }
+
+    return length;
+}
+
+/* Start a request in the send buffer, return where its data goes, behind command and number of bytes */
+static uint8_t *master_request(struct filetrans_master *master, int cmd)
+{
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+    uint8_t *req = agile_modbus_raw_request_data(ctx, master->slave, AGILE_MODBUS_FC_TRANS_FILE, NULL);
+
+    req[0] = cmd >> 8;
+    req[1] = cmd & 0xFF;
+
+    return req + 4;
+}
+
+/* The line is non-blocking and a window is more than its output buffer holds, wait for room */
+static int master_write(struct filetrans_master *master, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        int rc = serial_send(master->fd, buf, len);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+
+            struct pollfd pfd = {.fd = master->fd, .events = POLLOUT};
+            if (poll(&pfd, 1, master->timeout) == 0)
+                return -1;
+            continue;
+        }
+
+        buf += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* Finish the request with `nb` bytes of data and send it, return the length of the frame */
+static int master_send(struct filetrans_master *master, int nb)
+{
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+    uint8_t *req = ctx->send_buf + ctx->backend->header_length + 1;
+
+    req[2] = nb >> 8;
+    req[3] = nb & 0xFF;
+
+    int send_len = agile_modbus_serialize_raw_request_in_place(ctx, 4 + nb);
+    if (send_len < 0 || master_write(master, ctx->send_buf, send_len) < 0)
+        return -1;
+
+    return send_len;
+}
+
+/* Read one response, return its length, 0 on timeout and -1 when what came is not a valid frame */
+static int master_receive(struct filetrans_master *master)
+{
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+    uint64_t deadline = rt_tick_get_us() + (uint64_t)master->timeout * 1000;
+    int len = 0;
+
+    while (len < ctx->read_bufsz) {
+        uint64_t now = rt_tick_get_us();
+        if (now >= deadline)
+            break;
+
+        struct pollfd pfd = {.fd = master->fd, .events = POLLIN};
+        int rc = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            continue;
+
+        rc = read(master->fd, ctx->read_buf + len, ctx->read_bufsz - len);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        len += rc;
+
+        /* Done as soon as the frame is complete */
+        rc = agile_modbus_receive_judge(ctx, len, AGILE_MODBUS_MSG_CONFIRMATION);
+        if (rc > 0)
+            return rc;
+    }
+
+    return len > 0 ? -1 : 0;
+}
+
+/* Drop stale responses, not what is still on its way out */
+static void master_flush(struct filetrans_master *master)
+{
+    tcflush(master->fd, TCIFLUSH);
+}
+
+/*
+ * Wait for the response to the request in the send buffer and check it.
+ * Return a pointer to its data with the command in `cmd` and the number of
+ * bytes in `nb`, NULL when it didn't come or reports a failure.
+ */
+static const uint8_t *master_response(struct filetrans_master *master, int *cmd, int *nb)
+{
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+
+    /* The request is on the line when the wait for the response starts */
+    tcdrain(master->fd);
+
+    int read_len = master_receive(master);
+    if (read_len <= 0)
+        return NULL;
+
+    if (agile_modbus_deserialize_raw_response(ctx, read_len) < 0)
+        return NULL;
+
+    const uint8_t *rsp = ctx->read_buf + ctx->backend->header_length + 1;
+    if (rsp[2] != FILETRANS_STATUS_SUCCESS)
+        return NULL;
+
+    *cmd = (rsp[0] << 8) + rsp[1];
+    *nb = rsp[3];
+
+    return rsp + 4;
+}
+
+/* Send the request of `req_nb` bytes of data until a successful response of `cmd` with `nb_min` bytes comes */
+static const uint8_t *master_query(struct filetrans_master *master, int req_nb, int cmd, int nb_min, int *nb)
+{
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+    int send_len = 0;
+
+    for (int i = 0; i <= master->retries; i++) {
+        master_flush(master);
+
+        /* The frame stays in the send buffer, a retry sends it again as it is */
+        int rc;
+        if (i == 0)
+            rc = send_len = master_send(master, req_nb);
+        else
+            rc = master_write(master, ctx->send_buf, send_len);
+        if (rc < 0)
+            return NULL;
+
+        int rsp_cmd = 0;
+        const uint8_t *rsp = master_response(master, &rsp_cmd, nb);
+        if (rsp && rsp_cmd == cmd && *nb >= nb_min)
+            return rsp;
+    }
+
+    return NULL;
+}
+
+/* Start the transfer, `held` is the number of chunks the slave kept from an interrupted one */
+static int master_start(struct filetrans_master *master, uint32_t file_size, uint32_t file_crc, const char *name,
+                        uint32_t *held)
+{
+    int name_len = strlen(name) + 1;
+    uint8_t *req = master_request(master, TRANS_FILE_CMD_START);
+
+    put_u32(req, file_size);
+    req[4] = master->chunk_size >> 8;
+    req[5] = master->chunk_size & 0xFF;
+    req[6] = master->window;
+    put_u32(req + 7, file_crc);
+    req[11] = master->options;
+    memcpy(req + 12, name, name_len);
+
+    int nb = 0;
+    const uint8_t *rsp = master_query(master, 12 + name_len, TRANS_FILE_CMD_START, 8, &nb);
+    if (rsp == NULL)
+        return -1;
+
+    int chunk_size = (rsp[0] << 8) + rsp[1];
+    int window = rsp[2];
+    int options = rsp[7];
+    if (chunk_size <= 0 || chunk_size > master->chunk_size || window <= 0 || window > master->window ||
+        (options & ~master->options)) {
+        LOG_W("slave proposes chunk size %d, window %d and options 0x%02X.", chunk_size, window, options);
+        return -1;
+    }
+
+    master->chunk_size = chunk_size;
+    master->window = window;
+    master->options = options;
+    *held = get_u32(rsp + 3);
+
+    return 0;
+}
+
+/*
+ * Ask a slave for the chunks it misses and mark them in `gaps`. Return
+ * their number, 0 when the slave has the whole file and -1 when it doesn't
+ * answer.
+ */
+static int master_missing(struct filetrans_master *master, uint32_t nb_chunks, uint8_t *gaps)
+{
+    uint32_t from = 0;
+    int missing = 0;
+
+    while (from < nb_chunks) {
+        put_u32(master_request(master, TRANS_FILE_CMD_MISSING), from);
+
+        int nb = 0;
+        const uint8_t *rsp = master_query(master, 4, TRANS_FILE_CMD_MISSING, 8, &nb);
+        if (rsp == NULL)
+            return -1;
+
+        /* Everything before `first` is written, the map tells about the chunks after it */
+        uint32_t first = get_u32(rsp + 4);
+        int nb_bits = (nb - 8) * 8;
+        if (first < from || (nb_bits == 0 && first < nb_chunks))
+            return -1;
+
+        for (int i = 0; i < nb_bits && first + i < nb_chunks; i++) {
+            if (!(rsp[8 + i / 8] & (1 << (i % 8)))) {
+                uint32_t seq = first + i;
+                gaps[seq >> 3] |= 1 << (seq & 7);
+                missing++;
+            }
+        }
+
+        from = first + nb_bits;
+    }
+
+    return missing;
+}
+
+static int master_data(struct filetrans_master *master, FILE *fp, uint32_t file_size, uint32_t seq, int ack)
+{
+    uint8_t *req = master_request(master, TRANS_FILE_CMD_DATA);
+    off_t offset = (off_t)seq * master->chunk_size;
+    int len = master->chunk_size;
+    int flag = ack ? FILETRANS_FLAG_ACK : 0;
+
+    if (offset + len > (off_t)file_size)
+        len = file_size - offset;
+
+    /* The chunk is read into the frame, or compressed into it when that makes it smaller */
+    uint8_t *chunk = (master->options & FILETRANS_OPTION_LZ) ? master->chunk_buf : req + 5;
+    if (fseeko(fp, offset, SEEK_SET) != 0 || (int)fread(chunk, 1, len, fp) != len) {
+        LOG_W("read chunk %u error.", seq);
+        return -1;
+    }
+
+    if (chunk != req + 5) {
+        int lz_len = lz_compress(chunk, len, req + 5, len - 1);
+        if (lz_len > 0) {
+            len = lz_len;
+            flag |= FILETRANS_FLAG_LZ;
+        } else {
+            memcpy(req + 5, chunk, len);
+        }
+    }
+
+    put_u32(req, seq);
+    req[4] = flag;
+    master->stat.bytes += len;
+
+    return master_send(master, 5 + len) < 0 ? -1 : 0;
+}
+
+/* Wait for the ack of the window at `base`, asking again for a lost one */
+static int master_ack(struct filetrans_master *master, uint32_t base, uint32_t *next, uint32_t *bitmap)
+{
+    for (int i = 0; i <= master->retries; i++) {
+        if (i > 0) {
+            master->stat.polls++;
+            master_flush(master);
+            master_request(master, TRANS_FILE_CMD_ACK);
+            if (master_send(master, 0) < 0)
+                return -1;
+        }
+
+        /* Either the ack of the last chunk or the answer to a poll, an ack of an earlier window is stale */
+        int cmd = 0, nb = 0;
+        const uint8_t *rsp = master_response(master, &cmd, &nb);
+        if (rsp == NULL || (cmd != TRANS_FILE_CMD_DATA && cmd != TRANS_FILE_CMD_ACK) || nb < 8)
+            continue;
+        if (get_u32(rsp) < base)
+            continue;
+
+        *next = get_u32(rsp);
+        *bitmap = get_u32(rsp + 4);
+        master->stat.acks++;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+void filetrans_master_init(struct filetrans_master *master, int fd, int slave)
+{
+    memset(master, 0, sizeof(struct filetrans_master));
+    master->fd = fd;
+    master->slave = slave;
+    master->chunk_size = FILETRANS_CHUNK_MAX;
+    master->window = FILETRANS_WINDOW_DEFAULT;
+    master->timeout = 1000;
+    master->retries = 3;
+
+    agile_modbus_t *ctx = &master->ctx_rtu._ctx;
+    agile_modbus_rtu_init(&master->ctx_rtu, master->send_buf, sizeof(master->send_buf), master->read_buf,
+                          sizeof(master->read_buf));
+    agile_modbus_set_slave(ctx, slave);
+    agile_modbus_set_compute_meta_length_after_function_cb(ctx, filetrans_compute_meta_length);
+    agile_modbus_set_compute_data_length_after_meta_cb(ctx, filetrans_compute_data_length);
+}
+
+/* Open the file to send, with its size and its CRC32 by which a slave tells whether it can resume */
+static FILE *master_open(struct filetrans_master *master, const char *path, uint32_t *file_size, uint32_t *file_crc)
+{
+    struct stat s;
+    if (stat(path, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size > UINT32_MAX)
+        return NULL;
+
+    *file_size = s.st_size;
+
+    if (master->chunk_size <= 0 || master->chunk_size > FILETRANS_CHUNK_MAX)
+        master->chunk_size = FILETRANS_CHUNK_MAX;
+    if (master->window <= 0 || master->window > FILETRANS_WINDOW_MAX)
+        master->window = FILETRANS_WINDOW_DEFAULT;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    uint32_t crc = 0;
+    size_t len;
+    while ((len = fread(master->chunk_buf, 1, sizeof(master->chunk_buf), fp)) > 0)
+        crc = crc32_update(crc, master->chunk_buf, len);
+
+    if (ferror(fp)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    *file_crc = crc;
+
+    return fp;
+}
+
+/* Whether the slave has chunk `seq`: acked in `bitmap` after `base`, or not in the `gaps` it reported on resume */
+static int master_held(const uint8_t *gaps, uint32_t base, uint32_t bitmap, uint32_t seq)
+{
+    if (seq > base && seq - base - 1 < 32 && (bitmap & (1UL << (seq - base - 1))))
+        return 1;
+
+    return gaps && !map_test(gaps, seq);
+}
+
+/* Send the file at `path` to be stored as `name`, return 0 once the slave has all of it */
+int filetrans_master_send(struct filetrans_master *master, const char *path, const char *name)
+{
+    uint32_t file_size = 0, file_crc = 0;
+    FILE *fp = master_open(master, path, &file_size, &file_crc);
+    if (fp == NULL)
+        return -1;
+
+    int ret = -1;
+    uint8_t *gaps = NULL;
+    uint32_t held = 0;
+    if (master_start(master, file_size, file_crc, name, &held) < 0) {
+        LOG_W("start failed.");
+        goto _exit;
+    }
+
+    uint32_t nb_chunks = ((uint64_t)file_size + master->chunk_size - 1) / master->chunk_size;
+    uint32_t base = 0;
+    uint32_t bitmap = 0;
+    uint32_t sent = 0;
+    int stalls = 0;
+
+    LOG_I("chunk size %d, window %d, options 0x%02X, %u chunks.", master->chunk_size, master->window, master->options,
+          nb_chunks);
+
+    /* The slave kept chunks of an interrupted transfer, go on from its gaps */
+    if (held > 0) {
+        gaps = calloc(1, nb_chunks / 8 + 1);
+        if (gaps == NULL)
+            goto _exit;
+
+        int missing = master_missing(master, nb_chunks, gaps);
+        if (missing < 0) {
+            LOG_W("slave doesn't report its gaps.");
+            goto _exit;
+        }
+
+        while (base < nb_chunks && !map_test(gaps, base))
+            base++;
+
+        master->stat.resumed = nb_chunks - missing;
+        LOG_I("resume with %d chunks missing.", missing);
+    }
+
+    while (base < nb_chunks) {
+        uint32_t end = base + master->window;
+        if (end > nb_chunks)
+            end = nb_chunks;
+
+        /* The last chunk still missing in the window carries the ack request */
+        uint32_t last = base;
+        for (uint32_t seq = base + 1; seq < end; seq++) {
+            if (!master_held(gaps, base, bitmap, seq))
+                last = seq;
+        }
+
+        master_flush(master);
+        for (uint32_t seq = base; seq <= last; seq++) {
+            if (seq != base && master_held(gaps, base, bitmap, seq))
+                continue;
+
+            if (master_data(master, fp, file_size, seq, seq == last) < 0)
+                goto _exit;
+
+            master->stat.chunks++;
+            if (seq < sent)
+                master->stat.retransmits++;
+            else
+                sent = seq + 1;
+        }
+
+        uint32_t next = 0;
+        uint32_t acked = bitmap;
+        if (master_ack(master, base, &next, &bitmap) < 0) {
+            LOG_W("no ack for chunks %u ~ %u.", base, last);
+            goto _exit;
+        }
+
+        if (next > nb_chunks) {
+            LOG_W("ack of chunk %u out of window %u.", next, base);
+            goto _exit;
+        }
+
+        /* Give up on a slave that acks window after window without taking a chunk */
+        if (next > base || (bitmap & ~acked))
+            stalls = 0;
+        else if (++stalls > master->retries) {
+            LOG_W("slave doesn't take chunk %u.", base);
+            goto _exit;
+        }
+
+        base = next;
+
+        if (master->progress && file_size > 0) {
+            uint64_t done = (uint64_t)base * master->chunk_size;
+            master->progress(done < file_size ? done : file_size, file_size);
+        }
+    }
+
+    ret = 0;
+
+_exit:
+    free(gaps);
+    fclose(fp);
+
+    return ret;
+}
+
+/*
+ * Broadcast the file at `path` to the slaves of `targets`, to be stored as
+ * `name`. Return the number of targets that have the whole file, the state
+ * of each tells which.
+ */
+int filetrans_master_broadcast(struct filetrans_master *master, struct filetrans_target *targets, int nb_targets,
+                               const char *path, const char *name)
+{
+    uint32_t file_size = 0, file_crc = 0;
+    FILE *fp = master_open(master, path, &file_size, &file_crc);
+    if (fp == NULL)
+        return -1;
+
+    int slave = master->slave;
+    int chunk_size = master->chunk_size;
+    int window = master->window;
+    int chunk_min = chunk_size;
+    int options = master->options;
+    int options_all = options;
+    int fresh = 0;
+
+    /*
+     * Each slave is started on its own, those that took more than the smallest
+     * chunk size are started again. A slave resuming keeps the chunk size of its
+     * state at the first pass, so it isn't started again when the others agree.
+     */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nb_targets; i++) {
+            struct filetrans_target *target = &targets[i];
+            if (pass == 0) {
+                target->state = FILETRANS_TARGET_PENDING;
+                target->chunk_size = 0;
+                target->missing = 0;
+            } else if (target->state != FILETRANS_TARGET_PENDING || target->chunk_size == chunk_min) {
+                continue;
+            }
+
+            master->slave = target->slave;
+            master->chunk_size = pass ? chunk_min : chunk_size;
+            master->window = window;
+            master->options = options;
+            uint32_t held = 0;
+            if (master_start(master, file_size, file_crc, name, &held) < 0) {
+                LOG_W("slave %d doesn't start.", target->slave);
+                target->state = FILETRANS_TARGET_FAILED;
+                continue;
+            }
+
+            if (held == 0)
+                fresh = 1;
+            options_all &= master->options;
+
+            target->chunk_size = master->chunk_size;
+            if (target->chunk_size < chunk_min)
+                chunk_min = target->chunk_size;
+        }
+    }
+
+    /* Options only every slave took */
+    master->chunk_size = chunk_min;
+    master->options = options_all;
+
+    uint32_t nb_chunks = ((uint64_t)file_size + chunk_min - 1) / chunk_min;
+    uint8_t *gaps = malloc(nb_chunks / 8 + 1);
+    if (gaps == NULL) {
+        fclose(fp);
+        master->slave = slave;
+        return -1;
+    }
+    memset(gaps, 0xFF, nb_chunks / 8 + 1);
+
+    LOG_I("chunk size %d, options 0x%02X, %u chunks, %d slaves.", chunk_min, options_all, nb_chunks, nb_targets);
+
+    /* Every slave resumes an interrupted transfer, the first round only carries what they miss */
+    if (!fresh) {
+        memset(gaps, 0, nb_chunks / 8 + 1);
+        for (int i = 0; i < nb_targets; i++) {
+            struct filetrans_target *target = &targets[i];
+            if (target->state != FILETRANS_TARGET_PENDING)
+                continue;
+
+            master->slave = target->slave;
+            int rc = master_missing(master, nb_chunks, gaps);
+            if (rc < 0) {
+                LOG_W("slave %d doesn't report its gaps.", target->slave);
+                target->state = FILETRANS_TARGET_FAILED;
+                continue;
+            }
+
+            target->missing = rc;
+            if (rc == 0)
+                target->state = FILETRANS_TARGET_DONE;
+        }
+    }
+
+    /* Broadcast the chunks still missing somewhere, then gather the gaps of every slave */
+    uint32_t missing_last = UINT32_MAX;
+    int stalls = 0;
+    for (int round = 0;; round++) {
+        master->slave = AGILE_MODBUS_BROADCAST_ADDRESS;
+        master_flush(master);
+        for (uint32_t seq = 0; seq < nb_chunks; seq++) {
+            if (!(gaps[seq >> 3] & (1 << (seq & 7))))
+                continue;
+
+            if (master_data(master, fp, file_size, seq, 0) < 0)
+                goto _exit;
+
+            master->stat.chunks++;
+            if (round > 0)
+                master->stat.retransmits++;
+            else if (master->progress)
+                master->progress(seq + 1 < nb_chunks ? (uint64_t)(seq + 1) * chunk_min : file_size, file_size);
+        }
+
+        memset(gaps, 0, nb_chunks / 8 + 1);
+
+        uint32_t missing = 0;
+        int pending = 0;
+        for (int i = 0; i < nb_targets; i++) {
+            struct filetrans_target *target = &targets[i];
+            if (target->state != FILETRANS_TARGET_PENDING)
+                continue;
+
+            master->slave = target->slave;
+            int rc = master_missing(master, nb_chunks, gaps);
+            if (rc < 0) {
+                LOG_W("slave %d doesn't report its gaps.", target->slave);
+                target->state = FILETRANS_TARGET_FAILED;
+                continue;
+            }
+
+            target->missing = rc;
+            if (rc == 0) {
+                target->state = FILETRANS_TARGET_DONE;
+                continue;
+            }
+
+            missing += rc;
+            pending++;
+        }
+
+        if (pending == 0)
+            break;
+
+        LOG_I("round %d: %u chunks missing on %d slaves.", round, missing, pending);
+
+        /* Give up on a line that stays as bad as it is */
+        if (missing < missing_last)
+            stalls = 0;
+        else if (++stalls > master->retries)
+            break;
+        missing_last = missing;
+    }
+
+_exit:
+    free(gaps);
+    fclose(fp);
+    master->slave = slave;
+
+    int done = 0;
+    for (int i = 0; i < nb_targets; i++) {
+        if (targets[i].state == FILETRANS_TARGET_DONE)
+            done++;
+    }
+
+    return done;
+}
+
+/* Whether chunks can still be written, the file stays open until the transfer completes */
+static int slave_writable(struct filetrans_slave *slave)
+{
+    return slave->map && (slave->fp || slave->received == slave->nb_chunks);
+}
+
+/* Ack of the DATA and ACK commands */
+static int slave_ack(struct filetrans_slave *slave, uint8_t *rsp)
+{
+    uint32_t bitmap = 0;
+
+    for (int i = 0; i < 32 && slave->next + 1 + i < slave->nb_chunks; i++) {
+        if (map_test(slave->map, slave->next + 1 + i))
+            bitmap |= 1UL << i;
+    }
+
+    put_u32(rsp, slave->next);
+    put_u32(rsp + 4, bitmap);
+
+    return 8;
+}
+
+static void slave_close(struct filetrans_slave *slave)
+{
+    if (slave->fp) {
+        fclose(slave->fp);
+        slave->fp = NULL;
+    }
+
+    if (slave->state) {
+        fclose(slave->state);
+        slave->state = NULL;
+    }
+}
+
+/* The file is complete, its state goes */
+static void slave_finish(struct filetrans_slave *slave)
+{
+    slave_close(slave);
+    remove(slave->state_name);
+    LOG_I("success.");
+}
+
+/*
+ * State file: magic, file size, file CRC32 and chunk size (4 bytes each),
+ * then the CRC32 of each chunk and the map of written chunks.
+ */
+#define STATE_MAGIC       0x46545331
+#define STATE_HEADER_SIZE 16
+
+static off_t state_map_offset(struct filetrans_slave *slave)
+{
+    return STATE_HEADER_SIZE + (off_t)slave->nb_chunks * 4;
+}
+
+static int slave_state_create(struct filetrans_slave *slave)
+{
+    uint8_t buf[256] = {0};
+
+    slave->state = fopen(slave->state_name, "wb+");
+    if (slave->state == NULL)
+        return -1;
+
+    put_u32(buf, STATE_MAGIC);
+    put_u32(buf + 4, slave->file_size);
+    put_u32(buf + 8, slave->file_crc);
+    put_u32(buf + 12, slave->chunk_size);
+    if (fwrite(buf, 1, STATE_HEADER_SIZE, slave->state) != STATE_HEADER_SIZE)
+        return -1;
+
+    memset(buf, 0, STATE_HEADER_SIZE);
+    off_t left = state_map_offset(slave) - STATE_HEADER_SIZE + slave->nb_chunks / 8 + 1;
+    while (left > 0) {
+        size_t len = left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf);
+        if (fwrite(buf, 1, len, slave->state) != len)
+            return -1;
+        left -= len;
+    }
+
+    return fflush(slave->state);
+}
+
+/* Record chunk `seq` as written, after its data */
+static int slave_state_update(struct filetrans_slave *slave, uint32_t seq, uint32_t crc)
+{
+    uint8_t buf[4];
+
+    if (fflush(slave->fp) != 0)
+        return -1;
+
+    put_u32(buf, crc);
+    if (fseeko(slave->state, STATE_HEADER_SIZE + (off_t)seq * 4, SEEK_SET) != 0 || fwrite(buf, 1, 4, slave->state) != 4)
+        return -1;
+
+    if (fseeko(slave->state, state_map_offset(slave) + (seq >> 3), SEEK_SET) != 0 ||
+        fwrite(&slave->map[seq >> 3], 1, 1, slave->state) != 1)
+        return -1;
+
+    return fflush(slave->state);
+}
+
+/*
+ * Take up an interrupted transfer of the same file from its state: keep the
+ * chunks whose data still has the CRC recorded. Return -1 when there is
+ * nothing to resume.
+ */
+static int slave_resume(struct filetrans_slave *slave, const char *file_name)
+{
+    uint8_t header[STATE_HEADER_SIZE];
+    uint8_t *crcs = NULL;
+    uint8_t *chunk = NULL;
+    size_t map_size = slave->nb_chunks / 8 + 1;
+
+    slave->state = fopen(slave->state_name, "r+b");
+    if (slave->state == NULL)
+        return -1;
+
+    if (fread(header, 1, STATE_HEADER_SIZE, slave->state) != STATE_HEADER_SIZE || get_u32(header) != STATE_MAGIC ||
+        get_u32(header + 4) != slave->file_size || get_u32(header + 8) != slave->file_crc ||
+        get_u32(header + 12) != (uint32_t)slave->chunk_size)
+        goto _fail;
+
+    crcs = malloc((size_t)slave->nb_chunks * 4);
+    chunk = malloc(slave->chunk_size);
+    if (crcs == NULL || chunk == NULL)
+        goto _fail;
+
+    if (fread(crcs, 4, slave->nb_chunks, slave->state) != slave->nb_chunks ||
+        fread(slave->map, 1, map_size, slave->state) != map_size)
+        goto _fail;
+
+    slave->fp = fopen(file_name, "r+b");
+    if (slave->fp == NULL)
+        goto _fail;
+
+    /* A chunk marked before its data reached the disk reads back wrong and is sent again */
+    for (uint32_t seq = 0; seq < slave->nb_chunks; seq++) {
+        if (!map_test(slave->map, seq))
+            continue;
+
+        off_t offset = (off_t)seq * slave->chunk_size;
+        int len = slave->chunk_size;
+        if (offset + len > (off_t)slave->file_size)
+            len = slave->file_size - offset;
+
+        if (fseeko(slave->fp, offset, SEEK_SET) != 0 || (int)fread(chunk, 1, len, slave->fp) != len ||
+            crc32_update(0, chunk, len) != get_u32(crcs + seq * 4)) {
+            slave->map[seq >> 3] &= ~(1 << (seq & 7));
+            continue;
+        }
+
+        slave->received++;
+    }
+
+    while (slave->next < slave->nb_chunks && map_test(slave->map, slave->next))
+        slave->next++;
+
+    if (fseeko(slave->state, state_map_offset(slave), SEEK_SET) != 0 ||
+        fwrite(slave->map, 1, map_size, slave->state) != map_size || fflush(slave->state) != 0)
+        goto _fail;
+
+    free(crcs);
+    free(chunk);
+
+    return 0;
+
+_fail:
+    free(crcs);
+    free(chunk);
+    slave_close(slave);
+    memset(slave->map, 0, map_size);
+    slave->received = 0;
+    slave->next = 0;
+
+    return -1;
+}
+
+/* Chunk size of the interrupted transfer of the same file in the state, 0 when there is none */
+static int slave_state_chunk_size(struct filetrans_slave *slave, uint32_t file_size, uint32_t file_crc)
+{
+    uint8_t header[STATE_HEADER_SIZE];
+    int chunk_size = 0;
+
+    FILE *fp = fopen(slave->state_name, "rb");
+    if (fp == NULL)
+        return 0;
+
+    if (fread(header, 1, STATE_HEADER_SIZE, fp) == STATE_HEADER_SIZE && get_u32(header) == STATE_MAGIC &&
+        get_u32(header + 4) == file_size && get_u32(header + 8) == file_crc && get_u32(header + 12) <= FILETRANS_CHUNK_MAX)
+        chunk_size = get_u32(header + 12);
+
+    fclose(fp);
+
+    return chunk_size;
+}
+
+static int slave_start(struct filetrans_slave *slave, agile_modbus_t *ctx, const uint8_t *data, int len,
+                       uint8_t *rsp)
+{
+    if (len < 13 || memchr(data + 12, '\0', len - 12) == NULL) {
+        LOG_W("cmd start data_len must be greater than 12.");
+        return -1;
+    }
+
+    const char *file_name = (const char *)(data + 12);
+    if (strlen(file_name) >= 256 || strchr(file_name, '/')) {
+        LOG_W("file name must be less than 256 and without '/'.");
+        return -1;
+    }
+
+    if (slave->fp) {
+        LOG_W("transfer restarted before it completed.");
+        slave_close(slave);
+    }
+
+    /* A chunk has to fit the receive buffer in one frame */
+    int chunk_max = slave->frame_max - (ctx->backend->header_length + 1 + FILETRANS_DATA_META + ctx->backend->checksum_length);
+    int chunk_size = (data[4] << 8) + data[5];
+    int window = data[6];
+
+    if (chunk_size > chunk_max)
+        chunk_size = chunk_max;
+    if (window > FILETRANS_WINDOW_MAX)
+        window = FILETRANS_WINDOW_MAX;
+    if (chunk_size <= 0 || window <= 0) {
+        LOG_W("chunk size %d and window %d not acceptable.", chunk_size, window);
+        return -1;
+    }
+
+    uint32_t file_size = get_u32(data);
+    uint32_t file_crc = get_u32(data + 7);
+
+    char own_file_name[300];
+    snprintf(own_file_name, sizeof(own_file_name), "%d_%s", ctx->slave, file_name);
+    snprintf(slave->state_name, sizeof(slave->state_name), "%s" FILETRANS_STATE_SUFFIX, own_file_name);
+
+    /*
+     * Keep the chunk size of an interrupted transfer when it fits, so that a
+     * broadcast starting every slave with its largest one doesn't throw away
+     * what a slave wrote at the smaller size the others took.
+     */
+    int state_chunk_size = slave_state_chunk_size(slave, file_size, file_crc);
+    if (state_chunk_size > 0 && state_chunk_size < chunk_size)
+        chunk_size = state_chunk_size;
+
+    uint32_t nb_chunks = ((uint64_t)file_size + chunk_size - 1) / chunk_size;
+
+    int options = data[11] & slave->options;
+
+    /* Compressed chunks are decoded into a buffer of one chunk */
+    free(slave->chunk);
+    slave->chunk = NULL;
+    if (options & FILETRANS_OPTION_LZ) {
+        slave->chunk = malloc(chunk_size);
+        if (slave->chunk == NULL)
+            return -1;
+    }
+
+    free(slave->map);
+    slave->map = calloc(1, nb_chunks / 8 + 1);
+    if (slave->map == NULL)
+        return -1;
+
+    slave->file_size = file_size;
+    slave->file_crc = file_crc;
+    slave->chunk_size = chunk_size;
+    slave->window = window;
+    slave->nb_chunks = nb_chunks;
+    slave->next = 0;
+    slave->received = 0;
+
+    if (nb_chunks > 0 && slave_resume(slave, own_file_name) == 0) {
+        LOG_I("resume %s, %u of %u chunks written, chunk size %d, window %d", own_file_name, slave->received,
+              nb_chunks, chunk_size, window);
+    } else {
+        slave->fp = fopen(own_file_name, "wb");
+        if (slave->fp == NULL) {
+            LOG_W("open file %s error.", own_file_name);
+            return -1;
+        }
+
+        if (nb_chunks > 0 && slave_state_create(slave) < 0) {
+            LOG_W("create %s error.", slave->state_name);
+            slave_close(slave);
+            return -1;
+        }
+
+        LOG_I("write to %s, file size is %u, chunk size %d, window %d", own_file_name, file_size, chunk_size, window);
+    }
+
+    if (slave->received == nb_chunks)
+        slave_finish(slave);
+
+    rsp[0] = chunk_size >> 8;
+    rsp[1] = chunk_size & 0xFF;
+    rsp[2] = window;
+    put_u32(rsp + 3, slave->received);
+    rsp[7] = options;
+
+    return 8;
+}
+
+static int slave_data(struct filetrans_slave *slave, const uint8_t *data, int len)
+{
+    if (len < 5)
+        return -1;
+
+    uint32_t seq = get_u32(data);
+    const uint8_t *chunk = data + 5;
+    int chunk_len = len - 5;
+
+    /* Broadcasts reach slaves outside of the transfer too */
+    if (slave->map == NULL)
+        return -1;
+
+    if (seq >= slave->nb_chunks) {
+        LOG_W("chunk %u out of transfer.", seq);
+        return -1;
+    }
+
+    /* A transfer that failed to write is not acked any more */
+    if (!slave_writable(slave))
+        return -1;
+
+    /* Chunks come again when an ack got lost, also after the transfer completed */
+    if (map_test(slave->map, seq))
+        return 0;
+
+    off_t offset = (off_t)seq * slave->chunk_size;
+    int expected = slave->chunk_size;
+    if (offset + expected > (off_t)slave->file_size)
+        expected = slave->file_size - offset;
+
+    if (data[4] & FILETRANS_FLAG_LZ) {
+        if (slave->chunk == NULL) {
+            LOG_W("chunk %u compressed without the option.", seq);
+            return -1;
+        }
+
+        chunk_len = lz_decompress(chunk, chunk_len, slave->chunk, slave->chunk_size);
+        if (chunk_len < 0) {
+            LOG_W("chunk %u doesn't decompress.", seq);
+            return -1;
+        }
+        chunk = slave->chunk;
+    }
+
+    if (chunk_len != expected) {
+        LOG_W("chunk %u has %d bytes, not %d.", seq, chunk_len, expected);
+        return -1;
+    }
+
+    if (fseeko(slave->fp, offset, SEEK_SET) != 0 || fwrite(chunk, 1, chunk_len, slave->fp) != (size_t)chunk_len) {
+        LOG_W("write to file error.");
+        slave_close(slave);
+        return -1;
+    }
+
+    slave->map[seq >> 3] |= 1 << (seq & 7);
+    if (slave_state_update(slave, seq, crc32_update(0, chunk, chunk_len)) < 0) {
+        LOG_W("write to %s error.", slave->state_name);
+        slave->map[seq >> 3] &= ~(1 << (seq & 7));
+        slave_close(slave);
+        return -1;
+    }
+
+    slave->received++;
+    while (slave->next < slave->nb_chunks && map_test(slave->map, slave->next))
+        slave->next++;
+
+    if (slave->progress) {
+        uint64_t done = (uint64_t)slave->received * slave->chunk_size;
+        slave->progress(done < slave->file_size ? done : slave->file_size, slave->file_size);
+    }
+
+    if (slave->received == slave->nb_chunks)
+        slave_finish(slave);
+
+    return 0;
+}
+
+/* Chunks written from `from` on: next + first + as much of the map from first as fits in `rsp_max` */
+static int slave_missing(struct filetrans_slave *slave, const uint8_t *data, int len, uint8_t *rsp, int rsp_max)
+{
+    if (len < 4 || !slave_writable(slave) || rsp_max < 9)
+        return -1;
+
+    uint32_t first = get_u32(data);
+    if (first < slave->next)
+        first = slave->next;
+
+    int nb = 0;
+    while (nb < rsp_max - 8 && first + nb * 8 < slave->nb_chunks) {
+        uint8_t bits = 0;
+        for (int i = 0; i < 8; i++) {
+            uint32_t seq = first + nb * 8 + i;
+            if (seq >= slave->nb_chunks || map_test(slave->map, seq))
+                bits |= 1 << i;
+        }
+        rsp[8 + nb++] = bits;
+    }
+
+    put_u32(rsp, slave->next);
+    put_u32(rsp + 4, first);
+
+    return 8 + nb;
+}
+
+void filetrans_slave_init(struct filetrans_slave *slave, int frame_max)
+{
+    memset(slave, 0, sizeof(struct filetrans_slave));
+    slave->frame_max = frame_max;
+    slave->options = FILETRANS_OPTION_LZ;
+}
+
+void filetrans_slave_deinit(struct filetrans_slave *slave)
+{
+    slave_close(slave);
+    free(slave->map);
+    slave->map = NULL;
+    free(slave->chunk);
+    slave->chunk = NULL;
+}
+
+/*
+ * Serve a 0x50 request from the slave callback: return 0 with the response
+ * in the send buffer, or -AGILE_MODBUS_EXCEPTION_UNKNOW when there is none.
+ */
+int filetrans_slave_handle(struct filetrans_slave *slave, agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info)
+{
+    const uint8_t *data_ptr = slave_info->buf;
+    int send_index = slave_info->send_index;
+
+    if (slave_info->nb < 4)
+        return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    int cmd = (data_ptr[0] << 8) + data_ptr[1];
+    int cmd_data_len = (data_ptr[2] << 8) + data_ptr[3];
+    const uint8_t *cmd_data_ptr = data_ptr + 4;
+
+    if (cmd_data_len > slave_info->nb - 4)
+        return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    /* Room for the response data behind command, status and number of bytes */
+    int rsp_max = ctx->send_bufsz - send_index - 4 - ctx->backend->checksum_length;
+    if (rsp_max > 255)
+        rsp_max = 255;
+    if (rsp_max < 8)
+        return -AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+
+    uint8_t *rsp = ctx->send_buf + send_index + 4;
+    int rsp_len = 0;
+    int reply = 1;
+
+    switch (cmd) {
+    case TRANS_FILE_CMD_START:
+        rsp_len = slave_start(slave, ctx, cmd_data_ptr, cmd_data_len, rsp);
+        break;
+
+    case TRANS_FILE_CMD_DATA:
+        reply = cmd_data_len >= 5 && (cmd_data_ptr[4] & FILETRANS_FLAG_ACK);
+        rsp_len = slave_data(slave, cmd_data_ptr, cmd_data_len);
+        if (rsp_len == 0)
+            rsp_len = slave_ack(slave, rsp);
+        break;
+
+    case TRANS_FILE_CMD_ACK:
+        rsp_len = slave_writable(slave) ? slave_ack(slave, rsp) : -1;
+        break;
+
+    case TRANS_FILE_CMD_MISSING:
+        rsp_len = slave_missing(slave, cmd_data_ptr, cmd_data_len, rsp, rsp_max);
+        break;
+
+    default:
+        rsp_len = -1;
+        break;
+    }
+
+    if (!reply)
+        return -AGILE_MODBUS_EXCEPTION_UNKNOW;
+
+    if (rsp_len < 0)
+        rsp_len = 0;
+
+    ctx->send_buf[send_index++] = data_ptr[0];
+    ctx->send_buf[send_index++] = data_ptr[1];
+    ctx->send_buf[send_index++] = (rsp_len > 0) ? FILETRANS_STATUS_SUCCESS : FILETRANS_STATUS_FAILURE;
+    ctx->send_buf[send_index++] = rsp_len;
+    send_index += rsp_len;
+    *(slave_info->rsp_length) = send_index;
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+#ifndef __FILETRANS_H
+#define __FILETRANS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "agile_modbus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * File transfer over the private function code 0x50.
+ *
+ * The file is cut into chunks numbered from 0, every chunk but the last one
+ * `chunk_size` bytes long. START negotiates the chunk size down to what the
+ * slave's receive buffer holds in one frame, and the window, the number of
+ * chunks the master may send before it needs an acknowledgement.
+ *
+ * The master sends the chunks of a window back to back and asks for an ack
+ * with the last one only, so the line is busy with data and turns around
+ * once per window. The ack is cumulative, every chunk before `next` was
+ * written, and selective, a bitmap of the chunks after `next` that came in
+ * already, so only the chunks that were lost are sent again. When the ack
+ * itself is lost the master asks for it again with ACK instead of sending
+ * the data once more.
+ *
+ * Chunks are written at their offset, in whatever order they come in; the
+ * transfer is complete when the slave has every chunk.
+ *
+ * The slave keeps the map of written chunks and the CRC32 of each of them
+ * in a state file next to the one it writes, so an interrupted transfer
+ * resumes. START carries the CRC32 of the whole file: when the state file
+ * is of the same file and size, START takes its chunk size unless the one
+ * proposed is smaller, the chunks it lists are read back and those whose
+ * CRC no longer matches are dropped, and START answers with the number of
+ * chunks the slave still has. The master then asks for the gaps with
+ * MISSING and sends only those.
+ *
+ * START also agrees on options. With FILETRANS_OPTION_LZ the master may
+ * send a chunk compressed, alone, in the LZ4 block format, and marks it
+ * with FILETRANS_FLAG_LZ; a chunk that doesn't get smaller goes as it is.
+ * Chunks stay independent, for the slave to decode each one into a buffer
+ * of one chunk, and for repair and resume to work as before.
+ *
+ * To update many slaves on one line, `filetrans_master_broadcast` starts
+ * each of them, broadcasts every chunk once without acks and then asks each
+ * slave with MISSING for a map of the chunks it doesn't have. Only the
+ * union of those gaps is broadcast again, round after round, so the line
+ * carries about one copy of the file whatever the number of slaves.
+ *
+ * Request data:  command (2) + number of bytes (2) + data
+ * Response data: command (2) + status (1) + number of bytes (1) + data
+ *
+ * | Command | Request data                                        | Response data       |
+ * | START   | file size (4) + chunk size (2) + window (1) +       | chunk size + window |
+ * |         | file CRC32 (4) + options (1) + name                 | + chunks held (4) + |
+ * |         |                                                     | options (1)         |
+ * | DATA    | sequence (4) + flag (1) + chunk                     | next + bitmap       |
+ * | ACK     | -                                                   | next + bitmap       |
+ * | MISSING | from (4)                                            | next + first + map  |
+ *
+ * DATA gets a response only with FILETRANS_FLAG_ACK set. Bit i of `bitmap`
+ * is chunk next + 1 + i, bit i of `map` chunk first + i, set when written.
+ * `first` is `from` or `next` if greater, every chunk before it is written.
+ * Once the slave fails to write, DATA, ACK and MISSING get a failure until
+ * the next START.
+ */
+#define AGILE_MODBUS_FC_TRANS_FILE 0x50
+#define TRANS_FILE_CMD_START       0x0001
+#define TRANS_FILE_CMD_DATA        0x0002
+#define TRANS_FILE_CMD_ACK         0x0003
+#define TRANS_FILE_CMD_MISSING     0x0004
+
+#define FILETRANS_FLAG_ACK 0x01
+#define FILETRANS_FLAG_LZ  0x02
+
+#define FILETRANS_OPTION_LZ 0x01
+
+#define FILETRANS_STATUS_FAILURE 0x00
+#define FILETRANS_STATUS_SUCCESS 0x01
+
+/* Command, number of bytes, sequence and flag in front of a chunk */
+#define FILETRANS_DATA_META 9
+
+#define FILETRANS_CHUNK_MAX      4096
+#define FILETRANS_WINDOW_MAX     32
+#define FILETRANS_WINDOW_DEFAULT 8
+
+/* Frame of a full chunk on the RTU backend, slave address + function + CRC */
+#define FILETRANS_ADU_MAX (1 + 1 + FILETRANS_DATA_META + FILETRANS_CHUNK_MAX + 2)
+
+/* Largest response: a MISSING map of 247 bytes */
+#define FILETRANS_RSP_MAX (1 + 1 + 4 + 255 + 2)
+
+#define FILETRANS_TARGET_PENDING 0
+#define FILETRANS_TARGET_DONE    1
+#define FILETRANS_TARGET_FAILED  -1
+
+/* Appended to the name of the file a slave writes while the transfer is not complete */
+#define FILETRANS_STATE_SUFFIX ".part"
+
+typedef void (*filetrans_progress_t)(size_t cur_size, size_t total_size);
+
+struct filetrans_stat {
+    uint32_t chunks;
+    uint32_t retransmits;
+    uint32_t acks;
+    uint32_t polls;
+    uint32_t resumed;
+    uint32_t bytes;
+};
+
+/*
+ * `chunk_size`, `window` and `options` are proposals, START leaves what was
+ * agreed on. Requests are built in `send_buf` in place, `chunk_buf` holds a
+ * chunk on its way to be compressed.
+ */
+struct filetrans_master {
+    int fd;
+    int slave;
+    int chunk_size;
+    int window;
+    int options;
+    int timeout;
+    int retries;
+    filetrans_progress_t progress;
+    struct filetrans_stat stat;
+
+    agile_modbus_rtu_t ctx_rtu;
+    uint8_t send_buf[FILETRANS_ADU_MAX];
+    uint8_t read_buf[FILETRANS_RSP_MAX];
+    uint8_t chunk_buf[FILETRANS_CHUNK_MAX];
+};
+
+/* A slave of a broadcast, the chunk size it took and the number of chunks it missed at the last round */
+struct filetrans_target {
+    int slave;
+    int state;
+    int chunk_size;
+    uint32_t missing;
+};
+
+/* `next` is the first chunk missing, bit n of `map` is set when chunk n is written, `options` those it takes */
+struct filetrans_slave {
+    FILE *fp;
+    FILE *state;
+    char state_name[320];
+    int frame_max;
+    uint32_t file_size;
+    uint32_t file_crc;
+    uint32_t nb_chunks;
+    int chunk_size;
+    int window;
+    int options;
+    uint8_t *chunk;
+    uint32_t next;
+    uint32_t received;
+    uint8_t *map;
+    filetrans_progress_t progress;
+};
+
+uint8_t filetrans_compute_meta_length(agile_modbus_t *ctx, int function, agile_modbus_msg_type_t msg_type);
+int filetrans_compute_data_length(agile_modbus_t *ctx, uint8_t *msg, int msg_length, agile_modbus_msg_type_t msg_type);
+
+void filetrans_master_init(struct filetrans_master *master, int fd, int slave);
+int filetrans_master_send(struct filetrans_master *master, const char *path, const char *name);
+int filetrans_master_broadcast(struct filetrans_master *master, struct filetrans_target *targets, int nb_targets,
+                               const char *path, const char *name);
+
+void filetrans_slave_init(struct filetrans_slave *slave, int frame_max);
+void filetrans_slave_deinit(struct filetrans_slave *slave);
+int filetrans_slave_handle(struct filetrans_slave *slave, agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+#include "lz.h"
+#include <string.h>
+
+#define LZ_HASH_BITS     12
+#define LZ_MIN_MATCH     4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT      12
+#define LZ_MAX_OFFSET    65535
+
+static uint32_t read_u32(const uint8_t *ptr)
+{
+    uint32_t value;
+
+    memcpy(&value, ptr, 4);
+
+    return value;
+}
+
+static int lz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length beyond the 15 of a nibble, in bytes of 255 and what is left */
+static int put_length(uint8_t *dst, int len)
+{
+    int op = 0;
+
+    for (len -= 15; len >= 255; len -= 255)
+        dst[op++] = 255;
+    dst[op++] = len;
+
+    return op;
+}
+
+/* Literals and, with an offset, the match after them. Return the new output length, -1 when it doesn't fit */
+static int put_sequence(uint8_t *dst, int op, int dst_max, const uint8_t *literals, int nb_literals, int offset,
+                        int match_len)
+{
+    int ml = match_len - LZ_MIN_MATCH;
+
+    if (op + 1 + nb_literals + nb_literals / 255 + 1 + (offset ? 2 + ml / 255 + 1 : 0) > dst_max)
+        return -1;
+
+    uint8_t *token = &dst[op++];
+    *token = (nb_literals < 15 ? nb_literals : 15) << 4;
+    if (nb_literals >= 15)
+        op += put_length(dst + op, nb_literals);
+
+    memcpy(dst + op, literals, nb_literals);
+    op += nb_literals;
+
+    if (offset) {
+        dst[op++] = offset & 0xFF;
+        dst[op++] = offset >> 8;
+        *token |= ml < 15 ? ml : 15;
+        if (ml >= 15)
+            op += put_length(dst + op, ml);
+    }
+
+    return op;
+}
+
+/* Compress `src` into `dst`, return the length of the block or -1 when it doesn't fit in `dst_max` */
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    if (src_len < 0 || src_len > LZ_BLOCK_MAX)
+        return -1;
+
+    memset(table, 0, sizeof(table));
+
+    /* As the format wants, no match starts in the last 12 bytes nor reaches into the last 5 */
+    int limit = src_len - LZ_MF_LIMIT;
+    int match_limit = src_len - LZ_LAST_LITERALS;
+
+    while (ip < limit) {
+        uint32_t sequence = read_u32(src + ip);
+        int h = lz_hash(sequence);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read_u32(src + ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+
+        int len = LZ_MIN_MATCH;
+        while (ip + len < match_limit && src[ip + len] == src[ref + len])
+            len++;
+
+        op = put_sequence(dst, op, dst_max, src + anchor, ip - anchor, ip - ref, len);
+        if (op < 0)
+            return -1;
+
+        ip += len;
+        anchor = ip;
+
+        /* The end of a match is where the next one often starts from */
+        if (ip - 2 < limit)
+            table[lz_hash(read_u32(src + ip - 2))] = ip - 2;
+    }
+
+    return put_sequence(dst, op, dst_max, src + anchor, src_len - anchor, 0, 0);
+}
+
+static int get_length(const uint8_t *src, int src_len, int *ip, int *len)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip >= src_len)
+            return -1;
+        byte = src[(*ip)++];
+        *len += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+/* Decompress the block `src`, return the length of the data or -1 when the block is corrupt or `dst_max` too small */
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max)
+{
+    int ip = 0, op = 0;
+
+    while (ip < src_len) {
+        int token = src[ip++];
+
+        int len = token >> 4;
+        if (len == 15 && get_length(src, src_len, &ip, &len) < 0)
+            return -1;
+        if (len > src_len - ip || len > dst_max - op)
+            return -1;
+
+        memcpy(dst + op, src + ip, len);
+        ip += len;
+        op += len;
+
+        /* The last sequence ends with its literals */
+        if (ip == src_len)
+            break;
+
+        if (src_len - ip < 2)
+            return -1;
+        int offset = src[ip] + (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        len = token & 0x0F;
+        if (len == 15 && get_length(src, src_len, &ip, &len) < 0)
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (len > dst_max - op)
+            return -1;
+
+        /* Byte by byte, a match may overlap what it produces */
+        const uint8_t *match = dst + op - offset;
+        for (int i = 0; i < len; i++)
+            dst[op++] = match[i];
+    }
+
+    return op;
+}
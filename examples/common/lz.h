@@ -0,0 +1,34 @@
+#ifndef __LZ_H
+#define __LZ_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Block compression in the LZ4 block format, without dependencies.
+ *
+ * A block is a run of sequences, each a token (literal length in the high
+ * nibble, match length - 4 in the low one, 15 meaning more bytes of 255
+ * follow), the literals, then the match as a little endian offset (2) back
+ * into what was already decoded. The last sequence has literals only.
+ *
+ * The compressor keeps a 4096 entry hash table of 4 byte sequences on its
+ * stack. The decompressor needs no memory besides its output: it reads the
+ * block once, front to back, and copies matches out of what it wrote.
+ */
+#define LZ_BLOCK_MAX 65535
+
+/* Size of the output in the worst case, data that doesn't compress */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max);
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,786 @@
+#define _GNU_SOURCE
+#include "mbtcp_gateway.h"
+#include "serial.h"
+#include "rt_tick.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbtcp_gateway"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define MBTCP_MBAP_LENGTH 7
+
+struct mbtcp_gateway_txn {
+    rt_list_t list;
+    rt_list_t followers;
+    struct mbtcp_conn *conn;
+    uint16_t tid;
+    int prio;
+    uint64_t seq;
+    uint64_t time_submit;
+    int req_len;
+    uint8_t req[1 + AGILE_MODBUS_MAX_PDU_LENGTH];
+    int rsp_len;
+    uint8_t rsp[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+/* RTU ADU with its CRC in relay mode, MBAP frame otherwise */
+static int gateway_exception(struct mbtcp_gateway *gateway, uint8_t *buf, uint16_t tid, int unit, int function, int code)
+{
+    if (gateway->relay) {
+        buf[0] = unit;
+        buf[1] = function | 0x80;
+        buf[2] = code;
+
+        uint16_t crc = agile_modbus_rtu_crc16(buf, 3);
+        buf[3] = crc >> 8;
+        buf[4] = crc & 0xff;
+
+        return 5;
+    }
+
+    buf[0] = tid >> 8;
+    buf[1] = tid & 0xff;
+    buf[2] = 0;
+    buf[3] = 0;
+    buf[4] = 0;
+    buf[5] = 3;
+    buf[6] = unit;
+    buf[7] = function | 0x80;
+    buf[8] = code;
+
+    return 9;
+}
+
+static int gateway_priority(const uint8_t *pdu, int len)
+{
+    (void)len;
+
+    switch (pdu[0]) {
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+    case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
+    case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
+    case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+        return MBTCP_GATEWAY_PRIO_HIGH;
+    default:
+        break;
+    }
+
+    return MBTCP_GATEWAY_PRIO_LOW;
+}
+
+/* Put the client's transaction identifier on a shared response, relayed ADUs have none */
+static void gateway_set_tid(struct mbtcp_gateway *gateway, uint8_t *rsp, uint16_t tid)
+{
+    if (gateway->relay)
+        return;
+
+    rsp[0] = tid >> 8;
+    rsp[1] = tid & 0xff;
+}
+
+/* Reads are keyed on unit, function, address and count, which is the whole request but the CRC */
+static int txn_dedupable(struct mbtcp_gateway *gateway, const struct mbtcp_gateway_txn *txn)
+{
+    if (txn->req_len != MBTCP_GATEWAY_KEY_LENGTH + (gateway->relay ? 2 : 0) || txn->req[0] == 0)
+        return 0;
+
+    switch (txn->req[1]) {
+    case AGILE_MODBUS_FC_READ_COILS:
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        return 1;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static void txn_free(struct mbtcp_gateway_txn *txn)
+{
+    struct mbtcp_gateway_txn *follower, *n;
+
+    rt_list_for_each_entry_safe(follower, n, &txn->followers, list)
+    {
+        rt_list_remove(&follower->list);
+        free(follower);
+    }
+
+    free(txn);
+}
+
+/* Drop the followers of `txn` that belong to `conn` */
+static void txn_forget(struct mbtcp_gateway_txn *txn, struct mbtcp_conn *conn)
+{
+    struct mbtcp_gateway_txn *follower, *n;
+
+    rt_list_for_each_entry_safe(follower, n, &txn->followers, list)
+    {
+        if (follower->conn != conn)
+            continue;
+
+        rt_list_remove(&follower->list);
+        free(follower);
+    }
+}
+
+/* With the port locked: no write to the unit of `txn` was queued after it, its response is not older than one */
+static int port_fresh(struct mbtcp_gateway_port *port, const struct mbtcp_gateway_txn *txn)
+{
+    return txn->seq > port->write_seq[txn->req[0]];
+}
+
+/* With the port locked: find a queued or running request whose response `txn` can share */
+static struct mbtcp_gateway_txn *port_find(struct mbtcp_gateway_port *port, const struct mbtcp_gateway_txn *txn)
+{
+    struct mbtcp_gateway_txn *leader;
+
+    if (port->inflight && port->inflight->req_len == txn->req_len &&
+        memcmp(port->inflight->req, txn->req, MBTCP_GATEWAY_KEY_LENGTH) == 0 && port_fresh(port, port->inflight))
+        return port->inflight;
+
+    for (int prio = 0; prio < MBTCP_GATEWAY_PRIO_NUM; prio++) {
+        rt_list_for_each_entry(leader, &port->queues[prio], list)
+        {
+            if (leader->req_len == txn->req_len && memcmp(leader->req, txn->req, MBTCP_GATEWAY_KEY_LENGTH) == 0 &&
+                port_fresh(port, leader))
+                return leader;
+        }
+    }
+
+    return NULL;
+}
+
+/* With the port locked: copy a fresh cached response for `txn` into `buf`, return its length or 0 */
+static int port_cache_get(struct mbtcp_gateway_port *port, const struct mbtcp_gateway_txn *txn, uint8_t *buf)
+{
+    struct mbtcp_gateway *gateway = port->gateway;
+    uint64_t now = rt_tick_get_us();
+
+    for (int i = 0; i < MBTCP_GATEWAY_CACHE_SIZE; i++) {
+        struct mbtcp_gateway_cache *entry = &port->cache[i];
+
+        if (entry->len == 0 || memcmp(entry->key, txn->req, MBTCP_GATEWAY_KEY_LENGTH) != 0)
+            continue;
+
+        if (now - entry->time >= (uint64_t)gateway->dedup_ttl * 1000) {
+            entry->len = 0;
+            return 0;
+        }
+
+        memcpy(buf, entry->rsp, entry->len);
+        gateway_set_tid(gateway, buf, txn->tid);
+
+        return entry->len;
+    }
+
+    return 0;
+}
+
+/* With the port locked: keep a normal response, replacing the same key or else the oldest entry */
+static void port_cache_put(struct mbtcp_gateway_port *port, const struct mbtcp_gateway_txn *txn)
+{
+    struct mbtcp_gateway_cache *entry = &port->cache[0];
+
+    for (int i = 0; i < MBTCP_GATEWAY_CACHE_SIZE; i++) {
+        struct mbtcp_gateway_cache *e = &port->cache[i];
+
+        if (e->len > 0 && memcmp(e->key, txn->req, MBTCP_GATEWAY_KEY_LENGTH) == 0) {
+            entry = e;
+            break;
+        }
+
+        if (entry->len > 0 && (e->len == 0 || e->time < entry->time))
+            entry = e;
+    }
+
+    memcpy(entry->key, txn->req, MBTCP_GATEWAY_KEY_LENGTH);
+    memcpy(entry->rsp, txn->rsp, txn->rsp_len);
+    entry->len = txn->rsp_len;
+    entry->time = rt_tick_get_us();
+}
+
+/* Unit 0 drops the responses of every unit */
+static void port_cache_drop(struct mbtcp_gateway_port *port, int unit)
+{
+    for (int i = 0; i < MBTCP_GATEWAY_CACHE_SIZE; i++) {
+        if (unit == 0 || port->cache[i].key[0] == unit)
+            port->cache[i].len = 0;
+    }
+}
+
+static struct mbtcp_gateway_port *gateway_route(struct mbtcp_gateway *gateway, int unit)
+{
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        struct mbtcp_gateway_port *port = &gateway->ports[i];
+        if (unit >= port->unit_min && unit <= port->unit_max)
+            return port;
+    }
+
+    return NULL;
+}
+
+static int port_enqueue(struct mbtcp_gateway_port *port, struct mbtcp_gateway_txn *txn)
+{
+    pthread_mutex_lock(&port->lock);
+
+    if (port->stat.depth >= MBTCP_GATEWAY_QUEUE_MAX) {
+        port->stat.rejected++;
+        pthread_mutex_unlock(&port->lock);
+        return -1;
+    }
+
+    txn->seq = ++port->seq;
+
+    /* Anything but a read may change the slave, later reads must not share what was read before it */
+    if (!txn_dedupable(port->gateway, txn)) {
+        int unit = txn->req[0];
+
+        port_cache_drop(port, unit);
+        if (unit == 0) {
+            for (int i = 0; i < 256; i++)
+                port->write_seq[i] = txn->seq;
+        } else {
+            port->write_seq[unit] = txn->seq;
+        }
+    }
+
+    rt_list_insert_before(&port->queues[txn->prio], &txn->list);
+    port->stat.requests++;
+    port->stat.depth++;
+    if (port->stat.depth > port->stat.max_depth)
+        port->stat.max_depth = port->stat.depth;
+
+    pthread_cond_signal(&port->cond);
+    pthread_mutex_unlock(&port->lock);
+
+    return 0;
+}
+
+/* `adu` is unit + PDU, followed by the CRC in relay mode */
+static struct mbtcp_gateway_txn *txn_create(struct mbtcp_gateway *gateway, struct mbtcp_conn *conn, uint16_t tid,
+                                            const uint8_t *adu, int len)
+{
+    struct mbtcp_gateway_txn *txn = malloc(sizeof(struct mbtcp_gateway_txn));
+    if (txn == NULL)
+        return NULL;
+
+    rt_list_init(&txn->followers);
+    txn->conn = conn;
+    txn->tid = tid;
+    txn->prio = gateway->priority(adu + 1, len - 1 - (gateway->relay ? 2 : 0));
+    if (txn->prio < 0 || txn->prio >= MBTCP_GATEWAY_PRIO_NUM)
+        txn->prio = MBTCP_GATEWAY_PRIO_LOW;
+    txn->time_submit = rt_tick_get_us();
+    txn->req_len = len;
+    memcpy(txn->req, adu, len);
+    txn->rsp_len = 0;
+
+    return txn;
+}
+
+/* Server thread: queue the request on its port, answer at once only for gateway exceptions */
+static int gateway_request(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *frame, int len)
+{
+    struct mbtcp_gateway *gateway = server->user_data;
+    uint16_t tid = 0;
+
+    /* Relayed ADUs go to the bus as they came, MBAP frames lose their header */
+    if (!gateway->relay) {
+        /* Not Modbus */
+        if (frame[2] != 0 || frame[3] != 0)
+            return -1;
+
+        tid = (frame[0] << 8) + frame[1];
+        frame += 6;
+        len -= 6;
+    }
+
+    int unit = frame[0];
+    int function = frame[1];
+
+    if (unit == 0) {
+        for (int i = 0; i < gateway->nb_ports; i++) {
+            struct mbtcp_gateway_txn *txn = txn_create(gateway, NULL, tid, frame, len);
+            if (txn && port_enqueue(&gateway->ports[i], txn) < 0)
+                free(txn);
+        }
+        return 0;
+    }
+
+    struct mbtcp_gateway_port *port = gateway_route(gateway, unit);
+    if (port == NULL)
+        return gateway_exception(gateway, server->send_buf, tid, unit, function, AGILE_MODBUS_EXCEPTION_GATEWAY_PATH);
+
+    struct mbtcp_gateway_txn *txn = txn_create(gateway, conn, tid, frame, len);
+
+    if (txn && gateway->dedup && txn_dedupable(gateway, txn)) {
+        pthread_mutex_lock(&port->lock);
+
+        int rsp_len = gateway->dedup_ttl > 0 ? port_cache_get(port, txn, server->send_buf) : 0;
+        if (rsp_len > 0) {
+            port->stat.cached++;
+            pthread_mutex_unlock(&port->lock);
+            free(txn);
+            return rsp_len;
+        }
+
+        struct mbtcp_gateway_txn *leader = port_find(port, txn);
+        if (leader) {
+            rt_list_insert_before(&leader->followers, &txn->list);
+            port->stat.deduped++;
+            pthread_mutex_unlock(&port->lock);
+            return 0;
+        }
+
+        pthread_mutex_unlock(&port->lock);
+    }
+
+    if (txn == NULL || port_enqueue(port, txn) < 0) {
+        free(txn);
+        return gateway_exception(gateway, server->send_buf, tid, unit, function, AGILE_MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+
+    return 0;
+}
+
+/* Server thread: a session is going away, forget its requests */
+static void gateway_close(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    struct mbtcp_gateway *gateway = server->user_data;
+    struct mbtcp_gateway_txn *txn, *n;
+
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        struct mbtcp_gateway_port *port = &gateway->ports[i];
+
+        pthread_mutex_lock(&port->lock);
+        for (int prio = 0; prio < MBTCP_GATEWAY_PRIO_NUM; prio++) {
+            rt_list_for_each_entry_safe(txn, n, &port->queues[prio], list)
+            {
+                txn_forget(txn, conn);
+                if (txn->conn != conn)
+                    continue;
+
+                /* Still carries the requests of other clients */
+                if (!rt_list_isempty(&txn->followers)) {
+                    txn->conn = NULL;
+                    continue;
+                }
+
+                rt_list_remove(&txn->list);
+                port->stat.depth--;
+                free(txn);
+            }
+        }
+        if (port->inflight) {
+            txn_forget(port->inflight, conn);
+            if (port->inflight->conn == conn)
+                port->inflight->conn = NULL;
+        }
+        pthread_mutex_unlock(&port->lock);
+    }
+
+    /* Completed while the ports were scanned */
+    pthread_mutex_lock(&gateway->lock);
+    rt_list_for_each_entry_safe(txn, n, &gateway->done, list)
+    {
+        if (txn->conn != conn)
+            continue;
+
+        rt_list_remove(&txn->list);
+        free(txn);
+    }
+    pthread_mutex_unlock(&gateway->lock);
+}
+
+/* Server thread: send the responses the ports have finished */
+static void gateway_wake(struct mbtcp_server *server)
+{
+    struct mbtcp_gateway *gateway = server->user_data;
+
+    /* One at a time, a failed reply closes the session and drops its other responses from the list */
+    while (1) {
+        struct mbtcp_gateway_txn *txn = NULL;
+
+        pthread_mutex_lock(&gateway->lock);
+        if (!rt_list_isempty(&gateway->done)) {
+            txn = rt_list_first_entry(&gateway->done, struct mbtcp_gateway_txn, list);
+            rt_list_remove(&txn->list);
+        }
+        pthread_mutex_unlock(&gateway->lock);
+
+        if (txn == NULL)
+            break;
+
+        mbtcp_server_reply(server, txn->conn, txn->rsp, txn->rsp_len);
+        free(txn);
+    }
+}
+
+/* Read one response, return its length, 0 on timeout and -1 when what came is not a valid frame */
+static int port_receive(struct mbtcp_gateway_port *port)
+{
+    agile_modbus_t *ctx = &port->ctx_rtu._ctx;
+    uint64_t deadline = rt_tick_get_us() + (uint64_t)port->timeout * 1000;
+    int len = 0;
+
+    while (len < AGILE_MODBUS_RTU_MAX_ADU_LENGTH) {
+        uint64_t now = rt_tick_get_us();
+        if (now >= deadline)
+            break;
+
+        struct pollfd pfd = {.fd = port->fd, .events = POLLIN};
+        int rc = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            continue;
+
+        rc = read(port->fd, port->read_buf + len, AGILE_MODBUS_RTU_MAX_ADU_LENGTH - len);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        len += rc;
+
+        /* Done as soon as the frame is complete, no waiting for the bus to go quiet */
+        rc = agile_modbus_receive_judge(ctx, len, AGILE_MODBUS_MSG_CONFIRMATION);
+        if (rc > 0)
+            return rc;
+    }
+
+    return len > 0 ? -1 : 0;
+}
+
+static void port_transact(struct mbtcp_gateway_port *port, struct mbtcp_gateway_txn *txn)
+{
+    struct mbtcp_gateway *gateway = port->gateway;
+    agile_modbus_t *ctx = &port->ctx_rtu._ctx;
+    int unit = txn->req[0];
+    int function = txn->req[1];
+
+    uint64_t now = rt_tick_get_us();
+    if (now < port->time_idle + port->gap)
+        usleep(port->time_idle + port->gap - now);
+
+    uint64_t time_sent = rt_tick_get_us();
+    const uint8_t *adu = txn->req;
+    int send_len = txn->req_len;
+    if (!gateway->relay) {
+        send_len = agile_modbus_serialize_raw_request(ctx, txn->req, txn->req_len);
+        adu = ctx->send_buf;
+    }
+
+    serial_flush(port->fd);
+    if (send_len < 0 || serial_send(port->fd, adu, send_len) != send_len) {
+        txn->rsp_len = gateway_exception(gateway, txn->rsp, txn->tid, unit, function, AGILE_MODBUS_EXCEPTION_GATEWAY_TARGET);
+        port->time_idle = rt_tick_get_us();
+        return;
+    }
+    tcdrain(port->fd);
+
+    /* Slaves act on a broadcast without answering, give them time before the next frame */
+    if (unit == 0) {
+        port->time_idle = rt_tick_get_us() + MBTCP_GATEWAY_TURNAROUND * 1000;
+        return;
+    }
+
+    int rc = port_receive(port);
+    port->time_idle = rt_tick_get_us();
+
+    uint32_t bus = port->time_idle - time_sent;
+    uint32_t wait = time_sent - txn->time_submit;
+
+    if (rc > 0 && (port->read_buf[0] != unit || (port->read_buf[1] & 0x7f) != function))
+        rc = -1;
+
+    pthread_mutex_lock(&port->lock);
+    if (rc > 0) {
+        port->stat.responses++;
+        port->stat.bus_sum += bus;
+        if (bus > port->stat.bus_max)
+            port->stat.bus_max = bus;
+    } else if (rc == 0) {
+        port->stat.timeouts++;
+    } else {
+        port->stat.errors++;
+    }
+    port->stat.wait_sum += wait;
+    if (wait > port->stat.wait_max)
+        port->stat.wait_max = wait;
+    pthread_mutex_unlock(&port->lock);
+
+    if (rc <= 0) {
+        txn->rsp_len = gateway_exception(gateway, txn->rsp, txn->tid, unit, function, AGILE_MODBUS_EXCEPTION_GATEWAY_TARGET);
+        return;
+    }
+
+    if (gateway->relay) {
+        memcpy(txn->rsp, port->read_buf, rc);
+        txn->rsp_len = rc;
+        return;
+    }
+
+    /* Unit + PDU without the CRC behind a MBAP header with the client's transaction identifier */
+    int length = rc - 2;
+    txn->rsp[0] = txn->tid >> 8;
+    txn->rsp[1] = txn->tid & 0xff;
+    txn->rsp[2] = 0;
+    txn->rsp[3] = 0;
+    txn->rsp[4] = length >> 8;
+    txn->rsp[5] = length & 0xff;
+    memcpy(txn->rsp + 6, port->read_buf, length);
+    txn->rsp_len = 6 + length;
+}
+
+static void port_complete(struct mbtcp_gateway_port *port, struct mbtcp_gateway_txn *txn)
+{
+    struct mbtcp_gateway *gateway = port->gateway;
+    int wake = 0;
+
+    pthread_mutex_lock(&port->lock);
+    pthread_mutex_lock(&gateway->lock);
+
+    port->inflight = NULL;
+
+    if (txn->rsp_len > 0) {
+        /* A normal response, not an exception from the slave or the gateway */
+        int normal = !(txn->rsp[gateway->relay ? 1 : 7] & 0x80);
+
+        if (gateway->dedup_ttl > 0 && normal && txn_dedupable(gateway, txn) && port_fresh(port, txn))
+            port_cache_put(port, txn);
+        else if (normal && !txn_dedupable(gateway, txn))
+            port_cache_drop(port, txn->req[0]);
+    }
+
+    while (!rt_list_isempty(&txn->followers)) {
+        struct mbtcp_gateway_txn *follower = rt_list_first_entry(&txn->followers, struct mbtcp_gateway_txn, list);
+        rt_list_remove(&follower->list);
+
+        memcpy(follower->rsp, txn->rsp, txn->rsp_len);
+        gateway_set_tid(gateway, follower->rsp, follower->tid);
+        follower->rsp_len = txn->rsp_len;
+
+        wake |= rt_list_isempty(&gateway->done);
+        rt_list_insert_before(&gateway->done, &follower->list);
+    }
+
+    if (txn->conn && txn->rsp_len > 0) {
+        wake |= rt_list_isempty(&gateway->done);
+        rt_list_insert_before(&gateway->done, &txn->list);
+        txn = NULL;
+    }
+
+    pthread_mutex_unlock(&gateway->lock);
+    pthread_mutex_unlock(&port->lock);
+
+    free(txn);
+    if (wake)
+        mbtcp_server_wake(&gateway->server);
+}
+
+static void *port_entry(void *param)
+{
+    struct mbtcp_gateway_port *port = param;
+    struct mbtcp_gateway *gateway = port->gateway;
+
+    while (1) {
+        struct mbtcp_gateway_txn *txn = NULL;
+
+        pthread_mutex_lock(&port->lock);
+        while (gateway->running && port->stat.depth == 0)
+            pthread_cond_wait(&port->cond, &port->lock);
+
+        if (!gateway->running) {
+            pthread_mutex_unlock(&port->lock);
+            break;
+        }
+
+        for (int prio = 0; prio < MBTCP_GATEWAY_PRIO_NUM; prio++) {
+            if (!rt_list_isempty(&port->queues[prio])) {
+                txn = rt_list_first_entry(&port->queues[prio], struct mbtcp_gateway_txn, list);
+                rt_list_remove(&txn->list);
+                break;
+            }
+        }
+        port->stat.depth--;
+        port->inflight = txn;
+        pthread_mutex_unlock(&port->lock);
+
+        port_transact(port, txn);
+        port_complete(port, txn);
+    }
+
+    return NULL;
+}
+
+/* 8N1 at `baudrate`, the default timeout and a gap of 3.5 characters */
+void mbtcp_gateway_port_init(struct mbtcp_gateway_port *port, const char *device, int baudrate, int unit_min, int unit_max)
+{
+    memset(port, 0, sizeof(struct mbtcp_gateway_port));
+    port->device = device;
+    port->baudrate = baudrate;
+    port->parity = 'N';
+    port->data_bit = 8;
+    port->stop_bit = 1;
+    port->unit_min = unit_min;
+    port->unit_max = unit_max;
+    port->timeout = MBTCP_GATEWAY_TIMEOUT;
+    port->fd = -1;
+}
+
+int mbtcp_gateway_init(struct mbtcp_gateway *gateway, int port, int max_conns, int idle_timeout,
+                       struct mbtcp_gateway_port *ports, int nb_ports)
+{
+    memset(gateway, 0, sizeof(struct mbtcp_gateway));
+    gateway->ports = ports;
+    gateway->nb_ports = nb_ports;
+    gateway->priority = gateway_priority;
+    gateway->dedup = 1;
+    pthread_mutex_init(&gateway->lock, NULL);
+    rt_list_init(&gateway->done);
+
+    for (int i = 0; i < nb_ports; i++) {
+        struct mbtcp_gateway_port *p = &ports[i];
+
+        p->gateway = gateway;
+        p->fd = -1;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        for (int prio = 0; prio < MBTCP_GATEWAY_PRIO_NUM; prio++)
+            rt_list_init(&p->queues[prio]);
+
+        /* 3.5 characters of 11 bits, at least 1750us as the specification fixes it above 19200 baud */
+        if (p->gap <= 0) {
+            p->gap = 38500000 / p->baudrate;
+            if (p->gap < 1750)
+                p->gap = 1750;
+        }
+
+        agile_modbus_rtu_init(&p->ctx_rtu, p->send_buf, sizeof(p->send_buf), p->read_buf, sizeof(p->read_buf));
+    }
+
+    if (mbtcp_server_init(&gateway->server, port, max_conns, idle_timeout, NULL, NULL) < 0) {
+        mbtcp_gateway_deinit(gateway);
+        return -1;
+    }
+
+    gateway->server.request_cb = gateway_request;
+    gateway->server.close_cb = gateway_close;
+    gateway->server.wake_cb = gateway_wake;
+    gateway->server.user_data = gateway;
+
+    return 0;
+}
+
+void mbtcp_gateway_deinit(struct mbtcp_gateway *gateway)
+{
+    mbtcp_server_deinit(&gateway->server);
+
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        pthread_cond_destroy(&gateway->ports[i].cond);
+        pthread_mutex_destroy(&gateway->ports[i].lock);
+    }
+
+    pthread_mutex_destroy(&gateway->lock);
+}
+
+static void gateway_stop_ports(struct mbtcp_gateway *gateway)
+{
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        struct mbtcp_gateway_port *port = &gateway->ports[i];
+
+        pthread_mutex_lock(&port->lock);
+        gateway->running = 0;
+        pthread_cond_signal(&port->cond);
+        pthread_mutex_unlock(&port->lock);
+    }
+
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        struct mbtcp_gateway_port *port = &gateway->ports[i];
+        struct mbtcp_gateway_txn *txn, *n;
+
+        if (port->started)
+            pthread_join(port->tid, NULL);
+        port->started = 0;
+
+        if (port->fd >= 0)
+            serial_close(port->fd, &port->old_tios);
+        port->fd = -1;
+
+        for (int prio = 0; prio < MBTCP_GATEWAY_PRIO_NUM; prio++) {
+            rt_list_for_each_entry_safe(txn, n, &port->queues[prio], list)
+            {
+                rt_list_remove(&txn->list);
+                txn_free(txn);
+            }
+        }
+        port->stat.depth = 0;
+    }
+
+    while (!rt_list_isempty(&gateway->done)) {
+        struct mbtcp_gateway_txn *txn = rt_list_first_entry(&gateway->done, struct mbtcp_gateway_txn, list);
+        rt_list_remove(&txn->list);
+        free(txn);
+    }
+}
+
+/* Open the ports and serve until `mbtcp_gateway_stop`, return like `mbtcp_server_run` */
+int mbtcp_gateway_run(struct mbtcp_gateway *gateway)
+{
+    int rc = -1;
+
+    gateway->running = 1;
+
+    for (int i = 0; i < gateway->nb_ports; i++) {
+        struct mbtcp_gateway_port *port = &gateway->ports[i];
+
+        port->fd = serial_init(port->device, port->baudrate, port->parity, port->data_bit, port->stop_bit,
+                               &port->old_tios);
+        if (port->fd < 0) {
+            LOG_E("Open %s failed!", port->device);
+            goto _exit;
+        }
+
+        if (pthread_create(&port->tid, NULL, port_entry, port) != 0)
+            goto _exit;
+        port->started = 1;
+
+        LOG_I("%s: units %d ~ %d, %d baud.", port->device, port->unit_min, port->unit_max, port->baudrate);
+    }
+
+    gateway->server.rtu = gateway->relay;
+    rc = mbtcp_server_run(&gateway->server);
+
+_exit:
+    gateway_stop_ports(gateway);
+
+    return rc;
+}
+
+void mbtcp_gateway_stop(struct mbtcp_gateway *gateway)
+{
+    mbtcp_server_stop(&gateway->server);
+}
+
+void mbtcp_gateway_port_stat(struct mbtcp_gateway_port *port, struct mbtcp_gateway_stat *stat)
+{
+    pthread_mutex_lock(&port->lock);
+    *stat = port->stat;
+    pthread_mutex_unlock(&port->lock);
+}
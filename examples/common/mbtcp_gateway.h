@@ -0,0 +1,141 @@
+#ifndef __MBTCP_GATEWAY_H
+#define __MBTCP_GATEWAY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <termios.h>
+#include "agile_modbus.h"
+#include "mbtcp_server.h"
+#include "rtservice.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Modbus TCP to RTU gateway.
+ *
+ * A deferred mode mbtcp_server takes the requests of every client, strips
+ * the MBAP header and queues the unit + PDU on the serial port that serves
+ * the unit. Each port has its own thread that owns the bus: it takes the
+ * next request by priority, waits out the inter-frame gap, frames it with
+ * an agile_modbus_rtu_t and reads the response until it is complete. The
+ * response goes back to the server thread and to its client under the
+ * transaction identifier of the request.
+ *
+ * Priorities: MBTCP_GATEWAY_PRIO_HIGH is served before
+ * MBTCP_GATEWAY_PRIO_LOW, FIFO within one level. By default writes are high
+ * and everything else low; `priority` overrides that.
+ *
+ * Gateway exceptions: 0x0A when no port serves the unit, 0x06 when the
+ * port queue is full and 0x0B when the slave does not answer correctly.
+ * Unit 0 is broadcast on every port and never answered.
+ *
+ * Deduplication (`dedup`, on by default): a read of coils, discrete inputs,
+ * holding or input registers with the same unit, function, address and
+ * count as one queued or on the wire joins it, and the one response is
+ * fanned out to every waiting client. With `dedup_ttl` (ms) responses are
+ * also kept that long per port, up to MBTCP_GATEWAY_CACHE_SIZE of them, and
+ * served without touching the bus. A write through the gateway drops the
+ * cached responses of its unit as soon as it is queued, and a read never
+ * joins or caches a response taken before a write to its unit was queued.
+ *
+ * Relay mode (`relay`): clients speak RTU over TCP and their ADUs go to the
+ * bus as they came, CRC included, and back the same way. Only frame
+ * boundaries and CRCs are checked, nothing is converted or reframed.
+ */
+#define MBTCP_GATEWAY_PRIO_HIGH  0
+#define MBTCP_GATEWAY_PRIO_LOW   1
+#define MBTCP_GATEWAY_PRIO_NUM   2
+#define MBTCP_GATEWAY_QUEUE_MAX  64
+#define MBTCP_GATEWAY_TIMEOUT    1000
+#define MBTCP_GATEWAY_TURNAROUND 100
+#define MBTCP_GATEWAY_CACHE_SIZE 16
+#define MBTCP_GATEWAY_KEY_LENGTH 6
+
+struct mbtcp_gateway_txn;
+
+/* Latencies in us: `wait` is time queued, `bus` is request sent to response received */
+struct mbtcp_gateway_stat {
+    uint32_t requests;
+    uint32_t responses;
+    uint32_t timeouts;
+    uint32_t errors;
+    uint32_t rejected;
+    uint32_t deduped;
+    uint32_t cached;
+    int depth;
+    int max_depth;
+    uint64_t wait_sum;
+    uint64_t bus_sum;
+    uint32_t wait_max;
+    uint32_t bus_max;
+};
+
+struct mbtcp_gateway_cache {
+    uint8_t key[MBTCP_GATEWAY_KEY_LENGTH];
+    uint64_t time;
+    int len;
+    uint8_t rsp[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+/* `timeout` is the response timeout in ms, `gap` the inter-frame gap in us (0: 3.5 characters) */
+struct mbtcp_gateway_port {
+    const char *device;
+    int baudrate;
+    char parity;
+    int data_bit;
+    int stop_bit;
+    int unit_min;
+    int unit_max;
+    int timeout;
+    int gap;
+
+    struct mbtcp_gateway *gateway;
+    int fd;
+    struct termios old_tios;
+    pthread_t tid;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rt_list_t queues[MBTCP_GATEWAY_PRIO_NUM];
+    struct mbtcp_gateway_txn *inflight;
+    uint64_t time_idle;
+    struct mbtcp_gateway_cache cache[MBTCP_GATEWAY_CACHE_SIZE];
+    uint64_t seq;            /* Sequence number of the last queued request */
+    uint64_t write_seq[256]; /* Sequence number of the last queued write, per unit */
+
+    agile_modbus_rtu_t ctx_rtu;
+    uint8_t send_buf[AGILE_MODBUS_RTU_MAX_ADU_LENGTH];
+    uint8_t read_buf[AGILE_MODBUS_RTU_MAX_ADU_LENGTH];
+
+    struct mbtcp_gateway_stat stat;
+};
+
+struct mbtcp_gateway {
+    struct mbtcp_server server;
+    struct mbtcp_gateway_port *ports;
+    int nb_ports;
+    int (*priority)(const uint8_t *pdu, int len);
+    int dedup;
+    int dedup_ttl;
+    int relay;
+
+    int running;
+    pthread_mutex_t lock;
+    rt_list_t done;
+};
+
+void mbtcp_gateway_port_init(struct mbtcp_gateway_port *port, const char *device, int baudrate, int unit_min, int unit_max);
+int mbtcp_gateway_init(struct mbtcp_gateway *gateway, int port, int max_conns, int idle_timeout,
+                       struct mbtcp_gateway_port *ports, int nb_ports);
+void mbtcp_gateway_deinit(struct mbtcp_gateway *gateway);
+int mbtcp_gateway_run(struct mbtcp_gateway *gateway);
+void mbtcp_gateway_stop(struct mbtcp_gateway *gateway);
+void mbtcp_gateway_port_stat(struct mbtcp_gateway_port *port, struct mbtcp_gateway_stat *stat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include "mbtcp_master.h"
+#include "rt_tick.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbtcp_master"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define MBTCP_MBAP_LENGTH 7
+
+/* Take every node of `from` into the empty list `to` */
+static void list_move(rt_list_t *to, rt_list_t *from)
+{
+    if (rt_list_isempty(from)) {
+        rt_list_init(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    rt_list_init(from);
+}
+
+static struct mbtcp_request *dev_pop(struct mbtcp_device *dev)
+{
+    struct mbtcp_request *req = NULL;
+
+    pthread_mutex_lock(&dev->master->lock);
+    if (!rt_list_isempty(&dev->queue)) {
+        req = rt_list_first_entry(&dev->queue, struct mbtcp_request, list);
+        rt_list_remove(&req->list);
+    }
+    pthread_mutex_unlock(&dev->master->lock);
+
+    return req;
+}
+
+static void dev_schedule(struct mbtcp_device *dev, int ms)
+{
+    timerwheel_add(&dev->master->wheel, &dev->timer, rt_tick_get() + rt_tick_from_millisecond(ms));
+}
+
+static void dev_complete(struct mbtcp_device *dev, struct mbtcp_request *req, int rc)
+{
+    if (req->cb)
+        req->cb(dev, req, rc);
+}
+
+/* Complete the request on the wire and the queued ones. Requests submitted by the callbacks stay queued */
+static void dev_abort(struct mbtcp_device *dev, int rc)
+{
+    rt_list_t head;
+
+    if (dev->inflight) {
+        struct mbtcp_request *req = dev->inflight;
+        dev->inflight = NULL;
+        dev_complete(dev, req, rc);
+    }
+
+    pthread_mutex_lock(&dev->master->lock);
+    list_move(&head, &dev->queue);
+    pthread_mutex_unlock(&dev->master->lock);
+
+    while (!rt_list_isempty(&head)) {
+        struct mbtcp_request *req = rt_list_first_entry(&head, struct mbtcp_request, list);
+        rt_list_remove(&req->list);
+        dev_complete(dev, req, rc);
+    }
+}
+
+static void dev_close(struct mbtcp_device *dev)
+{
+    if (dev->fd >= 0) {
+        epoll_ctl(dev->master->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+        close(dev->fd);
+        dev->fd = -1;
+    }
+
+    dev->state = MBTCP_DEVICE_CLOSED;
+    dev->rx_len = 0;
+}
+
+/* Close the connection and schedule the next attempt */
+static void dev_fail(struct mbtcp_device *dev)
+{
+    dev_close(dev);
+    dev->stat.failures++;
+
+    if (dev->backoff == 0)
+        dev->backoff = MBTCP_MASTER_BACKOFF_MIN;
+    else if (dev->backoff < MBTCP_MASTER_BACKOFF_MAX / 2)
+        dev->backoff *= 2;
+    else
+        dev->backoff = MBTCP_MASTER_BACKOFF_MAX;
+
+    int delay = dev->backoff + rand() % (dev->backoff / 4 + 1);
+    dev_schedule(dev, delay);
+
+    /* Only the first failure in a row, a site of unreachable meters would flood the log */
+    if (dev->backoff == MBTCP_MASTER_BACKOFF_MIN)
+        LOG_W("%s:%d slave %d disconnected, retrying.", inet_ntoa(dev->addr.sin_addr), ntohs(dev->addr.sin_port),
+              dev->slave);
+
+    dev_abort(dev, MBTCP_MASTER_EDISCONNECT);
+}
+
+static int dev_serialize(struct mbtcp_device *dev, struct mbtcp_request *req)
+{
+    agile_modbus_t *ctx = &dev->ctx_tcp._ctx;
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+        return agile_modbus_serialize_read_bits(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+        return agile_modbus_serialize_read_input_bits(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+        return agile_modbus_serialize_read_registers(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        return agile_modbus_serialize_read_input_registers(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+        return agile_modbus_serialize_write_bit(ctx, req->address, ((uint8_t *)req->data)[0]);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return agile_modbus_serialize_write_register(ctx, req->address, ((uint16_t *)req->data)[0]);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return agile_modbus_serialize_write_bits(ctx, req->address, req->nb, req->data);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return agile_modbus_serialize_write_registers(ctx, req->address, req->nb, req->data);
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+static int dev_deserialize(struct mbtcp_device *dev, struct mbtcp_request *req, int len)
+{
+    agile_modbus_t *ctx = &dev->ctx_tcp._ctx;
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+        return agile_modbus_deserialize_read_bits(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+        return agile_modbus_deserialize_read_input_bits(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+        return agile_modbus_deserialize_read_registers(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        return agile_modbus_deserialize_read_input_registers(ctx, len, req->data);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+        return agile_modbus_deserialize_write_bit(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return agile_modbus_deserialize_write_register(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return agile_modbus_deserialize_write_bits(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return agile_modbus_deserialize_write_registers(ctx, len);
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+/* Put the next queued request on the wire */
+static void dev_send_next(struct mbtcp_device *dev)
+{
+    while (dev->state == MBTCP_DEVICE_CONNECTED && dev->inflight == NULL) {
+        struct mbtcp_request *req = dev_pop(dev);
+        if (req == NULL)
+            return;
+
+        int len = dev_serialize(dev, req);
+        if (len < 0) {
+            dev_complete(dev, req, -1);
+            continue;
+        }
+
+        /* One small request per round trip: the socket buffer is empty, a short write means the connection is gone */
+        dev->inflight = req;
+        int rc = send(dev->fd, dev->send_buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (rc != len) {
+            dev_fail(dev);
+            return;
+        }
+
+        dev->stat.requests++;
+        dev_schedule(dev, req->timeout);
+    }
+}
+
+/* Act on requests submitted since the device was last kicked */
+static void dev_kick(struct mbtcp_device *dev)
+{
+    switch (dev->state) {
+    case MBTCP_DEVICE_CONNECTED:
+        dev_send_next(dev);
+        break;
+
+    case MBTCP_DEVICE_CLOSED:
+        /* Don't pile up requests for a device that is backing off */
+        if (dev->backoff > 0)
+            dev_abort(dev, MBTCP_MASTER_EDISCONNECT);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void dev_connected(struct mbtcp_device *dev)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = dev};
+    if (epoll_ctl(dev->master->epfd, EPOLL_CTL_MOD, dev->fd, &ev) < 0) {
+        dev_fail(dev);
+        return;
+    }
+
+    timerwheel_del(&dev->master->wheel, &dev->timer);
+    dev->state = MBTCP_DEVICE_CONNECTED;
+    dev->backoff = 0;
+    dev->rx_len = 0;
+    dev->stat.connects++;
+
+    dev_send_next(dev);
+}
+
+static void dev_connect(struct mbtcp_device *dev)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        dev_fail(dev);
+        return;
+    }
+
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
+    dev->fd = fd;
+    dev->state = MBTCP_DEVICE_CONNECTING;
+    dev_schedule(dev, MBTCP_MASTER_CONNECT_TIMEOUT);
+
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = dev};
+    if (epoll_ctl(dev->master->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        dev_fail(dev);
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr *)&dev->addr, sizeof(dev->addr)) == 0) {
+        dev_connected(dev);
+        return;
+    }
+
+    if (errno != EINPROGRESS)
+        dev_fail(dev);
+}
+
+/* Handle the response at the head of the receive buffer, return the frame length, 0 if incomplete, -1 on error */
+static int dev_process(struct mbtcp_device *dev)
+{
+    if (dev->rx_len < MBTCP_MBAP_LENGTH)
+        return 0;
+
+    int length = (dev->read_buf[4] << 8) + dev->read_buf[5];
+    if (length < 2 || length > AGILE_MODBUS_TCP_MAX_ADU_LENGTH - 6)
+        return -1;
+
+    int frame_len = length + 6;
+    if (dev->rx_len < frame_len)
+        return 0;
+
+    /* Anything else is the late answer to a request that timed out */
+    struct mbtcp_request *req = dev->inflight;
+    if (req && dev->read_buf[0] == dev->send_buf[0] && dev->read_buf[1] == dev->send_buf[1]) {
+        dev->inflight = NULL;
+        timerwheel_del(&dev->master->wheel, &dev->timer);
+
+        int rc = dev_deserialize(dev, req, frame_len);
+        if (rc < 0)
+            dev->stat.errors++;
+        else
+            dev->stat.responses++;
+
+        dev_complete(dev, req, rc);
+    }
+
+    return frame_len;
+}
+
+static void dev_read(struct mbtcp_device *dev)
+{
+    while (1) {
+        int space = AGILE_MODBUS_TCP_MAX_ADU_LENGTH - dev->rx_len;
+        int rc = recv(dev->fd, dev->read_buf + dev->rx_len, space, MSG_DONTWAIT);
+        if (rc == 0)
+            goto _fail;
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            goto _fail;
+        }
+
+        dev->rx_len += rc;
+
+        int frame_len;
+        while ((frame_len = dev_process(dev)) > 0) {
+            dev->rx_len -= frame_len;
+            if (dev->rx_len > 0)
+                memmove(dev->read_buf, dev->read_buf + frame_len, dev->rx_len);
+        }
+        if (frame_len < 0)
+            goto _fail;
+
+        if (rc < space)
+            break;
+    }
+
+    dev_send_next(dev);
+    return;
+
+_fail:
+    dev_fail(dev);
+}
+
+static void dev_event(struct mbtcp_device *dev, uint32_t events)
+{
+    if (dev->state == MBTCP_DEVICE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(dev->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            dev_fail(dev);
+        else
+            dev_connected(dev);
+        return;
+    }
+
+    if (dev->state != MBTCP_DEVICE_CONNECTED)
+        return;
+
+    /* Read first, the peer may have answered before closing */
+    if (events & EPOLLIN)
+        dev_read(dev);
+    else if (events & (EPOLLERR | EPOLLHUP))
+        dev_fail(dev);
+}
+
+/* The deadline of the device passed */
+static void dev_deadline(struct timerwheel_timer *timer, void *arg)
+{
+    struct mbtcp_device *dev = arg;
+
+    (void)timer;
+
+    if (dev->state == MBTCP_DEVICE_CLOSED) {
+        dev_connect(dev);
+    } else if (dev->state == MBTCP_DEVICE_CONNECTING) {
+        dev_fail(dev);
+    } else if (dev->inflight) {
+        struct mbtcp_request *req = dev->inflight;
+        dev->inflight = NULL;
+        dev->stat.timeouts++;
+        dev_complete(dev, req, MBTCP_MASTER_ETIMEOUT);
+        dev_send_next(dev);
+    }
+}
+
+/* Run the deadlines that passed, return the time in ms until the next one or -1 */
+static int master_expire(struct mbtcp_master *master)
+{
+    uint32_t now = rt_tick_get();
+    uint32_t next;
+
+    timerwheel_run(&master->wheel, now);
+
+    if (timerwheel_next(&master->wheel, &next) < 0)
+        return -1;
+
+    int32_t ticks = (int32_t)(next - now);
+    if (ticks <= 0)
+        return 0;
+
+    return (int)((int64_t)ticks * 1000 / RT_TICK_PER_SECOND) + 1;
+}
+
+int mbtcp_device_init(struct mbtcp_device *dev, const char *ip, int port, int slave)
+{
+    memset(dev, 0, sizeof(struct mbtcp_device));
+    dev->addr.sin_family = AF_INET;
+    dev->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &dev->addr.sin_addr) != 1)
+        return -1;
+
+    dev->slave = slave;
+    dev->fd = -1;
+    dev->state = MBTCP_DEVICE_CLOSED;
+    rt_list_init(&dev->list);
+    rt_list_init(&dev->kick);
+    rt_list_init(&dev->queue);
+    timerwheel_timer_init(&dev->timer, dev_deadline, dev);
+
+    agile_modbus_tcp_init(&dev->ctx_tcp, dev->send_buf, sizeof(dev->send_buf), dev->read_buf, sizeof(dev->read_buf));
+    agile_modbus_set_slave(&dev->ctx_tcp._ctx, slave);
+
+    return 0;
+}
+
+int mbtcp_master_init(struct mbtcp_master *master)
+{
+    memset(master, 0, sizeof(struct mbtcp_master));
+    master->running = 1;
+    rt_list_init(&master->devices);
+    rt_list_init(&master->kicks);
+    timerwheel_init(&master->wheel, rt_tick_get());
+    pthread_mutex_init(&master->lock, NULL);
+
+    master->epfd = epoll_create1(EPOLL_CLOEXEC);
+    master->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (master->epfd < 0 || master->wake_fd < 0) {
+        mbtcp_master_deinit(master);
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = master};
+    if (epoll_ctl(master->epfd, EPOLL_CTL_ADD, master->wake_fd, &ev) < 0) {
+        mbtcp_master_deinit(master);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Close every connection and abort the outstanding requests */
+void mbtcp_master_deinit(struct mbtcp_master *master)
+{
+    while (!rt_list_isempty(&master->devices)) {
+        struct mbtcp_device *dev = rt_list_first_entry(&master->devices, struct mbtcp_device, list);
+        dev_close(dev);
+        dev_abort(dev, MBTCP_MASTER_EABORT);
+        timerwheel_del(&master->wheel, &dev->timer);
+        rt_list_remove(&dev->kick);
+        rt_list_remove(&dev->list);
+        dev->master = NULL;
+    }
+    master->nb_devices = 0;
+
+    if (master->wake_fd >= 0)
+        close(master->wake_fd);
+    if (master->epfd >= 0)
+        close(master->epfd);
+
+    master->wake_fd = master->epfd = -1;
+    pthread_mutex_destroy(&master->lock);
+}
+
+/* The device connects on the next pass of the loop */
+int mbtcp_master_add(struct mbtcp_master *master, struct mbtcp_device *dev)
+{
+    if (dev->master)
+        return -1;
+
+    dev->master = master;
+    dev_schedule(dev, 0);
+    rt_list_insert_before(&master->devices, &dev->list);
+    master->nb_devices++;
+
+    return 0;
+}
+
+int mbtcp_master_submit(struct mbtcp_device *dev, struct mbtcp_request *req)
+{
+    struct mbtcp_master *master = dev->master;
+    int wake = 0;
+
+    if (master == NULL || req->data == NULL)
+        return -1;
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        break;
+    default:
+        return -1;
+    }
+
+    pthread_mutex_lock(&master->lock);
+    rt_list_insert_before(&dev->queue, &req->list);
+    if (rt_list_isempty(&dev->kick)) {
+        rt_list_insert_before(&master->kicks, &dev->kick);
+        wake = !pthread_equal(master->tid, pthread_self());
+    }
+    pthread_mutex_unlock(&master->lock);
+
+    if (wake) {
+        uint64_t value = 1;
+        ssize_t rc = write(master->wake_fd, &value, sizeof(value));
+        (void)rc;
+    }
+
+    return 0;
+}
+
+/* Kick the devices with new requests, return 1 if callbacks kicked more */
+static int master_kick(struct mbtcp_master *master)
+{
+    rt_list_t head;
+
+    pthread_mutex_lock(&master->lock);
+    list_move(&head, &master->kicks);
+    pthread_mutex_unlock(&master->lock);
+
+    while (!rt_list_isempty(&head)) {
+        struct mbtcp_device *dev = rt_list_first_entry(&head, struct mbtcp_device, kick);
+
+        pthread_mutex_lock(&master->lock);
+        rt_list_remove(&dev->kick);
+        pthread_mutex_unlock(&master->lock);
+
+        dev_kick(dev);
+    }
+
+    pthread_mutex_lock(&master->lock);
+    int more = !rt_list_isempty(&master->kicks);
+    pthread_mutex_unlock(&master->lock);
+
+    return more;
+}
+
+/* Drive the devices until `mbtcp_master_stop`, return 0 when stopped and -1 on error */
+int mbtcp_master_run(struct mbtcp_master *master)
+{
+    struct epoll_event events[MBTCP_MASTER_MAX_EVENTS];
+
+    master->tid = pthread_self();
+    LOG_I("mbtcp master running, %d device(s).", master->nb_devices);
+
+    while (__atomic_load_n(&master->running, __ATOMIC_ACQUIRE)) {
+        int more = master_kick(master);
+        int timeout = more ? 0 : master_expire(master);
+
+        int n = epoll_wait(master->epfd, events, MBTCP_MASTER_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == master) {
+                uint64_t value;
+                ssize_t rc = read(master->wake_fd, &value, sizeof(value));
+                (void)rc;
+            } else {
+                dev_event((struct mbtcp_device *)ptr, events[i].events);
+            }
+        }
+    }
+
+    rt_list_t *node;
+    rt_list_for_each(node, &master->devices)
+    {
+        struct mbtcp_device *dev = rt_list_entry(node, struct mbtcp_device, list);
+        dev_close(dev);
+        dev_abort(dev, MBTCP_MASTER_EABORT);
+        dev->backoff = 0;
+        dev_schedule(dev, 0);
+    }
+
+    return __atomic_load_n(&master->running, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
+
+void mbtcp_master_stop(struct mbtcp_master *master)
+{
+    uint64_t value = 1;
+
+    __atomic_store_n(&master->running, 0, __ATOMIC_RELEASE);
+    ssize_t rc = write(master->wake_fd, &value, sizeof(value));
+    (void)rc;
+}
@@ -0,0 +1,130 @@
+#ifndef __MBTCP_MASTER_H
+#define __MBTCP_MASTER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "agile_modbus.h"
+#include "rtservice.h"
+#include "timerwheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event-driven Modbus TCP master.
+ *
+ * One thread drives the connections to any number of devices with epoll.
+ * Each device owns its context, buffers and a FIFO of requests, of which one
+ * at a time is on the wire. Connections are opened without blocking and
+ * reopened after a failure with an exponential backoff (plus jitter, so a
+ * site full of meters doesn't reconnect in lockstep).
+ *
+ * A device has one deadline at a time, a timer on the master's wheel: the
+ * connect timeout, the response timeout of the request on the wire or the
+ * end of its backoff. Requests
+ * complete through their callback, on the master thread, with the return
+ * value of the matching `agile_modbus_deserialize_*` or one of the
+ * MBTCP_MASTER_E* codes below. The response timeout counts from the moment
+ * the request is sent; a response that arrives later is dropped by its
+ * transaction identifier.
+ *
+ * `mbtcp_master_submit` may be called from any thread. Devices are added
+ * before `mbtcp_master_run` or from a completion callback.
+ */
+#define MBTCP_MASTER_MAX_EVENTS      64
+#define MBTCP_MASTER_CONNECT_TIMEOUT 3000
+#define MBTCP_MASTER_BACKOFF_MIN     500
+#define MBTCP_MASTER_BACKOFF_MAX     30000
+
+/* Completion codes besides those of agile_modbus_deserialize_* */
+#define MBTCP_MASTER_ETIMEOUT    -2
+#define MBTCP_MASTER_EDISCONNECT -3
+#define MBTCP_MASTER_EABORT      -4
+
+enum mbtcp_device_state {
+    MBTCP_DEVICE_CLOSED = 0,
+    MBTCP_DEVICE_CONNECTING,
+    MBTCP_DEVICE_CONNECTED
+};
+
+struct mbtcp_device;
+struct mbtcp_request;
+
+typedef void (*mbtcp_request_cb_t)(struct mbtcp_device *dev, struct mbtcp_request *req, int rc);
+
+/*
+ * `data` is read for the write functions and written by the read ones:
+ * one uint8_t per bit (0x01, 0x02, 0x05, 0x0F), one uint16_t per register
+ * (0x03, 0x04, 0x06, 0x10). It belongs to the master until the callback.
+ */
+struct mbtcp_request {
+    rt_list_t list;
+    int function;
+    int address;
+    int nb;
+    void *data;
+    int timeout;
+    mbtcp_request_cb_t cb;
+    void *arg;
+};
+
+struct mbtcp_device_stat {
+    uint32_t connects;
+    uint32_t failures;
+    uint32_t requests;
+    uint32_t responses;
+    uint32_t timeouts;
+    uint32_t errors;
+};
+
+struct mbtcp_device {
+    struct sockaddr_in addr;
+    int slave;
+    void *arg;
+
+    struct mbtcp_master *master;
+    rt_list_t list;
+    rt_list_t kick;
+    rt_list_t queue;
+    struct mbtcp_request *inflight;
+    int state;
+    int fd;
+    int backoff;
+    struct timerwheel_timer timer;
+
+    agile_modbus_tcp_t ctx_tcp;
+    uint8_t send_buf[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+    uint8_t read_buf[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+    int rx_len;
+
+    struct mbtcp_device_stat stat;
+};
+
+struct mbtcp_master {
+    int epfd;
+    int wake_fd;
+    int running;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    rt_list_t devices;
+    rt_list_t kicks;
+    int nb_devices;
+    struct timerwheel wheel;
+};
+
+int mbtcp_device_init(struct mbtcp_device *dev, const char *ip, int port, int slave);
+
+int mbtcp_master_init(struct mbtcp_master *master);
+void mbtcp_master_deinit(struct mbtcp_master *master);
+int mbtcp_master_add(struct mbtcp_master *master, struct mbtcp_device *dev);
+int mbtcp_master_submit(struct mbtcp_device *dev, struct mbtcp_request *req);
+int mbtcp_master_run(struct mbtcp_master *master);
+void mbtcp_master_stop(struct mbtcp_master *master);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
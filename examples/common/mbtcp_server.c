@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+#include "mbtcp_server.h"
+#include "tcp.h"
+#include "rt_tick.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbtcp_server"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define MBTCP_MBAP_LENGTH 7
+
+/* Runs from `mbtcp_server_expire`: close the session or wait for the rest of its timeout */
+static void conn_idle(struct timerwheel_timer *timer, void *arg)
+{
+    struct mbtcp_server *server = arg;
+    struct mbtcp_conn *conn = rt_container_of(timer, struct mbtcp_conn, timer);
+    uint32_t timeout = rt_tick_from_millisecond(server->idle_timeout);
+
+    if (rt_tick_get() - conn->tick_active < timeout) {
+        timerwheel_add(&server->wheel, timer, conn->tick_active + timeout);
+        return;
+    }
+
+    LOG_W("socket %d timeout.", conn->fd);
+    server->stat.timeouts++;
+    server->close_conn(server, conn);
+}
+
+void mbtcp_server_conn_touch(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    (void)server;
+    conn->tick_active = rt_tick_get();
+}
+
+/* Count a new session and arm its idle timer */
+void mbtcp_server_conn_add(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    conn->tick_active = rt_tick_get();
+    timerwheel_timer_init(&conn->timer, conn_idle, server);
+    if (server->idle_timeout > 0)
+        timerwheel_add(&server->wheel, &conn->timer, conn->tick_active + rt_tick_from_millisecond(server->idle_timeout));
+
+    rt_list_insert_before(&server->conns, &conn->list);
+    server->nb_conns++;
+    server->stat.accepted++;
+}
+
+void mbtcp_server_conn_remove(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    timerwheel_del(&server->wheel, &conn->timer);
+    rt_list_remove(&conn->list);
+}
+
+struct mbtcp_conn *mbtcp_server_conn_alloc(struct mbtcp_server *server)
+{
+    rt_slist_t *node = rt_slist_first(&server->pool);
+    if (node == NULL) {
+        struct mbtcp_conn *conn = malloc(sizeof(struct mbtcp_conn));
+        if (conn)
+            conn->tx_buf = NULL;
+        return conn;
+    }
+
+    rt_slist_remove(&server->pool, node);
+    server->nb_pool--;
+
+    return rt_slist_entry(node, struct mbtcp_conn, pool);
+}
+
+/* Pooled sessions keep their output buffer */
+void mbtcp_server_conn_free(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    if (server->nb_pool < MBTCP_SERVER_POOL_SIZE) {
+        rt_slist_insert(&server->pool, &conn->pool);
+        server->nb_pool++;
+        return;
+    }
+
+    free(conn->tx_buf);
+    free(conn);
+}
+
+static void conn_close(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    if (server->close_cb)
+        server->close_cb(server, conn);
+
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    mbtcp_server_conn_remove(server, conn);
+    mbtcp_server_conn_free(server, conn);
+
+    server->nb_conns--;
+    server->stat.closed++;
+
+    if (server->accept_paused) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = server};
+        if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, server->listen_fd, &ev) == 0)
+            server->accept_paused = 0;
+    }
+}
+
+static int conn_update_events(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    int queued = conn->tx_tail - conn->tx_head;
+    uint32_t events = 0;
+
+    if (queued < MBTCP_SERVER_TX_HIGH)
+        events |= EPOLLIN;
+    if (queued > 0)
+        events |= EPOLLOUT;
+
+    if (events == conn->events)
+        return 0;
+
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        return -1;
+
+    if (!(events & EPOLLIN))
+        server->stat.stalls++;
+
+    conn->events = events;
+
+    return 0;
+}
+
+static int conn_send(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len)
+{
+    (void)server;
+
+    /* Only write directly when nothing is queued, otherwise frames reorder */
+    if (conn->tx_tail == conn->tx_head) {
+        int rc = send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -1;
+            rc = 0;
+        }
+
+        if (rc == len)
+            return 0;
+
+        buf += rc;
+        len -= rc;
+    }
+
+    if (conn->tx_buf == NULL) {
+        conn->tx_buf = malloc(MBTCP_SERVER_TX_SIZE);
+        if (conn->tx_buf == NULL)
+            return -1;
+    }
+
+    if (conn->tx_tail + len > MBTCP_SERVER_TX_SIZE) {
+        memmove(conn->tx_buf, conn->tx_buf + conn->tx_head, conn->tx_tail - conn->tx_head);
+        conn->tx_tail -= conn->tx_head;
+        conn->tx_head = 0;
+    }
+
+    /* Requests are not processed past TX_HIGH, so one response always fits */
+    if (conn->tx_tail + len > MBTCP_SERVER_TX_SIZE)
+        return -1;
+
+    memcpy(conn->tx_buf + conn->tx_tail, buf, len);
+    conn->tx_tail += len;
+
+    return 0;
+}
+
+static int conn_flush(struct mbtcp_conn *conn)
+{
+    while (conn->tx_tail > conn->tx_head) {
+        int rc = send(conn->fd, conn->tx_buf + conn->tx_head, conn->tx_tail - conn->tx_head, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        conn->tx_head += rc;
+    }
+
+    if (conn->tx_head == conn->tx_tail)
+        conn->tx_head = conn->tx_tail = 0;
+
+    return 0;
+}
+
+/*
+ * Length of the RTU request at `frame` from its function code and sub-function, 0 while too little is received to
+ * tell, -1 when they don't give one: return query data and custom function codes.
+ */
+static int rtu_request_length(const uint8_t *frame, int len)
+{
+    if (len < 2)
+        return 0;
+
+    switch (frame[1]) {
+    case AGILE_MODBUS_FC_READ_COILS:
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return 8;
+    case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
+    case AGILE_MODBUS_FC_REPORT_SLAVE_ID:
+        return 4;
+    case AGILE_MODBUS_FC_DIAGNOSTICS:
+        if (len < 4)
+            return 0;
+        return (frame[2] << 8) + frame[3] == AGILE_MODBUS_DIAG_RETURN_QUERY_DATA ? -1 : 8;
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return len < 7 ? 0 : 9 + frame[6];
+    case AGILE_MODBUS_FC_READ_FILE_RECORD:
+    case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+        return len < 3 ? 0 : 5 + frame[2];
+    case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
+        return 10;
+    case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return len < 11 ? 0 : 13 + frame[10];
+    case AGILE_MODBUS_FC_READ_FIFO_QUEUE:
+        return 6;
+    case AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE:
+        if (len < 3)
+            return 0;
+        return frame[2] == AGILE_MODBUS_MEI_READ_DEVICE_ID ? 7 : -1;
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+/* Checked without the core so that resynchronising doesn't count a CRC error at every byte */
+static int rtu_crc_match(const uint8_t *frame, int length)
+{
+    uint16_t crc = agile_modbus_rtu_crc16(frame, length - 2);
+
+    return crc == ((frame[length - 2] << 8) | frame[length - 1]);
+}
+
+/* Frame length, 0 while incomplete, -1 when `frame` is not a frame: closes a TCP session, skips a byte in RTU */
+static int conn_frame_length(struct mbtcp_server *server, uint8_t *frame, int len)
+{
+    if (server->rtu) {
+        int length = rtu_request_length(frame, len);
+
+        if (len >= 2 && (frame[1] == 0 || frame[1] & 0x80))
+            return -1;
+
+        /* Complete once the CRC matches, a bad one is known as soon as the function code gives the length */
+        if (length > 0) {
+            if (length > AGILE_MODBUS_RTU_MAX_ADU_LENGTH)
+                return -1;
+            if (len < length)
+                return 0;
+
+            return rtu_crc_match(frame, length) ? length : -1;
+        }
+        if (length == 0)
+            return 0;
+
+        /* Without a length the frame ends at the first CRC that matches, return query data carries two bytes at least */
+        int n = frame[1] == AGILE_MODBUS_FC_DIAGNOSTICS ? 8 : 4;
+        for (; n <= len && n <= AGILE_MODBUS_RTU_MAX_ADU_LENGTH; n++) {
+            if (rtu_crc_match(frame, n))
+                return n;
+        }
+
+        return len >= AGILE_MODBUS_RTU_MAX_ADU_LENGTH ? -1 : 0;
+    }
+
+    if (len < MBTCP_MBAP_LENGTH)
+        return 0;
+
+    int length = (frame[4] << 8) + frame[5];
+    if (length < 2 || length > AGILE_MODBUS_TCP_MAX_ADU_LENGTH - 6)
+        return -1;
+
+    return len < length + 6 ? 0 : length + 6;
+}
+
+/*
+ * Handle the complete frames in the receive buffer and pass the responses to
+ * `send`. Stops early while the session has MBTCP_SERVER_TX_HIGH bytes queued.
+ */
+int mbtcp_server_conn_process(struct mbtcp_server *server, struct mbtcp_conn *conn, mbtcp_server_send_t send)
+{
+    agile_modbus_t *ctx = server->rtu ? &server->ctx_rtu._ctx : &server->ctx_tcp._ctx;
+    int pos = 0;
+
+    while (conn->rx_len > pos) {
+        if (conn->tx_tail - conn->tx_head >= MBTCP_SERVER_TX_HIGH)
+            break;
+
+        uint8_t *frame = conn->rx_buf + pos;
+        int frame_len = conn_frame_length(server, frame, conn->rx_len - pos);
+        if (frame_len < 0) {
+            if (!server->rtu)
+                return -1;
+
+            /* No length field to skip by, look for a frame at the next byte. One CRC error per skipped run */
+            if (!conn->resync) {
+                conn->resync = 1;
+                server->diag.bus_comm_error++;
+            }
+            pos++;
+            continue;
+        }
+        if (frame_len == 0)
+            break;
+
+        pos += frame_len;
+        conn->resync = 0;
+        server->stat.requests++;
+
+        int send_len;
+        if (server->request_cb) {
+            send_len = server->request_cb(server, conn, frame, frame_len);
+            if (send_len < 0)
+                return -1;
+        } else {
+            ctx->read_buf = frame;
+            ctx->read_bufsz = frame_len;
+            send_len = agile_modbus_slave_handle(ctx, frame_len, 0, server->slave_cb, server->slave_data, NULL);
+        }
+
+        if (send_len > 0) {
+            if (send(server, conn, ctx->send_buf, send_len) < 0)
+                return -1;
+        }
+    }
+
+    if (pos > 0) {
+        conn->rx_len -= pos;
+        if (conn->rx_len > 0)
+            memmove(conn->rx_buf, conn->rx_buf + pos, conn->rx_len);
+    }
+
+    return 0;
+}
+
+static int conn_read(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    while (conn->tx_tail - conn->tx_head < MBTCP_SERVER_TX_HIGH) {
+        int space = MBTCP_SERVER_RX_SIZE - conn->rx_len;
+        if (space <= 0)
+            break;
+
+        int rc = recv(conn->fd, conn->rx_buf + conn->rx_len, space, MSG_DONTWAIT);
+        if (rc == 0)
+            return -1;
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        conn->rx_len += rc;
+        mbtcp_server_conn_touch(server, conn);
+
+        if (mbtcp_server_conn_process(server, conn, conn_send) < 0)
+            return -1;
+
+        /* A short read means the socket is drained */
+        if (rc < space)
+            break;
+    }
+
+    return 0;
+}
+
+static void conn_event(struct mbtcp_server *server, struct mbtcp_conn *conn, uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+        goto _close;
+
+    if (events & EPOLLOUT) {
+        /* A session draining its output is not idle */
+        if (conn_flush(conn) < 0)
+            goto _close;
+        mbtcp_server_conn_touch(server, conn);
+
+        /* Requests left behind by backpressure */
+        if (mbtcp_server_conn_process(server, conn, conn_send) < 0)
+            goto _close;
+    }
+
+    if (events & EPOLLIN) {
+        if (conn_read(server, conn) < 0)
+            goto _close;
+    }
+
+    if (conn_update_events(server, conn) < 0)
+        goto _close;
+
+    return;
+
+_close:
+    conn_close(server, conn);
+}
+
+static void server_accept(struct mbtcp_server *server)
+{
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EMFILE || errno == ENFILE) {
+                /* Stop polling the listener until a session goes away */
+                struct epoll_event ev = {.events = 0, .data.ptr = server};
+                if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, server->listen_fd, &ev) == 0)
+                    server->accept_paused = 1;
+                LOG_W("out of file descriptors, accepting paused.");
+            }
+            break;
+        }
+
+        if (server->nb_conns >= server->max_conns) {
+            server->stat.rejected++;
+            close(fd);
+            continue;
+        }
+
+        struct mbtcp_conn *conn = mbtcp_server_conn_alloc(server);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        int option = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->tx_head = conn->tx_tail = 0;
+        conn->rx_len = 0;
+        conn->resync = 0;
+
+        struct epoll_event ev = {.events = conn->events, .data.ptr = conn};
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            mbtcp_server_conn_free(server, conn);
+            continue;
+        }
+
+        mbtcp_server_conn_add(server, conn);
+    }
+}
+
+/* Close idle sessions with `close_conn`, return the time in ms until the next one expires */
+int mbtcp_server_expire(struct mbtcp_server *server, void (*close_conn)(struct mbtcp_server *server, struct mbtcp_conn *conn))
+{
+    uint32_t now = rt_tick_get();
+    uint32_t next;
+
+    server->close_conn = close_conn;
+    timerwheel_run(&server->wheel, now);
+
+    if (timerwheel_next(&server->wheel, &next) < 0)
+        return -1;
+
+    int32_t ticks = (int32_t)(next - now);
+    if (ticks <= 0)
+        return 0;
+
+    return (int)((int64_t)ticks * 1000 / RT_TICK_PER_SECOND) + 1;
+}
+
+int mbtcp_server_init(struct mbtcp_server *server, int port, int max_conns, int idle_timeout,
+                      agile_modbus_slave_callback_t slave_cb, const void *slave_data)
+{
+    memset(server, 0, sizeof(struct mbtcp_server));
+    server->port = port;
+    server->max_conns = max_conns;
+    server->idle_timeout = idle_timeout;
+    server->slave_cb = slave_cb;
+    server->slave_data = slave_data;
+    server->cpu = -1;
+#ifdef MBTCP_SERVER_USING_URING
+    server->uring = 1;
+#endif
+    server->listen_fd = -1;
+    server->running = 1;
+    rt_list_init(&server->conns);
+    rt_slist_init(&server->pool);
+    timerwheel_init(&server->wheel, rt_tick_get());
+
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->epfd < 0 || server->wake_fd < 0) {
+        mbtcp_server_deinit(server);
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &server->wake_fd};
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->wake_fd, &ev) < 0) {
+        mbtcp_server_deinit(server);
+        return -1;
+    }
+
+    agile_modbus_tcp_init(&server->ctx_tcp, server->send_buf, sizeof(server->send_buf), NULL, 0);
+    agile_modbus_set_slave(&server->ctx_tcp._ctx, 1);
+    agile_modbus_rtu_init(&server->ctx_rtu, server->send_buf, sizeof(server->send_buf), NULL, 0);
+    agile_modbus_set_slave(&server->ctx_rtu._ctx, 1);
+
+    /* Both framings are served on the server thread, they share the diagnostics counters (0x08) */
+    agile_modbus_set_diag(&server->ctx_tcp._ctx, &server->diag);
+    agile_modbus_set_diag(&server->ctx_rtu._ctx, &server->diag);
+
+    return 0;
+}
+
+void mbtcp_server_deinit(struct mbtcp_server *server)
+{
+    while (!rt_list_isempty(&server->conns))
+        conn_close(server, rt_list_first_entry(&server->conns, struct mbtcp_conn, list));
+
+    rt_slist_t *node;
+    while ((node = rt_slist_first(&server->pool)) != NULL) {
+        struct mbtcp_conn *conn = rt_slist_entry(node, struct mbtcp_conn, pool);
+        rt_slist_remove(&server->pool, node);
+        free(conn->tx_buf);
+        free(conn);
+    }
+    server->nb_pool = 0;
+
+    if (server->listen_fd >= 0)
+        tcp_close(server->listen_fd);
+    if (server->wake_fd >= 0)
+        close(server->wake_fd);
+    if (server->epfd >= 0)
+        close(server->epfd);
+
+    server->listen_fd = server->wake_fd = server->epfd = -1;
+}
+
+static int server_loop(struct mbtcp_server *server)
+{
+    struct epoll_event events[MBTCP_SERVER_MAX_EVENTS];
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = server};
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0)
+        return -1;
+
+    while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+        int timeout = mbtcp_server_expire(server, conn_close);
+
+        int n = epoll_wait(server->epfd, events, MBTCP_SERVER_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == server) {
+                server_accept(server);
+            } else if (ptr == &server->wake_fd) {
+                uint64_t value;
+                ssize_t rc = read(server->wake_fd, &value, sizeof(value));
+                (void)rc;
+                if (server->wake_cb)
+                    server->wake_cb(server);
+            } else {
+                conn_event(server, (struct mbtcp_conn *)ptr, events[i].events);
+            }
+        }
+    }
+
+    while (!rt_list_isempty(&server->conns))
+        conn_close(server, rt_list_first_entry(&server->conns, struct mbtcp_conn, list));
+
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, server->listen_fd, NULL);
+
+    return __atomic_load_n(&server->running, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
+
+/* Serve until `mbtcp_server_stop`, return 0 when stopped and -1 on error */
+int mbtcp_server_run(struct mbtcp_server *server)
+{
+    int rc;
+
+    if (server->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(server->cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+            LOG_W("pin to cpu %d failed.", server->cpu);
+    }
+
+    if (server->reuseport)
+        server->listen_fd = tcp_listen_shared(server->port, MBTCP_SERVER_BACKLOG);
+    else
+        server->listen_fd = tcp_listen(server->port, MBTCP_SERVER_BACKLOG);
+    if (server->listen_fd < 0)
+        return -1;
+
+    if (server->cpu >= 0)
+        LOG_I("mbtcp server listening on port %d, cpu %d.", server->port, server->cpu);
+    else
+        LOG_I("mbtcp server listening on port %d.", server->port);
+
+#ifdef MBTCP_SERVER_USING_URING
+    if (server->uring)
+        rc = mbtcp_server_uring_loop(server);
+    else
+#endif
+        rc = server_loop(server);
+
+    tcp_close(server->listen_fd);
+    server->listen_fd = -1;
+
+    return rc;
+}
+
+void mbtcp_server_stop(struct mbtcp_server *server)
+{
+    __atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
+    mbtcp_server_wake(server);
+}
+
+/* Safe from any thread, `wake_cb` then runs on the server thread */
+void mbtcp_server_wake(struct mbtcp_server *server)
+{
+    uint64_t value = 1;
+
+    ssize_t rc = write(server->wake_fd, &value, sizeof(value));
+    (void)rc;
+}
+
+/* Send a deferred response, on the server thread. The session is closed on failure */
+int mbtcp_server_reply(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len)
+{
+#ifdef MBTCP_SERVER_USING_URING
+    if (server->ring)
+        return mbtcp_server_uring_reply(server, conn, buf, len);
+#endif
+
+    mbtcp_server_conn_touch(server, conn);
+
+    if (conn_send(server, conn, buf, len) < 0 || conn_update_events(server, conn) < 0) {
+        conn_close(server, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *group_entry(void *param)
+{
+    mbtcp_server_run((struct mbtcp_server *)param);
+
+    return NULL;
+}
+
+/* `max_conns` applies to each shard. Shards are pinned round-robin over the online CPUs when there are several */
+int mbtcp_server_group_init(struct mbtcp_server_group *group, int nb_shards, int port, int max_conns, int idle_timeout,
+                            agile_modbus_slave_callback_t slave_cb, const void *slave_data)
+{
+    long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (nb_shards <= 0)
+        return -1;
+
+    memset(group, 0, sizeof(struct mbtcp_server_group));
+    group->servers = calloc(nb_shards, sizeof(struct mbtcp_server));
+    group->tids = calloc(nb_shards, sizeof(pthread_t));
+    if (group->servers == NULL || group->tids == NULL) {
+        mbtcp_server_group_deinit(group);
+        return -1;
+    }
+
+    for (int i = 0; i < nb_shards; i++) {
+        struct mbtcp_server *server = &group->servers[i];
+
+        if (mbtcp_server_init(server, port, max_conns, idle_timeout, slave_cb, slave_data) < 0) {
+            mbtcp_server_group_deinit(group);
+            return -1;
+        }
+
+        group->nb++;
+        server->reuseport = 1;
+        if (nb_shards > 1 && nb_cpus > 0)
+            server->cpu = i % nb_cpus;
+    }
+
+    return 0;
+}
+
+void mbtcp_server_group_deinit(struct mbtcp_server_group *group)
+{
+    for (int i = 0; i < group->nb; i++)
+        mbtcp_server_deinit(&group->servers[i]);
+
+    free(group->servers);
+    free(group->tids);
+    memset(group, 0, sizeof(struct mbtcp_server_group));
+}
+
+/* Run shard 0 in the calling thread and the others in their own, return like `mbtcp_server_run` for shard 0 */
+int mbtcp_server_group_run(struct mbtcp_server_group *group)
+{
+    int started = 1;
+
+    for (; started < group->nb; started++) {
+        if (pthread_create(&group->tids[started], NULL, group_entry, &group->servers[started]) != 0)
+            break;
+    }
+
+    int rc = -1;
+    if (started == group->nb)
+        rc = mbtcp_server_run(&group->servers[0]);
+
+    mbtcp_server_group_stop(group);
+    for (int i = 1; i < started; i++)
+        pthread_join(group->tids[i], NULL);
+
+    return rc;
+}
+
+void mbtcp_server_group_stop(struct mbtcp_server_group *group)
+{
+    for (int i = 0; i < group->nb; i++)
+        mbtcp_server_stop(&group->servers[i]);
+}
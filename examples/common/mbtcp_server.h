@@ -0,0 +1,184 @@
+#ifndef __MBTCP_SERVER_H
+#define __MBTCP_SERVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "agile_modbus.h"
+#include "rtservice.h"
+#include "timerwheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event-driven Modbus TCP server.
+ *
+ * One thread multiplexes every session of a listening socket with epoll.
+ * A session is a plain structure: a receive buffer where MBAP frames are
+ * reassembled incrementally and an output queue that is only allocated once
+ * the peer stops keeping up. Requests of all sessions are handled on one
+ * agile_modbus_tcp_t whose read buffer points into the session buffer, so no
+ * frame is copied before it reaches `agile_modbus_slave_handle`.
+ *
+ * Backpressure: once MBTCP_SERVER_TX_HIGH bytes are queued for a session it
+ * is no longer read, and buffered requests are left unprocessed, until the
+ * queue drains. A client that never reads can't make the server buffer more
+ * than MBTCP_SERVER_TX_SIZE bytes.
+ *
+ * Each session has an idle timer on the server's timer wheel. Activity only
+ * records its tick; when the timer fires, a session that was active since is
+ * armed again for the rest of its timeout, so traffic costs no timer work.
+ * Closed sessions are kept in a per-server pool of up to
+ * MBTCP_SERVER_POOL_SIZE for reuse.
+ *
+ * Sharded mode (`mbtcp_server_group`): N servers, each with its own thread,
+ * listening socket (SO_REUSEPORT), context, buffers and session pool, pinned
+ * to one CPU. The kernel spreads connections over the listening sockets and
+ * a session stays on its shard, so shards only meet in the slave callback.
+ *
+ * io_uring backend (build with MBTCP_SERVER_USING_URING): the same sessions
+ * driven by multishot accept / receive into a registered buffer ring, with
+ * responses queued per session and sent by linked send requests. Selected
+ * per server by `uring`, which defaults to 1 when the backend is built.
+ *
+ * Deferred mode: with `request_cb` set, frames go to it instead of the slave
+ * callback. It returns the length of a response built in `send_buf`, 0 to
+ * answer later with `mbtcp_server_reply`, or -1 to close the session. Work
+ * done in other threads gets back to the server thread with
+ * `mbtcp_server_wake`, which calls `wake_cb` there. `close_cb` tells that a
+ * session is going away, after which it must not be replied to.
+ *
+ * RTU over TCP (`rtu`): sessions carry RTU ADUs instead of MBAP frames.
+ * There are no gaps on a stream, so a frame ends where its function code
+ * and sub-function say and its CRC matches. Return query data and custom
+ * function codes end at the first CRC that matches. A byte that does not
+ * start a frame is skipped and the next one is tried.
+ */
+#define MBTCP_SERVER_RX_SIZE    (AGILE_MODBUS_TCP_MAX_ADU_LENGTH * 2)
+#define MBTCP_SERVER_TX_HIGH    (AGILE_MODBUS_TCP_MAX_ADU_LENGTH * 16)
+#define MBTCP_SERVER_TX_SIZE    (MBTCP_SERVER_TX_HIGH + AGILE_MODBUS_TCP_MAX_ADU_LENGTH)
+#define MBTCP_SERVER_MAX_EVENTS 64
+#define MBTCP_SERVER_BACKLOG    128
+#define MBTCP_SERVER_POOL_SIZE  64
+
+struct mbtcp_conn {
+    int fd;
+    uint32_t events;
+    uint32_t tick_active;
+    struct timerwheel_timer timer;
+    rt_list_t list;
+    rt_slist_t pool;
+    uint8_t *tx_buf;
+    int tx_head;
+    int tx_tail;
+#ifdef MBTCP_SERVER_USING_URING
+    int inflight;
+    int nb_sends;
+    uint8_t recv_armed;
+    uint8_t recv_starved;
+    uint8_t cancelling;
+    uint8_t closing;
+    uint8_t flush_pending;
+    rt_slist_t flush;
+    int held_head;
+    int held_tail;
+#endif
+    int rx_len;
+    uint8_t resync; /* RTU: skipping bytes that don't start a frame */
+    uint8_t rx_buf[MBTCP_SERVER_RX_SIZE];
+};
+
+struct mbtcp_server_stat {
+    uint32_t accepted;
+    uint32_t rejected;
+    uint32_t closed;
+    uint32_t timeouts;
+    uint32_t requests;
+    uint32_t stalls;
+};
+
+struct mbtcp_server;
+
+typedef int (*mbtcp_server_request_t)(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *frame, int len);
+typedef void (*mbtcp_server_close_t)(struct mbtcp_server *server, struct mbtcp_conn *conn);
+typedef void (*mbtcp_server_wake_t)(struct mbtcp_server *server);
+
+struct mbtcp_server {
+    int port;
+    int max_conns;
+    int idle_timeout;
+    agile_modbus_slave_callback_t slave_cb;
+    const void *slave_data;
+    int reuseport;
+    int cpu;
+    int rtu;
+    mbtcp_server_request_t request_cb;
+    mbtcp_server_close_t close_cb;
+    mbtcp_server_wake_t wake_cb;
+    void *user_data;
+#ifdef MBTCP_SERVER_USING_URING
+    int uring;
+    void *ring;
+#endif
+
+    int listen_fd;
+    int epfd;
+    int wake_fd;
+    int running;
+    int accept_paused;
+    int nb_conns;
+    rt_list_t conns;
+    struct timerwheel wheel;
+    void (*close_conn)(struct mbtcp_server *server, struct mbtcp_conn *conn);
+    rt_slist_t pool;
+    int nb_pool;
+
+    agile_modbus_tcp_t ctx_tcp;
+    agile_modbus_rtu_t ctx_rtu;
+    uint8_t send_buf[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+
+    struct mbtcp_server_stat stat;
+    agile_modbus_diag_t diag;
+};
+
+typedef int (*mbtcp_server_send_t)(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len);
+
+struct mbtcp_server_group {
+    struct mbtcp_server *servers;
+    pthread_t *tids;
+    int nb;
+};
+
+int mbtcp_server_init(struct mbtcp_server *server, int port, int max_conns, int idle_timeout,
+                      agile_modbus_slave_callback_t slave_cb, const void *slave_data);
+void mbtcp_server_deinit(struct mbtcp_server *server);
+int mbtcp_server_run(struct mbtcp_server *server);
+void mbtcp_server_stop(struct mbtcp_server *server);
+void mbtcp_server_wake(struct mbtcp_server *server);
+int mbtcp_server_reply(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len);
+
+/* Shared by the event loop backends */
+void mbtcp_server_conn_touch(struct mbtcp_server *server, struct mbtcp_conn *conn);
+void mbtcp_server_conn_add(struct mbtcp_server *server, struct mbtcp_conn *conn);
+void mbtcp_server_conn_remove(struct mbtcp_server *server, struct mbtcp_conn *conn);
+struct mbtcp_conn *mbtcp_server_conn_alloc(struct mbtcp_server *server);
+void mbtcp_server_conn_free(struct mbtcp_server *server, struct mbtcp_conn *conn);
+int mbtcp_server_conn_process(struct mbtcp_server *server, struct mbtcp_conn *conn, mbtcp_server_send_t send);
+int mbtcp_server_expire(struct mbtcp_server *server, void (*close_conn)(struct mbtcp_server *server, struct mbtcp_conn *conn));
+#ifdef MBTCP_SERVER_USING_URING
+int mbtcp_server_uring_loop(struct mbtcp_server *server);
+int mbtcp_server_uring_reply(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len);
+#endif
+
+int mbtcp_server_group_init(struct mbtcp_server_group *group, int nb_shards, int port, int max_conns, int idle_timeout,
+                            agile_modbus_slave_callback_t slave_cb, const void *slave_data);
+void mbtcp_server_group_deinit(struct mbtcp_server_group *group);
+int mbtcp_server_group_run(struct mbtcp_server_group *group);
+void mbtcp_server_group_stop(struct mbtcp_server_group *group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,869 @@
+#define _GNU_SOURCE
+#include "mbtcp_server.h"
+
+#ifdef MBTCP_SERVER_USING_URING
+
+#include "rt_tick.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbtcp_uring"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+/*
+ * io_uring event loop of mbtcp_server, on raw system calls.
+ *
+ * - One multishot accept and one multishot poll of the wake eventfd stay
+ *   armed for the life of the loop.
+ * - Each session has one multishot receive selecting buffers from a ring of
+ *   MBTCP_URING_NB_BUFS buffers registered with IORING_REGISTER_PBUF_RING.
+ *   Data is deframed into the session receive buffer and the kernel buffer
+ *   is handed back at once.
+ * - Responses go to a circular output queue. After each batch of completions
+ *   the queue of every session that got new data is sent, as one send or,
+ *   when it wraps, as two sends linked with IOSQE_IO_LINK. MSG_WAITALL makes
+ *   a short send fail, which cuts the link.
+ * - Backpressure: a session over MBTCP_SERVER_TX_HIGH has its receive
+ *   cancelled. Buffers that complete before the cancel are held in order and
+ *   replayed when the output queue drains. Receives that end because every
+ *   buffer is held are armed again once one comes back.
+ * - A session is freed only after the kernel has returned every request that
+ *   refers to it.
+ */
+#define MBTCP_URING_ENTRIES  256
+#define MBTCP_URING_NB_BUFS  512
+#define MBTCP_URING_BUF_SIZE 2048
+#define MBTCP_URING_BGID     0
+
+#define MBTCP_URING_OP_ACCEPT 1
+#define MBTCP_URING_OP_WAKE   2
+#define MBTCP_URING_OP_RECV   3
+#define MBTCP_URING_OP_SEND   4
+#define MBTCP_URING_OP_CANCEL 5
+#define MBTCP_URING_OP_MASK   0x7
+
+struct mbtcp_uring {
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    uint8_t *bufs;
+    int nb_starved;
+    int buf_returned;
+
+    /* Per buffer id: next held buffer, consumed offset and length */
+    int16_t held_next[MBTCP_URING_NB_BUFS];
+    uint16_t held_off[MBTCP_URING_NB_BUFS];
+    uint16_t held_len[MBTCP_URING_NB_BUFS];
+
+    rt_slist_t flush_list;
+    int accept_armed;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_deinit(struct mbtcp_uring *ring)
+{
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->br && ring->br != MAP_FAILED)
+        munmap(ring->br, ring->br_size);
+    free(ring->bufs);
+}
+
+static void uring_buf_recycle(struct mbtcp_uring *ring, int bid)
+{
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (MBTCP_URING_NB_BUFS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + bid * MBTCP_URING_BUF_SIZE);
+    buf->len = MBTCP_URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_init(struct mbtcp_uring *ring)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(struct mbtcp_uring));
+    rt_slist_init(&ring->flush_list);
+
+    /* Completions are only reaped by the loop thread, let the kernel defer work to it */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = uring_setup(MBTCP_URING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = uring_setup(MBTCP_URING_ENTRIES, &p);
+    }
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto _fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto _fail;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto _fail;
+
+    ring->sq_head = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ptr + p.cq_off.cqes);
+
+    /* Receive buffer ring */
+    ring->br_size = MBTCP_URING_NB_BUFS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ring->bufs = malloc(MBTCP_URING_NB_BUFS * MBTCP_URING_BUF_SIZE);
+    if (ring->br == MAP_FAILED || ring->bufs == NULL)
+        goto _fail;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = MBTCP_URING_NB_BUFS;
+    reg.bgid = MBTCP_URING_BGID;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto _fail;
+
+    for (int i = 0; i < MBTCP_URING_NB_BUFS; i++)
+        uring_buf_recycle(ring, i);
+
+    return 0;
+
+_fail:
+    uring_deinit(ring);
+    return -1;
+}
+
+static int uring_submit(struct mbtcp_uring *ring, unsigned min_complete, int timeout)
+{
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *parg = NULL;
+    size_t argsz = 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            parg = &arg;
+            argsz = sizeof(arg);
+        }
+    }
+
+    if (to_submit == 0 && min_complete == 0)
+        return 0;
+
+    int rc = uring_enter(ring->fd, to_submit, min_complete, flags, parg, argsz);
+    if (rc < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+        return 0;
+
+    return rc;
+}
+
+static struct io_uring_sqe *uring_sqe(struct mbtcp_uring *ring)
+{
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_submit(ring, 0, -1);
+        if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+static uint64_t uring_data(void *ptr, int op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static int uring_arm_accept(struct mbtcp_uring *ring, struct mbtcp_server *server)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_data(NULL, MBTCP_URING_OP_ACCEPT);
+    ring->accept_armed = 1;
+
+    return 0;
+}
+
+static int uring_arm_wake(struct mbtcp_uring *ring, struct mbtcp_server *server)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_data(NULL, MBTCP_URING_OP_WAKE);
+
+    return 0;
+}
+
+static int uring_arm_recv(struct mbtcp_uring *ring, struct mbtcp_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = MBTCP_URING_BGID;
+    sqe->user_data = uring_data(conn, MBTCP_URING_OP_RECV);
+
+    conn->recv_armed = 1;
+    conn->inflight++;
+
+    return 0;
+}
+
+static int uring_cancel_recv(struct mbtcp_uring *ring, struct mbtcp_conn *conn)
+{
+    if (!conn->recv_armed || conn->cancelling)
+        return 0;
+
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_data(conn, MBTCP_URING_OP_RECV);
+    sqe->user_data = uring_data(conn, MBTCP_URING_OP_CANCEL);
+
+    conn->cancelling = 1;
+    conn->inflight++;
+
+    return 0;
+}
+
+static int uring_queued(struct mbtcp_conn *conn)
+{
+    return conn->tx_tail - conn->tx_head;
+}
+
+/* `tx_head` is the queue start in [0, MBTCP_SERVER_TX_SIZE), `tx_tail` is `tx_head` plus the queued length */
+static int uring_conn_send(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+
+    if (conn->tx_buf == NULL) {
+        conn->tx_buf = malloc(MBTCP_SERVER_TX_SIZE);
+        if (conn->tx_buf == NULL)
+            return -1;
+    }
+
+    if (uring_queued(conn) + len > MBTCP_SERVER_TX_SIZE)
+        return -1;
+
+    int start = conn->tx_tail % MBTCP_SERVER_TX_SIZE;
+    int first = MBTCP_SERVER_TX_SIZE - start;
+    if (first > len)
+        first = len;
+
+    memcpy(conn->tx_buf + start, buf, first);
+    memcpy(conn->tx_buf, buf + first, len - first);
+    conn->tx_tail += len;
+
+    if (!conn->flush_pending) {
+        conn->flush_pending = 1;
+        rt_slist_insert(&ring->flush_list, &conn->flush);
+    }
+
+    return 0;
+}
+
+static int uring_flush(struct mbtcp_uring *ring, struct mbtcp_conn *conn)
+{
+    int queued = uring_queued(conn);
+
+    if (conn->nb_sends > 0 || conn->closing || queued == 0)
+        return 0;
+
+    int start = conn->tx_head;
+    int first = MBTCP_SERVER_TX_SIZE - start;
+    if (first > queued)
+        first = queued;
+
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->tx_buf + start);
+    sqe->len = first;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_data(conn, MBTCP_URING_OP_SEND);
+    conn->nb_sends++;
+    conn->inflight++;
+
+    if (queued == first)
+        return 0;
+
+    /* The queue wraps, the second half must not start before the first is sent */
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = uring_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->tx_buf;
+    sqe->len = queued - first;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = uring_data(conn, MBTCP_URING_OP_SEND);
+    conn->nb_sends++;
+    conn->inflight++;
+
+    return 0;
+}
+
+static void uring_held_push(struct mbtcp_uring *ring, struct mbtcp_conn *conn, int bid, int off, int len)
+{
+    ring->held_next[bid] = -1;
+    ring->held_off[bid] = off;
+    ring->held_len[bid] = len;
+
+    if (conn->held_tail >= 0)
+        ring->held_next[conn->held_tail] = bid;
+    else
+        conn->held_head = bid;
+    conn->held_tail = bid;
+}
+
+static void uring_buf_release(struct mbtcp_uring *ring, int bid)
+{
+    uring_buf_recycle(ring, bid);
+    ring->buf_returned = 1;
+}
+
+/* Copy received bytes through the receive buffer, return how many were taken */
+static int uring_feed(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *data, int len)
+{
+    int pos = 0;
+
+    while (pos < len) {
+        int n = MBTCP_SERVER_RX_SIZE - conn->rx_len;
+        if (n > len - pos)
+            n = len - pos;
+        if (n == 0)
+            break;
+
+        memcpy(conn->rx_buf + conn->rx_len, data + pos, n);
+        conn->rx_len += n;
+        pos += n;
+
+        if (mbtcp_server_conn_process(server, conn, uring_conn_send) < 0)
+            return -1;
+    }
+
+    return pos;
+}
+
+static void uring_close(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    if (conn->closing)
+        return;
+
+    if (server->close_cb)
+        server->close_cb(server, conn);
+
+    conn->closing = 1;
+    mbtcp_server_conn_remove(server, conn);
+
+    /* Ends the receive and any send still waiting for room */
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+/* Free a closing session once the kernel has given back all its requests */
+static void uring_put(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+
+    if (!conn->closing || conn->inflight > 0)
+        return;
+
+    if (conn->flush_pending)
+        rt_slist_remove(&ring->flush_list, &conn->flush);
+
+    while (conn->held_head >= 0) {
+        int bid = conn->held_head;
+        conn->held_head = ring->held_next[bid];
+        uring_buf_release(ring, bid);
+    }
+
+    close(conn->fd);
+    mbtcp_server_conn_free(server, conn);
+
+    server->nb_conns--;
+    server->stat.closed++;
+
+    if (server->accept_paused && !ring->accept_armed) {
+        if (uring_arm_accept(ring, server) == 0)
+            server->accept_paused = 0;
+    }
+}
+
+static void uring_close_put(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    uring_close(server, conn);
+    uring_put(server, conn);
+}
+
+/* Replay held data once the output queue has room, then receive again */
+static int uring_resume(struct mbtcp_server *server, struct mbtcp_conn *conn)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+
+    if (mbtcp_server_conn_process(server, conn, uring_conn_send) < 0)
+        return -1;
+
+    while (conn->held_head >= 0 && uring_queued(conn) < MBTCP_SERVER_TX_HIGH) {
+        int bid = conn->held_head;
+        int off = ring->held_off[bid];
+        int len = ring->held_len[bid] - off;
+
+        int rc = uring_feed(server, conn, ring->bufs + bid * MBTCP_URING_BUF_SIZE + off, len);
+        if (rc < 0)
+            return -1;
+
+        if (rc < len) {
+            ring->held_off[bid] += rc;
+            break;
+        }
+
+        conn->held_head = ring->held_next[bid];
+        if (conn->held_head < 0)
+            conn->held_tail = -1;
+        uring_buf_release(ring, bid);
+    }
+
+    if (conn->held_head < 0 && !conn->recv_armed && uring_queued(conn) < MBTCP_SERVER_TX_HIGH) {
+        conn->recv_starved = 0;
+        if (uring_arm_recv(ring, conn) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void uring_on_accept(struct mbtcp_server *server, struct io_uring_cqe *cqe)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        ring->accept_armed = 0;
+
+    if (cqe->res < 0) {
+        if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+            /* Armed again when a session goes away */
+            server->accept_paused = 1;
+            LOG_W("out of file descriptors, accepting paused.");
+        } else if (!ring->accept_armed) {
+            uring_arm_accept(ring, server);
+        }
+        return;
+    }
+
+    int fd = cqe->res;
+
+    if (!ring->accept_armed && !server->accept_paused)
+        uring_arm_accept(ring, server);
+
+    if (server->nb_conns >= server->max_conns) {
+        server->stat.rejected++;
+        close(fd);
+        return;
+    }
+
+    struct mbtcp_conn *conn = mbtcp_server_conn_alloc(server);
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
+    conn->fd = fd;
+    conn->tx_head = conn->tx_tail = 0;
+    conn->inflight = 0;
+    conn->nb_sends = 0;
+    conn->recv_armed = 0;
+    conn->recv_starved = 0;
+    conn->cancelling = 0;
+    conn->closing = 0;
+    conn->flush_pending = 0;
+    conn->held_head = conn->held_tail = -1;
+    conn->rx_len = 0;
+    conn->resync = 0;
+
+    mbtcp_server_conn_add(server, conn);
+
+    if (uring_arm_recv(ring, conn) < 0)
+        uring_close_put(server, conn);
+}
+
+static void uring_on_recv(struct mbtcp_server *server, struct mbtcp_conn *conn, struct io_uring_cqe *cqe)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+    int res = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+        conn->cancelling = 0;
+        conn->inflight--;
+    }
+
+    if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (conn->closing) {
+            uring_buf_release(ring, bid);
+            return;
+        }
+
+        mbtcp_server_conn_touch(server, conn);
+
+        int rc = 0;
+        if (conn->held_head < 0)
+            rc = uring_feed(server, conn, ring->bufs + bid * MBTCP_URING_BUF_SIZE, res);
+
+        if (rc < 0) {
+            uring_buf_release(ring, bid);
+            uring_close(server, conn);
+            return;
+        }
+
+        if (rc == res)
+            uring_buf_release(ring, bid);
+        else
+            uring_held_push(ring, conn, bid, rc, res);
+
+        if (uring_queued(conn) >= MBTCP_SERVER_TX_HIGH || conn->held_head >= 0) {
+            server->stat.stalls++;
+            uring_cancel_recv(ring, conn);
+        }
+    } else if (res == 0) {
+        uring_close(server, conn);
+        return;
+    } else if (res < 0 && res != -ECANCELED && res != -ENOBUFS) {
+        uring_close(server, conn);
+        return;
+    }
+
+    if (conn->closing || conn->recv_armed)
+        return;
+
+    if (res == -ENOBUFS) {
+        /* Every buffer is taken, arm again when one comes back */
+        conn->recv_starved = 1;
+        ring->nb_starved++;
+        return;
+    }
+
+    if (conn->held_head < 0 && uring_queued(conn) < MBTCP_SERVER_TX_HIGH) {
+        if (uring_arm_recv(ring, conn) < 0)
+            uring_close(server, conn);
+    }
+}
+
+static void uring_on_send(struct mbtcp_server *server, struct mbtcp_conn *conn, struct io_uring_cqe *cqe)
+{
+    conn->inflight--;
+    conn->nb_sends--;
+
+    if (cqe->res < 0) {
+        /* -ECANCELED: the first half of a linked pair failed, that one decides */
+        if (cqe->res != -ECANCELED)
+            uring_close(server, conn);
+        return;
+    }
+
+    conn->tx_head += cqe->res;
+    if (conn->tx_head >= MBTCP_SERVER_TX_SIZE) {
+        conn->tx_head -= MBTCP_SERVER_TX_SIZE;
+        conn->tx_tail -= MBTCP_SERVER_TX_SIZE;
+    }
+
+    if (conn->closing || conn->nb_sends > 0)
+        return;
+
+    /* A session draining its output is not idle */
+    mbtcp_server_conn_touch(server, conn);
+
+    if (uring_resume(server, conn) < 0) {
+        uring_close(server, conn);
+        return;
+    }
+
+    if (uring_flush((struct mbtcp_uring *)server->ring, conn) < 0)
+        uring_close(server, conn);
+}
+
+static void uring_rearm_starved(struct mbtcp_server *server)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+    struct mbtcp_conn *conn, *n;
+
+    if (ring->nb_starved == 0 || !ring->buf_returned)
+        return;
+
+    ring->nb_starved = 0;
+    ring->buf_returned = 0;
+
+    rt_list_for_each_entry_safe(conn, n, &server->conns, list)
+    {
+        if (!conn->recv_starved)
+            continue;
+
+        conn->recv_starved = 0;
+        if (uring_resume(server, conn) < 0)
+            uring_close_put(server, conn);
+    }
+}
+
+static void uring_flush_all(struct mbtcp_server *server)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+    rt_slist_t *node;
+
+    while ((node = rt_slist_first(&ring->flush_list)) != NULL) {
+        struct mbtcp_conn *conn = rt_slist_entry(node, struct mbtcp_conn, flush);
+
+        rt_slist_remove(&ring->flush_list, node);
+        conn->flush_pending = 0;
+
+        if (uring_flush(ring, conn) < 0)
+            uring_close_put(server, conn);
+    }
+}
+
+static void uring_reap(struct mbtcp_server *server)
+{
+    struct mbtcp_uring *ring = (struct mbtcp_uring *)server->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        int op = cqe->user_data & MBTCP_URING_OP_MASK;
+        struct mbtcp_conn *conn = (struct mbtcp_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)MBTCP_URING_OP_MASK);
+
+        switch (op) {
+        case MBTCP_URING_OP_ACCEPT:
+            uring_on_accept(server, cqe);
+            break;
+
+        case MBTCP_URING_OP_WAKE: {
+            uint64_t value;
+            ssize_t rc = read(server->wake_fd, &value, sizeof(value));
+            (void)rc;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                uring_arm_wake(ring, server);
+            if (server->wake_cb)
+                server->wake_cb(server);
+        } break;
+
+        case MBTCP_URING_OP_RECV:
+            uring_on_recv(server, conn, cqe);
+            uring_put(server, conn);
+            break;
+
+        case MBTCP_URING_OP_SEND:
+            uring_on_send(server, conn, cqe);
+            uring_put(server, conn);
+            break;
+
+        case MBTCP_URING_OP_CANCEL:
+            conn->inflight--;
+            uring_put(server, conn);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    uring_rearm_starved(server);
+    uring_flush_all(server);
+}
+
+/* Queued like any response, the send goes out with the batch */
+int mbtcp_server_uring_reply(struct mbtcp_server *server, struct mbtcp_conn *conn, const uint8_t *buf, int len)
+{
+    if (conn->closing)
+        return -1;
+
+    mbtcp_server_conn_touch(server, conn);
+
+    if (uring_conn_send(server, conn, buf, len) < 0) {
+        uring_close_put(server, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uring_has_cqe(struct mbtcp_uring *ring)
+{
+    return *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+int mbtcp_server_uring_loop(struct mbtcp_server *server)
+{
+    struct mbtcp_uring ring;
+
+    if (uring_init(&ring) < 0) {
+        LOG_E("io_uring setup failed.");
+        return -1;
+    }
+
+    server->ring = &ring;
+
+    if (uring_arm_wake(&ring, server) < 0 || uring_arm_accept(&ring, server) < 0) {
+        server->ring = NULL;
+        uring_deinit(&ring);
+        return -1;
+    }
+
+    int error = 0;
+
+    while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+        int timeout = mbtcp_server_expire(server, uring_close_put);
+
+        if (uring_submit(&ring, uring_has_cqe(&ring) ? 0 : 1, timeout) < 0) {
+            error = 1;
+            break;
+        }
+
+        uring_reap(server);
+    }
+
+    /* Hand every session back before the memory its requests point at goes away */
+    while (!rt_list_isempty(&server->conns))
+        uring_close_put(server, rt_list_first_entry(&server->conns, struct mbtcp_conn, list));
+
+    uint32_t deadline = rt_tick_get() + rt_tick_from_millisecond(1000);
+    while (server->nb_conns > 0 && (int32_t)(deadline - rt_tick_get()) > 0) {
+        uring_submit(&ring, 1, 100);
+        uring_reap(server);
+    }
+
+    if (server->nb_conns > 0)
+        LOG_W("%d session(s) still owned by the kernel.", server->nb_conns);
+
+    server->ring = NULL;
+    uring_deinit(&ring);
+
+    return error ? -1 : 0;
+}
+
+#endif /* MBTCP_SERVER_USING_URING */
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include "mbudp_master.h"
+#include "rt_tick.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbudp_master"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define MBUDP_MBAP_LENGTH 7
+
+static int master_serialize(struct mbudp_master *master, struct mbudp_request *req)
+{
+    agile_modbus_t *ctx = &master->ctx_udp._ctx;
+
+    agile_modbus_set_slave(ctx, req->dev->slave);
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+        return agile_modbus_serialize_read_bits(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+        return agile_modbus_serialize_read_input_bits(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+        return agile_modbus_serialize_read_registers(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        return agile_modbus_serialize_read_input_registers(ctx, req->address, req->nb);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+        return agile_modbus_serialize_write_bit(ctx, req->address, ((uint8_t *)req->data)[0]);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return agile_modbus_serialize_write_register(ctx, req->address, ((uint16_t *)req->data)[0]);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return agile_modbus_serialize_write_bits(ctx, req->address, req->nb, req->data);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return agile_modbus_serialize_write_registers(ctx, req->address, req->nb, req->data);
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+static int master_deserialize(struct mbudp_master *master, struct mbudp_request *req, int len)
+{
+    agile_modbus_t *ctx = &master->ctx_udp._ctx;
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+        return agile_modbus_deserialize_read_bits(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+        return agile_modbus_deserialize_read_input_bits(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+        return agile_modbus_deserialize_read_registers(ctx, len, req->data);
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        return agile_modbus_deserialize_read_input_registers(ctx, len, req->data);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+        return agile_modbus_deserialize_write_bit(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return agile_modbus_deserialize_write_register(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return agile_modbus_deserialize_write_bits(ctx, len);
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return agile_modbus_deserialize_write_registers(ctx, len);
+    default:
+        break;
+    }
+
+    return -1;
+}
+
+static void master_complete(struct mbudp_master *master, struct mbudp_slot *slot, int rc)
+{
+    struct mbudp_request *req = slot->req;
+
+    slot->req = NULL;
+    master->nb_inflight--;
+    timerwheel_del(&master->wheel, &slot->timer);
+
+    if (req->cb)
+        req->cb(req->dev, req, rc);
+}
+
+/* Send the batched datagrams, those the socket won't take are lost like any other and retransmitted */
+static void master_flush(struct mbudp_master *master)
+{
+    struct mmsghdr msgs[MBUDP_MASTER_BATCH];
+    struct iovec iovs[MBUDP_MASTER_BATCH];
+
+    if (master->nb_tx == 0)
+        return;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * master->nb_tx);
+    for (int i = 0; i < master->nb_tx; i++) {
+        struct mbudp_slot *slot = master->tx[i];
+
+        iovs[i].iov_base = slot->adu;
+        iovs[i].iov_len = slot->len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &slot->req->dev->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int sent = 0;
+    while (sent < master->nb_tx) {
+        int rc = sendmmsg(master->fd, msgs + sent, master->nb_tx - sent, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        sent += rc;
+    }
+
+    master->nb_tx = 0;
+}
+
+static void master_transmit(struct mbudp_master *master, struct mbudp_slot *slot)
+{
+    timerwheel_add(&master->wheel, &slot->timer, rt_tick_get() + rt_tick_from_millisecond(slot->req->timeout));
+
+    master->tx[master->nb_tx++] = slot;
+    if (master->nb_tx == MBUDP_MASTER_BATCH)
+        master_flush(master);
+}
+
+static struct mbudp_request *master_pop(struct mbudp_master *master)
+{
+    struct mbudp_request *req = NULL;
+
+    pthread_mutex_lock(&master->lock);
+    if (!rt_list_isempty(&master->queue)) {
+        req = rt_list_first_entry(&master->queue, struct mbudp_request, list);
+        rt_list_remove(&req->list);
+    }
+    pthread_mutex_unlock(&master->lock);
+
+    return req;
+}
+
+/* Put queued requests on the wire while the window has room */
+static void master_send_queued(struct mbudp_master *master)
+{
+    agile_modbus_t *ctx = &master->ctx_udp._ctx;
+
+    while (master->nb_inflight < MBUDP_MASTER_WINDOW) {
+        struct mbudp_request *req = master_pop(master);
+        if (req == NULL)
+            break;
+
+        /* A slot per identifier modulo the window, skip those still waiting for an answer */
+        while (master->slots[master->next_tid % MBUDP_MASTER_WINDOW].req)
+            master->next_tid++;
+
+        uint16_t tid = master->next_tid++;
+        struct mbudp_slot *slot = &master->slots[tid % MBUDP_MASTER_WINDOW];
+
+        ctx->send_buf = slot->adu;
+        int len = master_serialize(master, req);
+        if (len < 0) {
+            if (req->cb)
+                req->cb(req->dev, req, -1);
+            continue;
+        }
+
+        slot->adu[0] = tid >> 8;
+        slot->adu[1] = tid & 0xff;
+        slot->req = req;
+        slot->len = len;
+        slot->tries = 0;
+        master->nb_inflight++;
+        req->dev->stat.requests++;
+
+        master_transmit(master, slot);
+    }
+
+    master_flush(master);
+}
+
+/* No answer in time: send the request again or give up on it */
+static void slot_expire(struct timerwheel_timer *timer, void *arg)
+{
+    struct mbudp_master *master = arg;
+    struct mbudp_slot *slot = rt_container_of(timer, struct mbudp_slot, timer);
+    struct mbudp_device *dev = slot->req->dev;
+
+    if (slot->tries >= slot->req->retries) {
+        dev->stat.timeouts++;
+        master_complete(master, slot, MBUDP_MASTER_ETIMEOUT);
+        return;
+    }
+
+    slot->tries++;
+    dev->stat.retransmits++;
+    master_transmit(master, slot);
+}
+
+/* Retransmit or time out the requests past their deadline, return the time in ms until the next one or -1 */
+static int master_expire(struct mbudp_master *master)
+{
+    uint32_t now = rt_tick_get();
+    uint32_t next;
+
+    timerwheel_run(&master->wheel, now);
+    master_flush(master);
+
+    if (timerwheel_next(&master->wheel, &next) < 0)
+        return -1;
+
+    int32_t ticks = (int32_t)(next - now);
+    if (ticks <= 0)
+        return 0;
+
+    return (int)((int64_t)ticks * 1000 / RT_TICK_PER_SECOND) + 1;
+}
+
+/* Complete the request `buf` answers, anything else is a duplicate or a stray */
+static void master_process(struct mbudp_master *master, const struct sockaddr_in *peer, uint8_t *buf, int len)
+{
+    agile_modbus_t *ctx = &master->ctx_udp._ctx;
+
+    if (len < MBUDP_MBAP_LENGTH + 1 || (buf[4] << 8) + buf[5] != len - 6)
+        return;
+
+    uint16_t tid = (buf[0] << 8) + buf[1];
+    struct mbudp_slot *slot = &master->slots[tid % MBUDP_MASTER_WINDOW];
+    struct mbudp_request *req = slot->req;
+
+    if (req == NULL || slot->adu[0] != buf[0] || slot->adu[1] != buf[1] ||
+        peer->sin_addr.s_addr != req->dev->addr.sin_addr.s_addr || peer->sin_port != req->dev->addr.sin_port) {
+        master->duplicates++;
+        return;
+    }
+
+    ctx->send_buf = slot->adu;
+    ctx->read_buf = buf;
+    ctx->read_bufsz = len;
+
+    int rc = master_deserialize(master, req, len);
+    if (rc < 0)
+        req->dev->stat.errors++;
+    else
+        req->dev->stat.responses++;
+
+    master_complete(master, slot, rc);
+}
+
+static int master_read(struct mbudp_master *master)
+{
+    struct mmsghdr msgs[MBUDP_MASTER_BATCH];
+    struct iovec iovs[MBUDP_MASTER_BATCH];
+    struct sockaddr_in peers[MBUDP_MASTER_BATCH];
+
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < MBUDP_MASTER_BATCH; i++) {
+            iovs[i].iov_base = master->read_bufs[i];
+            iovs[i].iov_len = AGILE_MODBUS_TCP_MAX_ADU_LENGTH;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &peers[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        int n = recvmmsg(master->fd, msgs, MBUDP_MASTER_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* ICMP port unreachable of a device that is down surfaces here, the request times out */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+                return 0;
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                master_process(master, &peers[i], master->read_bufs[i], msgs[i].msg_len);
+        }
+
+        if (n < MBUDP_MASTER_BATCH)
+            return 0;
+    }
+}
+
+/* Complete every outstanding and queued request with `rc` */
+static void master_abort(struct mbudp_master *master, int rc)
+{
+    for (int i = 0; i < MBUDP_MASTER_WINDOW; i++) {
+        if (master->slots[i].req)
+            master_complete(master, &master->slots[i], rc);
+    }
+
+    struct mbudp_request *req;
+    while ((req = master_pop(master)) != NULL) {
+        if (req->cb)
+            req->cb(req->dev, req, rc);
+    }
+}
+
+int mbudp_device_init(struct mbudp_device *dev, const char *ip, int port, int slave)
+{
+    memset(dev, 0, sizeof(struct mbudp_device));
+    dev->addr.sin_family = AF_INET;
+    dev->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &dev->addr.sin_addr) != 1)
+        return -1;
+
+    dev->slave = slave;
+
+    return 0;
+}
+
+int mbudp_master_init(struct mbudp_master *master)
+{
+    memset(master, 0, sizeof(struct mbudp_master));
+    master->running = 1;
+    master->next_tid = rand();
+    rt_list_init(&master->queue);
+    timerwheel_init(&master->wheel, rt_tick_get());
+    for (int i = 0; i < MBUDP_MASTER_WINDOW; i++)
+        timerwheel_timer_init(&master->slots[i].timer, slot_expire, master);
+    pthread_mutex_init(&master->lock, NULL);
+
+    master->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    master->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (master->fd < 0 || master->wake_fd < 0) {
+        mbudp_master_deinit(master);
+        return -1;
+    }
+
+    agile_modbus_udp_init(&master->ctx_udp, master->slots[0].adu, AGILE_MODBUS_TCP_MAX_ADU_LENGTH, NULL, 0);
+
+    return 0;
+}
+
+void mbudp_master_deinit(struct mbudp_master *master)
+{
+    master_abort(master, MBUDP_MASTER_EABORT);
+
+    if (master->wake_fd >= 0)
+        close(master->wake_fd);
+    if (master->fd >= 0)
+        close(master->fd);
+
+    master->wake_fd = master->fd = -1;
+    pthread_mutex_destroy(&master->lock);
+}
+
+int mbudp_master_add(struct mbudp_master *master, struct mbudp_device *dev)
+{
+    if (dev->master)
+        return -1;
+
+    dev->master = master;
+
+    return 0;
+}
+
+int mbudp_master_submit(struct mbudp_device *dev, struct mbudp_request *req)
+{
+    struct mbudp_master *master = dev->master;
+
+    if (master == NULL || req->data == NULL || req->retries < 0)
+        return -1;
+
+    switch (req->function) {
+    case AGILE_MODBUS_FC_READ_COILS:
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        break;
+    default:
+        return -1;
+    }
+
+    req->dev = dev;
+
+    pthread_mutex_lock(&master->lock);
+    rt_list_insert_before(&master->queue, &req->list);
+    pthread_mutex_unlock(&master->lock);
+
+    if (!pthread_equal(master->tid, pthread_self())) {
+        uint64_t value = 1;
+        ssize_t rc = write(master->wake_fd, &value, sizeof(value));
+        (void)rc;
+    }
+
+    return 0;
+}
+
+/* Drive the requests until `mbudp_master_stop`, return 0 when stopped and -1 on error */
+int mbudp_master_run(struct mbudp_master *master)
+{
+    struct pollfd fds[2] = {
+        {.fd = master->fd, .events = POLLIN},
+        {.fd = master->wake_fd, .events = POLLIN},
+    };
+    int rc = 0;
+
+    master->tid = pthread_self();
+    LOG_I("mbudp master running.");
+
+    while (__atomic_load_n(&master->running, __ATOMIC_ACQUIRE)) {
+        master_send_queued(master);
+        int timeout = master_expire(master);
+
+        int n = poll(fds, 2, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            ssize_t len = read(master->wake_fd, &value, sizeof(value));
+            (void)len;
+        }
+
+        if ((fds[0].revents & POLLIN) && master_read(master) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    master_abort(master, MBUDP_MASTER_EABORT);
+
+    return rc;
+}
+
+void mbudp_master_stop(struct mbudp_master *master)
+{
+    uint64_t value = 1;
+
+    __atomic_store_n(&master->running, 0, __ATOMIC_RELEASE);
+    ssize_t rc = write(master->wake_fd, &value, sizeof(value));
+    (void)rc;
+}
@@ -0,0 +1,120 @@
+#ifndef __MBUDP_MASTER_H
+#define __MBUDP_MASTER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "agile_modbus.h"
+#include "rtservice.h"
+#include "timerwheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Modbus over UDP master.
+ *
+ * One thread and one socket serve any number of devices. There are no
+ * connections to set up and no head of line blocking: requests to every
+ * device are on the wire at once, up to MBUDP_MASTER_WINDOW of them, each
+ * under its own transaction identifier. New requests and retransmissions
+ * are sent in batches with `sendmmsg`, responses read with `recvmmsg`.
+ *
+ * Each request on the wire has a timer on the master's wheel. A request
+ * that gets no response within `timeout` ms is sent again, unchanged and
+ * under the same identifier, up to `retries` times before it completes
+ * with MBUDP_MASTER_ETIMEOUT. A response is matched by its
+ * identifier and sender; the second answer to a retransmitted request and
+ * answers that come after the request completed are counted as duplicates
+ * and dropped.
+ *
+ * Requests complete through their callback, on the master thread, with the
+ * return value of the matching `agile_modbus_deserialize_*` or one of the
+ * codes below. `mbudp_master_submit` may be called from any thread.
+ */
+#define MBUDP_MASTER_WINDOW 256
+#define MBUDP_MASTER_BATCH  32
+
+/* Completion codes besides those of agile_modbus_deserialize_* */
+#define MBUDP_MASTER_ETIMEOUT -2
+#define MBUDP_MASTER_EABORT   -4
+
+struct mbudp_device;
+struct mbudp_request;
+
+typedef void (*mbudp_request_cb_t)(struct mbudp_device *dev, struct mbudp_request *req, int rc);
+
+/* `data` as for mbtcp_request: one uint8_t per bit, one uint16_t per register */
+struct mbudp_request {
+    rt_list_t list;
+    struct mbudp_device *dev;
+    int function;
+    int address;
+    int nb;
+    void *data;
+    int timeout;
+    int retries;
+    mbudp_request_cb_t cb;
+    void *arg;
+};
+
+struct mbudp_device_stat {
+    uint32_t requests;
+    uint32_t retransmits;
+    uint32_t responses;
+    uint32_t timeouts;
+    uint32_t errors;
+};
+
+struct mbudp_device {
+    struct sockaddr_in addr;
+    int slave;
+    void *arg;
+
+    struct mbudp_master *master;
+    struct mbudp_device_stat stat;
+};
+
+struct mbudp_slot {
+    struct mbudp_request *req;
+    struct timerwheel_timer timer;
+    int tries;
+    int len;
+    uint8_t adu[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+struct mbudp_master {
+    int fd;
+    int wake_fd;
+    int running;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    rt_list_t queue;
+    uint16_t next_tid;
+    int nb_inflight;
+    uint32_t duplicates;
+    struct timerwheel wheel;
+    struct mbudp_slot slots[MBUDP_MASTER_WINDOW];
+
+    agile_modbus_udp_t ctx_udp;
+    uint8_t read_bufs[MBUDP_MASTER_BATCH][AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+
+    int nb_tx;
+    struct mbudp_slot *tx[MBUDP_MASTER_BATCH];
+};
+
+int mbudp_device_init(struct mbudp_device *dev, const char *ip, int port, int slave);
+
+int mbudp_master_init(struct mbudp_master *master);
+void mbudp_master_deinit(struct mbudp_master *master);
+int mbudp_master_add(struct mbudp_master *master, struct mbudp_device *dev);
+int mbudp_master_submit(struct mbudp_device *dev, struct mbudp_request *req);
+int mbudp_master_run(struct mbudp_master *master);
+void mbudp_master_stop(struct mbudp_master *master);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "mbudp_server.h"
+#include "rt_tick.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "mbudp_server"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define MBUDP_MBAP_LENGTH 7
+
+static struct mbudp_server_dup *dup_slot(struct mbudp_server *server, const struct sockaddr_in *peer, uint16_t tid)
+{
+    uint32_t hash = peer->sin_addr.s_addr ^ ((uint32_t)peer->sin_port << 16) ^ tid;
+
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+
+    return &server->dups[hash % MBUDP_SERVER_DUP_SIZE];
+}
+
+/* The remembered response to this very request, if any */
+static struct mbudp_server_dup *dup_find(struct mbudp_server *server, const struct sockaddr_in *peer, uint16_t tid,
+                                         uint16_t crc)
+{
+    struct mbudp_server_dup *dup = dup_slot(server, peer, tid);
+
+    if (dup->len == 0 || dup->tid != tid || dup->crc != crc)
+        return NULL;
+    if (dup->peer.sin_addr.s_addr != peer->sin_addr.s_addr || dup->peer.sin_port != peer->sin_port)
+        return NULL;
+    if (rt_tick_get() - dup->tick >= rt_tick_from_millisecond(MBUDP_SERVER_DUP_TTL))
+        return NULL;
+
+    return dup;
+}
+
+/* Handle one datagram, return the length of the response in `rsp` or 0 for none */
+static int server_handle(struct mbudp_server *server, const struct sockaddr_in *peer, uint8_t *req, int len,
+                         uint8_t *rsp)
+{
+    agile_modbus_t *ctx = &server->ctx_udp._ctx;
+
+    /* One datagram is exactly one ADU */
+    if (len < MBUDP_MBAP_LENGTH + 1 || (req[4] << 8) + req[5] != len - 6) {
+        server->stat.errors++;
+        return 0;
+    }
+
+    server->stat.requests++;
+
+    uint16_t tid = (req[0] << 8) + req[1];
+    uint16_t crc = agile_modbus_rtu_crc16(req + 2, len - 2);
+
+    struct mbudp_server_dup *dup = dup_find(server, peer, tid, crc);
+    if (dup) {
+        server->stat.duplicates++;
+        memcpy(rsp, dup->rsp, dup->len);
+        return dup->len;
+    }
+
+    ctx->read_buf = req;
+    ctx->read_bufsz = len;
+    ctx->send_buf = rsp;
+    ctx->send_bufsz = AGILE_MODBUS_TCP_MAX_ADU_LENGTH;
+
+    int rsp_len = agile_modbus_slave_handle(ctx, len, 0, server->slave_cb, server->slave_data, NULL);
+    if (rsp_len <= 0) {
+        if (rsp_len < 0)
+            server->stat.errors++;
+        return 0;
+    }
+
+    dup = dup_slot(server, peer, tid);
+    dup->peer = *peer;
+    dup->tid = tid;
+    dup->crc = crc;
+    dup->tick = rt_tick_get();
+    dup->len = rsp_len;
+    memcpy(dup->rsp, rsp, rsp_len);
+
+    return rsp_len;
+}
+
+/* Drain the socket a batch at a time, answering each batch with one sendmmsg */
+static int server_read(struct mbudp_server *server)
+{
+    struct mmsghdr rx_msgs[MBUDP_SERVER_BATCH];
+    struct mmsghdr tx_msgs[MBUDP_SERVER_BATCH];
+    struct iovec rx_iovs[MBUDP_SERVER_BATCH];
+    struct iovec tx_iovs[MBUDP_SERVER_BATCH];
+    struct sockaddr_in peers[MBUDP_SERVER_BATCH];
+
+    while (1) {
+        memset(rx_msgs, 0, sizeof(rx_msgs));
+        for (int i = 0; i < MBUDP_SERVER_BATCH; i++) {
+            rx_iovs[i].iov_base = server->rx_bufs[i];
+            rx_iovs[i].iov_len = AGILE_MODBUS_TCP_MAX_ADU_LENGTH;
+            rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+            rx_msgs[i].msg_hdr.msg_iovlen = 1;
+            rx_msgs[i].msg_hdr.msg_name = &peers[i];
+            rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        int n = recvmmsg(server->fd, rx_msgs, MBUDP_SERVER_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        int nb_tx = 0;
+        memset(tx_msgs, 0, sizeof(tx_msgs));
+        for (int i = 0; i < n; i++) {
+            /* Truncated datagrams can't be valid ADUs */
+            if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                server->stat.errors++;
+                continue;
+            }
+
+            int rsp_len = server_handle(server, &peers[i], server->rx_bufs[i], rx_msgs[i].msg_len,
+                                        server->tx_bufs[nb_tx]);
+            if (rsp_len <= 0)
+                continue;
+
+            tx_iovs[nb_tx].iov_base = server->tx_bufs[nb_tx];
+            tx_iovs[nb_tx].iov_len = rsp_len;
+            tx_msgs[nb_tx].msg_hdr.msg_iov = &tx_iovs[nb_tx];
+            tx_msgs[nb_tx].msg_hdr.msg_iovlen = 1;
+            tx_msgs[nb_tx].msg_hdr.msg_name = &peers[i];
+            tx_msgs[nb_tx].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            nb_tx++;
+        }
+
+        /* A response that doesn't fit the socket buffer is lost like any datagram, the master retransmits */
+        int sent = 0;
+        while (sent < nb_tx) {
+            int rc = sendmmsg(server->fd, tx_msgs + sent, nb_tx - sent, MSG_DONTWAIT);
+            if (rc < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            sent += rc;
+        }
+        server->stat.responses += sent;
+
+        if (n < MBUDP_SERVER_BATCH)
+            return 0;
+    }
+}
+
+int mbudp_server_init(struct mbudp_server *server, int port, agile_modbus_slave_callback_t slave_cb,
+                      const void *slave_data)
+{
+    memset(server, 0, sizeof(struct mbudp_server));
+    server->port = port;
+    server->slave_cb = slave_cb;
+    server->slave_data = slave_data;
+    server->running = 1;
+
+    server->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->fd < 0 || server->wake_fd < 0) {
+        mbudp_server_deinit(server);
+        return -1;
+    }
+
+    int option = 1;
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&option, sizeof(int));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_E("bind udp port %d failed.", port);
+        mbudp_server_deinit(server);
+        return -1;
+    }
+
+    agile_modbus_udp_init(&server->ctx_udp, server->tx_bufs[0], AGILE_MODBUS_TCP_MAX_ADU_LENGTH, NULL, 0);
+    agile_modbus_set_slave(&server->ctx_udp._ctx, 1);
+    agile_modbus_set_diag(&server->ctx_udp._ctx, &server->diag);
+
+    return 0;
+}
+
+void mbudp_server_deinit(struct mbudp_server *server)
+{
+    if (server->fd >= 0)
+        close(server->fd);
+    if (server->wake_fd >= 0)
+        close(server->wake_fd);
+
+    server->fd = server->wake_fd = -1;
+}
+
+/* Serve until `mbudp_server_stop`, return 0 when stopped and -1 on error */
+int mbudp_server_run(struct mbudp_server *server)
+{
+    struct pollfd fds[2] = {
+        {.fd = server->fd, .events = POLLIN},
+        {.fd = server->wake_fd, .events = POLLIN},
+    };
+
+    LOG_I("mbudp server listening on port %d.", server->port);
+
+    while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+        int n = poll(fds, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            ssize_t rc = read(server->wake_fd, &value, sizeof(value));
+            (void)rc;
+        }
+
+        if ((fds[0].revents & POLLIN) && server_read(server) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void mbudp_server_stop(struct mbudp_server *server)
+{
+    uint64_t value = 1;
+
+    __atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
+    ssize_t rc = write(server->wake_fd, &value, sizeof(value));
+    (void)rc;
+}
@@ -0,0 +1,75 @@
+#ifndef __MBUDP_SERVER_H
+#define __MBUDP_SERVER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "agile_modbus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Modbus over UDP server.
+ *
+ * One datagram is one MBAP ADU, handled on an agile_modbus_udp_t. Requests
+ * are read in batches of up to MBUDP_SERVER_BATCH with `recvmmsg` and the
+ * responses of a batch leave in one `sendmmsg`, so a busy socket costs two
+ * system calls per batch instead of two per request.
+ *
+ * UDP loses datagrams and masters retransmit under the same transaction
+ * identifier. Each response is remembered by peer and transaction
+ * identifier, together with the CRC of its request, for
+ * MBUDP_SERVER_DUP_TTL ms: a retransmitted request gets the remembered
+ * response again instead of being executed twice, which matters for
+ * writes. A request with a reused identifier but other content is new.
+ */
+#define MBUDP_SERVER_BATCH      32
+#define MBUDP_SERVER_DUP_SIZE   256
+#define MBUDP_SERVER_DUP_TTL    5000
+
+struct mbudp_server_dup {
+    struct sockaddr_in peer;
+    uint16_t tid;
+    uint16_t crc;
+    uint32_t tick;
+    int len;
+    uint8_t rsp[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+struct mbudp_server_stat {
+    uint32_t requests;
+    uint32_t responses;
+    uint32_t duplicates;
+    uint32_t errors;
+};
+
+struct mbudp_server {
+    int port;
+    agile_modbus_slave_callback_t slave_cb;
+    const void *slave_data;
+
+    int fd;
+    int wake_fd;
+    int running;
+    struct mbudp_server_dup dups[MBUDP_SERVER_DUP_SIZE];
+
+    agile_modbus_udp_t ctx_udp;
+    uint8_t rx_bufs[MBUDP_SERVER_BATCH][AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+    uint8_t tx_bufs[MBUDP_SERVER_BATCH][AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+
+    struct mbudp_server_stat stat;
+    agile_modbus_diag_t diag;
+};
+
+int mbudp_server_init(struct mbudp_server *server, int port, agile_modbus_slave_callback_t slave_cb,
+                      const void *slave_data);
+void mbudp_server_deinit(struct mbudp_server *server);
+int mbudp_server_run(struct mbudp_server *server);
+void mbudp_server_stop(struct mbudp_server *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,145 @@
+#include "regbank.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define REGBANK_PAGE(index) ((index) >> REGBANK_PAGE_SHIFT)
+
+int regbank_init(struct regbank *bank, int nb)
+{
+    int nb_pages = REGBANK_PAGE(nb - 1) + 1;
+
+    if (nb <= 0)
+        return -1;
+
+    memset(bank, 0, sizeof(struct regbank));
+    bank->regs = calloc(nb, sizeof(uint16_t));
+    bank->seqs = calloc(nb_pages, sizeof(uint32_t));
+    if (bank->regs == NULL || bank->seqs == NULL) {
+        free(bank->regs);
+        free(bank->seqs);
+        return -1;
+    }
+
+    bank->nb = nb;
+    pthread_mutex_init(&bank->wr_mtx, NULL);
+
+    return 0;
+}
+
+void regbank_deinit(struct regbank *bank)
+{
+    pthread_mutex_destroy(&bank->wr_mtx);
+    free(bank->regs);
+    free(bank->seqs);
+    memset(bank, 0, sizeof(struct regbank));
+}
+
+static void regbank_read_segment(struct regbank *bank, int index, uint16_t *dest, int nb)
+{
+    uint32_t seqs[REGBANK_READ_MAX_PAGES];
+    int first = REGBANK_PAGE(index);
+    int last = REGBANK_PAGE(index + nb - 1);
+    int retry;
+
+    do {
+        retry = 0;
+
+        for (int p = first; p <= last; p++) {
+            seqs[p - first] = __atomic_load_n(&bank->seqs[p], __ATOMIC_ACQUIRE);
+            if (seqs[p - first] & 1)
+                retry = 1;
+        }
+
+        if (retry)
+            continue;
+
+        for (int i = 0; i < nb; i++)
+            dest[i] = __atomic_load_n(&bank->regs[index + i], __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        for (int p = first; p <= last; p++) {
+            if (__atomic_load_n(&bank->seqs[p], __ATOMIC_RELAXED) != seqs[p - first]) {
+                retry = 1;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+int regbank_read(struct regbank *bank, int index, uint16_t *dest, int nb)
+{
+    if (index < 0 || nb < 0 || index + nb > bank->nb)
+        return -1;
+
+    int remain = nb;
+
+    while (remain > 0) {
+        /* Never let one segment span more pages than we can track */
+        int seg_end = (REGBANK_PAGE(index) + REGBANK_READ_MAX_PAGES) << REGBANK_PAGE_SHIFT;
+        int seg_len = seg_end - index;
+        if (seg_len > remain)
+            seg_len = remain;
+
+        regbank_read_segment(bank, index, dest, seg_len);
+
+        index += seg_len;
+        dest += seg_len;
+        remain -= seg_len;
+    }
+
+    return nb;
+}
+
+int regbank_write(struct regbank *bank, int index, const uint16_t *src, int nb)
+{
+    if (index < 0 || nb < 0 || index + nb > bank->nb)
+        return -1;
+
+    if (nb == 0)
+        return 0;
+
+    int first = REGBANK_PAGE(index);
+    int last = REGBANK_PAGE(index + nb - 1);
+
+    pthread_mutex_lock(&bank->wr_mtx);
+
+    for (int p = first; p <= last; p++)
+        __atomic_store_n(&bank->seqs[p], bank->seqs[p] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (int i = 0; i < nb; i++)
+        __atomic_store_n(&bank->regs[index + i], src[i], __ATOMIC_RELAXED);
+
+    for (int p = first; p <= last; p++)
+        __atomic_store_n(&bank->seqs[p], bank->seqs[p] + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&bank->version, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&bank->wr_mtx);
+
+    return nb;
+}
+
+uint32_t regbank_version(struct regbank *bank)
+{
+    return __atomic_load_n(&bank->version, __ATOMIC_ACQUIRE);
+}
+
+int regbank_map_get(struct regbank *bank, int index, int nb, void *buf, int bufsz)
+{
+    if (nb * (int)sizeof(uint16_t) > bufsz)
+        return -1;
+
+    return (regbank_read(bank, index, (uint16_t *)buf, nb) < 0) ? -1 : 0;
+}
+
+int regbank_map_set(struct regbank *bank, int index, int map_index, int len, void *buf, int bufsz)
+{
+    uint16_t *ptr = (uint16_t *)buf;
+
+    if ((map_index + len) * (int)sizeof(uint16_t) > bufsz)
+        return -1;
+
+    return (regbank_write(bank, index + map_index, ptr + map_index, len) < 0) ? -1 : 0;
+}
@@ -0,0 +1,66 @@
+#ifndef __REGBANK_H
+#define __REGBANK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Register bank shared by all slave sessions.
+ *
+ * Every page of REGBANK_PAGE_SIZE registers carries its own sequence counter.
+ * Writers serialize on `wr_mtx` and make the pages they touch odd while
+ * updating them; readers never lock, they just retry when a page sequence
+ * changed under them. Readers therefore never block each other and a writer
+ * never waits for readers.
+ *
+ * A read covering at most REGBANK_READ_MAX_PAGES pages is consistent as a
+ * whole, which is always the case for a single modbus request.
+ */
+#define REGBANK_PAGE_SHIFT     6
+#define REGBANK_PAGE_SIZE      (1 << REGBANK_PAGE_SHIFT)
+#define REGBANK_READ_MAX_PAGES 4
+
+struct regbank {
+    uint16_t *regs;
+    uint32_t *seqs;
+    int nb;
+    uint32_t version;
+    pthread_mutex_t wr_mtx;
+};
+
+int regbank_init(struct regbank *bank, int nb);
+void regbank_deinit(struct regbank *bank);
+int regbank_read(struct regbank *bank, int index, uint16_t *dest, int nb);
+int regbank_write(struct regbank *bank, int index, const uint16_t *src, int nb);
+uint32_t regbank_version(struct regbank *bank);
+
+int regbank_map_get(struct regbank *bank, int index, int nb, void *buf, int bufsz);
+int regbank_map_set(struct regbank *bank, int index, int map_index, int len, void *buf, int bufsz);
+
+/*
+ * Define the `get` / `set` interfaces of an `agile_modbus_slave_util_map_t`
+ * covering `nb` registers of `bank` starting at `index`:
+ *
+ *     REGBANK_MAP_DEFINE(holding, &bank, 0xFFF6, 10)
+ *     const agile_modbus_slave_util_map_t maps[1] = {
+ *         {0xFFF6, 0xFFFF, holding_get, holding_set}};
+ */
+#define REGBANK_MAP_DEFINE(name, bank, index, nb)                                   \
+    static int name##_get(void *buf, int bufsz)                                     \
+    {                                                                               \
+        return regbank_map_get((bank), (index), (nb), buf, bufsz);                  \
+    }                                                                               \
+    static int name##_set(int map_index, int len, void *buf, int bufsz)             \
+    {                                                                               \
+        return regbank_map_set((bank), (index), map_index, len, buf, bufsz);        \
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
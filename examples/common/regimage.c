@@ -0,0 +1,158 @@
+#include "regimage.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Epoch pinned by the calling thread for the duration of one request */
+static __thread struct regimage *_pinned_img = NULL;
+static __thread struct regimage_buf *_pinned_buf = NULL;
+
+int regimage_init(struct regimage *img, int nb, int nb_bufs)
+{
+    if (nb <= 0)
+        return -1;
+
+    if (nb_bufs < REGIMAGE_MIN_BUFS)
+        nb_bufs = REGIMAGE_MIN_BUFS;
+
+    memset(img, 0, sizeof(struct regimage));
+    img->bufs = calloc(nb_bufs, sizeof(struct regimage_buf));
+    if (img->bufs == NULL)
+        return -1;
+
+    img->nb_bufs = nb_bufs;
+    img->nb = nb;
+
+    for (int i = 0; i < nb_bufs; i++) {
+        img->bufs[i].regs = calloc(nb, sizeof(uint16_t));
+        if (img->bufs[i].regs == NULL) {
+            regimage_deinit(img);
+            return -1;
+        }
+    }
+
+    img->current = &img->bufs[0];
+
+    return 0;
+}
+
+void regimage_deinit(struct regimage *img)
+{
+    if (img->bufs) {
+        for (int i = 0; i < img->nb_bufs; i++)
+            free(img->bufs[i].regs);
+        free(img->bufs);
+    }
+
+    memset(img, 0, sizeof(struct regimage));
+}
+
+/**
+ * Producer side: get a writable back buffer.
+ * Returns NULL when every non-current buffer is still held by a reader.
+ */
+uint16_t *regimage_begin(struct regimage *img, int copy_current)
+{
+    struct regimage_buf *current = __atomic_load_n(&img->current, __ATOMIC_SEQ_CST);
+
+    if (img->back == NULL) {
+        for (int i = 0; i < img->nb_bufs; i++) {
+            struct regimage_buf *buf = &img->bufs[i];
+            if (buf == current)
+                continue;
+
+            if (__atomic_load_n(&buf->ref, __ATOMIC_SEQ_CST) == 0) {
+                img->back = buf;
+                break;
+            }
+        }
+
+        if (img->back == NULL)
+            return NULL;
+    }
+
+    if (copy_current)
+        memcpy(img->back->regs, current->regs, img->nb * sizeof(uint16_t));
+
+    return img->back->regs;
+}
+
+uint32_t regimage_publish(struct regimage *img)
+{
+    struct regimage_buf *back = img->back;
+    struct regimage_buf *current = img->current;
+
+    if (back == NULL)
+        return current->epoch;
+
+    back->epoch = current->epoch + 1;
+    __atomic_store_n(&img->current, back, __ATOMIC_SEQ_CST);
+    img->back = NULL;
+
+    return back->epoch;
+}
+
+struct regimage_buf *regimage_acquire(struct regimage *img)
+{
+    while (1) {
+        struct regimage_buf *buf = __atomic_load_n(&img->current, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&buf->ref, 1, __ATOMIC_SEQ_CST);
+
+        /* The producer only recycles buffers that are not current, so once
+           the buffer is still current after taking the reference it is ours */
+        if (__atomic_load_n(&img->current, __ATOMIC_SEQ_CST) == buf)
+            return buf;
+
+        __atomic_sub_fetch(&buf->ref, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void regimage_release(struct regimage_buf *buf)
+{
+    __atomic_sub_fetch(&buf->ref, 1, __ATOMIC_SEQ_CST);
+}
+
+uint32_t regimage_epoch(struct regimage *img)
+{
+    struct regimage_buf *buf = __atomic_load_n(&img->current, __ATOMIC_SEQ_CST);
+
+    /* The epoch of a published buffer only changes once it is recycled, which
+       cannot happen before a newer epoch has been published */
+    return __atomic_load_n(&buf->epoch, __ATOMIC_RELAXED);
+}
+
+void regimage_pin(struct regimage *img)
+{
+    if (_pinned_buf)
+        regimage_release(_pinned_buf);
+
+    _pinned_img = img;
+    _pinned_buf = regimage_acquire(img);
+}
+
+void regimage_unpin(struct regimage *img)
+{
+    if (_pinned_img != img || _pinned_buf == NULL)
+        return;
+
+    regimage_release(_pinned_buf);
+    _pinned_img = NULL;
+    _pinned_buf = NULL;
+}
+
+int regimage_map_get(struct regimage *img, int index, int nb, void *buf, int bufsz)
+{
+    if (index < 0 || index + nb > img->nb || nb * (int)sizeof(uint16_t) > bufsz)
+        return -1;
+
+    if (_pinned_img == img && _pinned_buf) {
+        memcpy(buf, _pinned_buf->regs + index, nb * sizeof(uint16_t));
+        return 0;
+    }
+
+    struct regimage_buf *epoch = regimage_acquire(img);
+    memcpy(buf, epoch->regs + index, nb * sizeof(uint16_t));
+    regimage_release(epoch);
+
+    return 0;
+}
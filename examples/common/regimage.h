@@ -0,0 +1,67 @@
+#ifndef __REGIMAGE_H
+#define __REGIMAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Double-buffered register image.
+ *
+ * A single producer fills a back buffer and publishes it with one atomic
+ * pointer swap. Readers take a reference on the current epoch, copy from it
+ * without locking and drop the reference. A buffer is only handed out again
+ * as back buffer once no reader holds it, so old epochs are reclaimed as soon
+ * as the last session lets go of them.
+ *
+ * With `nb_bufs` buffers the producer can always make progress as long as at
+ * most `nb_bufs - 2` old epochs are still pinned.
+ */
+#define REGIMAGE_MIN_BUFS 3
+
+struct regimage_buf {
+    uint16_t *regs;
+    uint32_t epoch;
+    uint32_t ref;
+};
+
+struct regimage {
+    struct regimage_buf *bufs;
+    int nb_bufs;
+    int nb;
+    struct regimage_buf *current;
+    struct regimage_buf *back;
+};
+
+int regimage_init(struct regimage *img, int nb, int nb_bufs);
+void regimage_deinit(struct regimage *img);
+
+uint16_t *regimage_begin(struct regimage *img, int copy_current);
+uint32_t regimage_publish(struct regimage *img);
+
+struct regimage_buf *regimage_acquire(struct regimage *img);
+void regimage_release(struct regimage_buf *buf);
+uint32_t regimage_epoch(struct regimage *img);
+
+void regimage_pin(struct regimage *img);
+void regimage_unpin(struct regimage *img);
+
+int regimage_map_get(struct regimage *img, int index, int nb, void *buf, int bufsz);
+
+/*
+ * Define the `get` interface of a read-only `agile_modbus_slave_util_map_t`
+ * covering `nb` registers of `img` starting at `index`.
+ */
+#define REGIMAGE_MAP_DEFINE(name, img, index, nb)                    \
+    static int name##_get(void *buf, int bufsz)                      \
+    {                                                                \
+        return regimage_map_get((img), (index), (nb), buf, bufsz);   \
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,38 +1,55 @@
 #include "rt_tick.h"
-#include <pthread.h>
-#include <unistd.h>
 
-static uint32_t rt_tick = 0;
-static uint8_t is_initialized = 0;
+#ifdef RT_TICK_USING_HWTICK
 
-static void *rt_tick_entry(void *param)
+static volatile uint32_t rt_tick = 0;
+
+void rt_tick_init(void)
 {
-    int us = 1000000 / RT_TICK_PER_SECOND;
-    while (1) {
-        usleep(us);
-        rt_tick++;
-    }
+    __atomic_store_n(&rt_tick, 0, __ATOMIC_RELAXED);
+}
+
+/* From the system timer interrupt, RT_TICK_PER_SECOND times a second */
+void rt_tick_increase(void)
+{
+    __atomic_add_fetch(&rt_tick, 1, __ATOMIC_RELAXED);
+}
 
-    pthread_exit(NULL);
+uint32_t rt_tick_get(void)
+{
+    return __atomic_load_n(&rt_tick, __ATOMIC_RELAXED);
 }
 
-void rt_tick_init(void)
+uint64_t rt_tick_get_us(void)
 {
-    if (is_initialized)
-        return;
+    return (uint64_t)rt_tick_get() * (1000000 / RT_TICK_PER_SECOND);
+}
+
+#else
 
-    pthread_t tid;
-    pthread_create(&tid, NULL, rt_tick_entry, NULL);
-    pthread_detach(tid);
+#include <time.h>
 
-    is_initialized = 1;
+/* Nothing to start, kept for the callers written against the tick thread */
+void rt_tick_init(void)
+{
 }
 
 uint32_t rt_tick_get(void)
 {
-    return rt_tick;
+    return (uint32_t)(rt_tick_get_us() / (1000000 / RT_TICK_PER_SECOND));
+}
+
+uint64_t rt_tick_get_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+#endif /* RT_TICK_USING_HWTICK */
+
 uint32_t rt_tick_from_millisecond(int32_t ms)
 {
     uint32_t tick;
@@ -2,12 +2,27 @@
 #define __RT_TICK_H
 #include <stdint.h>
 
+/*
+ * Tick clock.
+ *
+ * On Linux the tick is derived from CLOCK_MONOTONIC on every call: no
+ * thread, no drift and the same value from every thread. Define
+ * RT_TICK_USING_HWTICK on targets without it and call `rt_tick_increase`
+ * RT_TICK_PER_SECOND times a second from the system timer interrupt;
+ * `rt_tick_get_us` then has the resolution of one tick.
+ *
+ * Ticks wrap around, compare them by their signed difference.
+ */
 #define RT_TICK_MAX        0xffffffff
-#define RT_TICK_PER_SECOND 200
+#define RT_TICK_PER_SECOND 1000
 #define RT_WAITING_FOREVER -1
 
 void rt_tick_init(void);
 uint32_t rt_tick_get(void);
+uint64_t rt_tick_get_us(void);
 uint32_t rt_tick_from_millisecond(int32_t ms);
+#ifdef RT_TICK_USING_HWTICK
+void rt_tick_increase(void);
+#endif
 
 #endif
@@ -20,7 +20,7 @@
 #define DBG_LEVEL        DBG_LOG
 #include "dbg_log.h"
 
-int tcp_listen(int port, int nb_connection)
+static int tcp_listen_opt(int port, int nb_connection, int reuseport)
 {
     int new_s;
     int enable;
@@ -45,6 +45,13 @@ int tcp_listen(int port, int nb_connection)
         return -1;
     }
 
+    /* Every socket bound with SO_REUSEPORT gets a share of the connections */
+    if (reuseport && setsockopt(new_s, SOL_SOCKET, SO_REUSEPORT,
+                                (char *)&enable, sizeof(enable)) == -1) {
+        close(new_s);
+        return -1;
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     /* If the modbus port is < to 1024, we need the setuid root. */
@@ -73,6 +80,16 @@ int tcp_listen(int port, int nb_connection)
     return new_s;
 }
 
+int tcp_listen(int port, int nb_connection)
+{
+    return tcp_listen_opt(port, nb_connection, 0);
+}
+
+int tcp_listen_shared(int port, int nb_connection)
+{
+    return tcp_listen_opt(port, nb_connection, 1);
+}
+
 int tcp_accept(int s)
 {
     struct sockaddr_in addr;
@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
 int tcp_listen(int port, int nb_connection);
+int tcp_listen_shared(int port, int nb_connection);
 int tcp_accept(int s);
 void tcp_close(int s);
 int tcp_send(int s, const uint8_t *buf, int length);
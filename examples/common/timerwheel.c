@@ -0,0 +1,189 @@
+#include "timerwheel.h"
+#include <string.h>
+
+#define TIMERWHEEL_SHIFT(level) (TIMERWHEEL_BITS * (level))
+
+/* Take every node of `from` into the empty list `to` */
+static void list_move(rt_list_t *to, rt_list_t *from)
+{
+    if (rt_list_isempty(from)) {
+        rt_list_init(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    rt_list_init(from);
+}
+
+static void wheel_insert(struct timerwheel *wheel, struct timerwheel_timer *timer)
+{
+    uint32_t expires = timer->expires;
+    int32_t delta = (int32_t)(expires - wheel->now);
+
+    /* Overdue timers fire on the next tick, far ones wait in the last level */
+    if (delta < 0) {
+        expires = wheel->now;
+        delta = 0;
+    } else if ((uint32_t)delta >= TIMERWHEEL_RANGE) {
+        expires = wheel->now + TIMERWHEEL_RANGE - 1;
+        delta = TIMERWHEEL_RANGE - 1;
+    }
+
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && (uint32_t)delta >= (1UL << TIMERWHEEL_SHIFT(level + 1)))
+        level++;
+
+    int slot = (expires >> TIMERWHEEL_SHIFT(level)) & TIMERWHEEL_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    rt_list_insert_before(&wheel->slots[level][slot], &timer->list);
+    wheel->bitmap[level] |= 1ULL << slot;
+}
+
+/* Place the timers of a slot again, one level down at least */
+static void wheel_cascade(struct timerwheel *wheel, int level, int slot)
+{
+    rt_list_t head;
+
+    list_move(&head, &wheel->slots[level][slot]);
+    wheel->bitmap[level] &= ~(1ULL << slot);
+
+    while (!rt_list_isempty(&head)) {
+        struct timerwheel_timer *timer = rt_list_first_entry(&head, struct timerwheel_timer, list);
+        rt_list_remove(&timer->list);
+        wheel_insert(wheel, timer);
+    }
+}
+
+void timerwheel_init(struct timerwheel *wheel, uint32_t now)
+{
+    memset(wheel, 0, sizeof(struct timerwheel));
+    wheel->now = now;
+
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMERWHEEL_SIZE; slot++)
+            rt_list_init(&wheel->slots[level][slot]);
+    }
+}
+
+void timerwheel_timer_init(struct timerwheel_timer *timer, timerwheel_timeout_t timeout, void *arg)
+{
+    rt_list_init(&timer->list);
+    timer->expires = 0;
+    timer->level = timer->slot = 0;
+    timer->timeout = timeout;
+    timer->arg = arg;
+}
+
+/* Arm `timer` to fire at tick `expires`, a pending timer is moved */
+void timerwheel_add(struct timerwheel *wheel, struct timerwheel_timer *timer, uint32_t expires)
+{
+    timerwheel_del(wheel, timer);
+
+    timer->expires = expires;
+    wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+void timerwheel_del(struct timerwheel *wheel, struct timerwheel_timer *timer)
+{
+    if (rt_list_isempty(&timer->list))
+        return;
+
+    rt_list_remove(&timer->list);
+    if (rt_list_isempty(&wheel->slots[timer->level][timer->slot]))
+        wheel->bitmap[timer->level] &= ~(1ULL << timer->slot);
+    wheel->count--;
+}
+
+int timerwheel_pending(const struct timerwheel_timer *timer)
+{
+    return !rt_list_isempty(&timer->list);
+}
+
+/* Fire every timer due up to and including tick `now` */
+void timerwheel_run(struct timerwheel *wheel, uint32_t now)
+{
+    while ((int32_t)(now - wheel->now) >= 0) {
+        /* Nothing to cascade or fire, catch up at once */
+        if (wheel->count == 0) {
+            wheel->now = now + 1;
+            return;
+        }
+
+        int slot = wheel->now & TIMERWHEEL_MASK;
+
+        /* Level 0 wrapped, bring down the next slot of each level that wrapped with it */
+        if (slot == 0) {
+            for (int level = 1; level < TIMERWHEEL_LEVELS; level++) {
+                int index = (wheel->now >> TIMERWHEEL_SHIFT(level)) & TIMERWHEEL_MASK;
+                wheel_cascade(wheel, level, index);
+                if (index != 0)
+                    break;
+            }
+        }
+
+        /* Callbacks may arm timers for this very tick, those wait for the next run */
+        rt_list_t head;
+        list_move(&head, &wheel->slots[0][slot]);
+        wheel->bitmap[0] &= ~(1ULL << slot);
+        wheel->now++;
+
+        while (!rt_list_isempty(&head)) {
+            struct timerwheel_timer *timer = rt_list_first_entry(&head, struct timerwheel_timer, list);
+            rt_list_remove(&timer->list);
+            wheel->count--;
+            timer->timeout(timer, timer->arg);
+        }
+    }
+}
+
+/* First occupied slot at `min` or more slots after `slot`, TIMERWHEEL_SIZE + `slot` wraps to itself */
+static int bitmap_distance(uint64_t bitmap, int slot, int min)
+{
+    uint64_t rotated = slot ? (bitmap >> slot) | (bitmap << (TIMERWHEEL_SIZE - slot)) : bitmap;
+
+    rotated &= ~((1ULL << min) - 1);
+    if (rotated)
+        return __builtin_ctzll(rotated);
+
+    return (bitmap & (1ULL << slot)) ? TIMERWHEEL_SIZE : -1;
+}
+
+/*
+ * Store in `tick` the earliest tick something is due: a timer of level 0 or
+ * the cascade of a higher level slot. Return -1 when no timer is pending.
+ */
+int timerwheel_next(const struct timerwheel *wheel, uint32_t *tick)
+{
+    uint32_t best = UINT32_MAX;
+
+    if (wheel->count == 0)
+        return -1;
+
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        if (wheel->bitmap[level] == 0)
+            continue;
+
+        int shift = TIMERWHEEL_SHIFT(level);
+        int slot = (wheel->now >> shift) & TIMERWHEEL_MASK;
+        uint32_t offset = wheel->now & ((1UL << shift) - 1);
+
+        /* The current slot of a higher level cascades at this tick only on its boundary, else a turn later */
+        int distance = bitmap_distance(wheel->bitmap[level], slot, offset ? 1 : 0);
+        if (distance < 0)
+            continue;
+
+        uint32_t ticks = ((uint32_t)distance << shift) - offset;
+        if (ticks < best)
+            best = ticks;
+    }
+
+    *tick = wheel->now + best;
+
+    return 0;
+}
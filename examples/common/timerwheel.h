@@ -0,0 +1,64 @@
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <stdint.h>
+#include "rtservice.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hierarchical timer wheel on rt_tick time.
+ *
+ * TIMERWHEEL_LEVELS wheels of TIMERWHEEL_SIZE slots each, every level
+ * TIMERWHEEL_SIZE times coarser than the one below. A timer goes to the
+ * slot of the finest level that covers its distance and is moved down when
+ * the level below wraps, so insert and cancel are O(1) and each timer is
+ * moved at most TIMERWHEEL_LEVELS - 1 times. Expiries further away than
+ * TIMERWHEEL_RANGE ticks wait in the last level and are placed again.
+ *
+ * Timers only fire from `timerwheel_run`, on the thread that owns the
+ * wheel; a timeout callback may add or cancel any timer, itself included.
+ * `timerwheel_next` gives the tick a loop has to wake up at, a bitmap per
+ * level makes that independent of the number of timers.
+ */
+#define TIMERWHEEL_BITS   6
+#define TIMERWHEEL_SIZE   (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK   (TIMERWHEEL_SIZE - 1)
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_RANGE  (1UL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+struct timerwheel_timer;
+
+typedef void (*timerwheel_timeout_t)(struct timerwheel_timer *timer, void *arg);
+
+struct timerwheel_timer {
+    rt_list_t list;
+    uint32_t expires;
+    uint8_t level;
+    uint8_t slot;
+    timerwheel_timeout_t timeout;
+    void *arg;
+};
+
+struct timerwheel {
+    uint32_t now;
+    int count;
+    uint64_t bitmap[TIMERWHEEL_LEVELS];
+    rt_list_t slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SIZE];
+};
+
+void timerwheel_init(struct timerwheel *wheel, uint32_t now);
+void timerwheel_timer_init(struct timerwheel_timer *timer, timerwheel_timeout_t timeout, void *arg);
+void timerwheel_add(struct timerwheel *wheel, struct timerwheel_timer *timer, uint32_t expires);
+void timerwheel_del(struct timerwheel *wheel, struct timerwheel_timer *timer);
+int timerwheel_pending(const struct timerwheel_timer *timer);
+void timerwheel_run(struct timerwheel *wheel, uint32_t now);
+int timerwheel_next(const struct timerwheel *wheel, uint32_t *tick);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
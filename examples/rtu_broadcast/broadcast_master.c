@@ -1,5 +1,7 @@
 #include "agile_modbus.h"
 #include "serial.h"
+#include "filetrans.h"
+#include "rt_tick.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,50 +17,9 @@
 
 static int _fd = -1;
 static struct termios _old_tios = {0};
-static const uint8_t _dirty_buf[100] = {1, 2, 3, 4, 5};
-
-#define AGILE_MODBUS_FC_TRANS_FILE 0x50
-#define TRANS_FILE_CMD_START       0x0001
-#define TRANS_FILE_CMD_DATA        0x0002
-#define TRANS_FILE_FLAG_END        0x00
-#define TRANS_FILE_FLAG_NOT_END    0x01
-
-static uint8_t compute_meta_length_after_function_callback(agile_modbus_t *ctx, int function,
-                                                           agile_modbus_msg_type_t msg_type)
-{
-    int length;
-
-    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
-        length = 0;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = 4;
-    } else {
-        /* MSG_CONFIRMATION */
-        length = 1;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = 3;
-    }
-
-    return length;
-}
-
-static int compute_data_length_after_meta_callback(agile_modbus_t *ctx, uint8_t *msg,
-                                                   int msg_length, agile_modbus_msg_type_t msg_type)
-{
-    int function = msg[ctx->backend->header_length];
-    int length;
-
-    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
-        length = 0;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = (msg[ctx->backend->header_length + 3] << 8) + msg[ctx->backend->header_length + 4];
-    } else {
-        /* MSG_CONFIRMATION */
-        length = 0;
-    }
-
-    return length;
-}
+static struct filetrans_target _targets[247];
+static int _nb_targets = 0;
+static int _options = 0;
 
 static void print_progress(size_t cur_size, size_t total_size)
 {
@@ -155,19 +116,9 @@ static char *normalize_path(char *fullpath)
     return fullpath;
 }
 
-static int trans_file(int slave, char *file_path)
+static int trans_file(char *file_path)
 {
-    uint8_t ctx_send_buf[2048];
-    uint8_t ctx_read_buf[50];
-    uint8_t raw_req[2048];
-    int raw_req_len = 0;
-
-    agile_modbus_rtu_t ctx_rtu;
-    agile_modbus_t *ctx = &ctx_rtu._ctx;
-    agile_modbus_rtu_init(&ctx_rtu, ctx_send_buf, sizeof(ctx_send_buf), ctx_read_buf, sizeof(ctx_read_buf));
-    agile_modbus_set_slave(ctx, slave);
-    agile_modbus_set_compute_meta_length_after_function_cb(ctx, compute_meta_length_after_function_callback);
-    agile_modbus_set_compute_data_length_after_meta_cb(ctx, compute_data_length_after_meta_callback);
+    struct filetrans_master master;
 
     if (normalize_path(file_path) == NULL)
         return -1;
@@ -188,88 +139,64 @@ static int trans_file(int slave, char *file_path)
     if (!S_ISREG(s.st_mode))
         return -1;
 
-    int file_size = s.st_size;
-
-    LOG_I("file name:%s, file size:%d", file_name, file_size);
+    LOG_I("file name:%s, file size:%d", file_name, (int)s.st_size);
     printf("\r\n\r\n");
 
-    FILE *fp = fopen(file_path, "rb");
-    if (fp == NULL)
-        return -1;
-
-    int ret = 0;
-    int write_file_size = 0;
-    int step = 0;
+    filetrans_master_init(&master, _fd, AGILE_MODBUS_BROADCAST_ADDRESS);
+    master.progress = print_progress;
+    master.options = _options;
 
-    raw_req[0] = slave;
-    raw_req[1] = AGILE_MODBUS_FC_TRANS_FILE;
+    uint32_t tick = rt_tick_get();
+    int done = filetrans_master_broadcast(&master, _targets, _nb_targets, file_path, file_name);
+    int ms = (int)((int64_t)(rt_tick_get() - tick) * 1000 / RT_TICK_PER_SECOND);
 
-    while (1) {
-        usleep(5000);
-
-        raw_req_len = 2;
-
-        switch (step) {
-        case 0: {
-            step = 1;
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_START >> 8);
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_START & 0xFF);
-            int nb = 5 + strlen(file_name);
-            raw_req[raw_req_len++] = nb >> 8;
-            raw_req[raw_req_len++] = nb & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 24) & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 16) & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 8) & 0xFF;
-            raw_req[raw_req_len++] = file_size & 0xFF;
-            memcpy(raw_req + raw_req_len, file_name, strlen(file_name));
-            raw_req_len += strlen(file_name);
-            raw_req[raw_req_len++] = '\0';
-        } break;
-
-        case 1: {
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_DATA >> 8);
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_DATA & 0xFF);
-            int nb_pos = raw_req_len;
-            raw_req_len += 3;
-            int recv_bytes = fread(raw_req + raw_req_len, 1, 1024, fp);
-            raw_req_len += recv_bytes;
-            write_file_size += recv_bytes;
-            int nb = recv_bytes + 1;
-            raw_req[nb_pos] = nb >> 8;
-            raw_req[nb_pos + 1] = nb & 0xFF;
-            if (recv_bytes < 1024) {
-                raw_req[nb_pos + 2] = TRANS_FILE_FLAG_END;
-                step = 2;
-            } else
-                raw_req[nb_pos + 2] = TRANS_FILE_FLAG_NOT_END;
-        } break;
-
-        default:
-            break;
-        }
+    printf("\r\n\r\n");
+    if (done < 0) {
+        LOG_W("transfer failed.");
+        return -1;
+    }
 
-        if (ret < 0)
-            break;
+    for (int i = 0; i < _nb_targets; i++) {
+        if (_targets[i].state == FILETRANS_TARGET_FAILED)
+            LOG_W("slave %d doesn't answer.", _targets[i].slave);
+        else if (_targets[i].state == FILETRANS_TARGET_PENDING)
+            LOG_W("slave %d still misses %u chunks.", _targets[i].slave, _targets[i].missing);
+    }
 
-        serial_flush(_fd);
-        int send_len = agile_modbus_serialize_raw_request(ctx, raw_req, raw_req_len);
-        serial_send(_fd, ctx->send_buf, send_len);
+    LOG_I("%d of %d slaves have %d bytes after %d ms, %u chunks, %u repaired.", done, _nb_targets, (int)s.st_size,
+          ms, master.stat.chunks, master.stat.retransmits);
+    LOG_I("%u bytes of chunks sent.", master.stat.bytes);
 
-        //dirty data
-        serial_send(_fd, _dirty_buf, sizeof(_dirty_buf));
+    return done == _nb_targets ? 0 : -1;
+}
 
-        print_progress(write_file_size, file_size);
+/* Slave addresses as "1,3,5-9" */
+static int parse_targets(const char *str)
+{
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        if (first < 1 || last > 247 || first > last)
+            return -1;
+
+        for (long slave = first; slave <= last; slave++) {
+            if (_nb_targets == sizeof(_targets) / sizeof(_targets[0]))
+                return -1;
+            _targets[_nb_targets++].slave = slave;
+        }
 
-        if (step == 2)
-            break;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        str = end;
     }
 
-    fclose(fp);
-    fp = NULL;
-
-    printf("\r\n\r\n");
-
-    return ret;
+    return _nb_targets > 0 ? 0 : -1;
 }
 
 static void *cycle_entry(void *param)
@@ -286,14 +213,22 @@ static void *cycle_entry(void *param)
             }
         }
 
-        trans_file(0, tmp);
+        trans_file(tmp);
     }
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        LOG_E("Please enter broadcast_master [dev]!");
+    if (argc < 3) {
+        LOG_E("Please enter broadcast_master [dev] [slaves] [lz]!");
+        return -1;
+    }
+
+    if (argc > 3 && strcmp(argv[3], "lz") == 0)
+        _options |= FILETRANS_OPTION_LZ;
+
+    if (parse_targets(argv[2]) < 0) {
+        LOG_E("slaves must be like 1,3,5-9 within 1 ~ 247!");
         return -1;
     }
 
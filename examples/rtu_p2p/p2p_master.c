@@ -1,5 +1,7 @@
 #include "agile_modbus.h"
 #include "serial.h"
+#include "filetrans.h"
+#include "rt_tick.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,49 +17,8 @@
 
 static int _fd = -1;
 static struct termios _old_tios = {0};
-
-#define AGILE_MODBUS_FC_TRANS_FILE 0x50
-#define TRANS_FILE_CMD_START       0x0001
-#define TRANS_FILE_CMD_DATA        0x0002
-#define TRANS_FILE_FLAG_END        0x00
-#define TRANS_FILE_FLAG_NOT_END    0x01
-
-static uint8_t compute_meta_length_after_function_callback(agile_modbus_t *ctx, int function,
-                                                           agile_modbus_msg_type_t msg_type)
-{
-    int length;
-
-    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
-        length = 0;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = 4;
-    } else {
-        /* MSG_CONFIRMATION */
-        length = 1;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = 3;
-    }
-
-    return length;
-}
-
-static int compute_data_length_after_meta_callback(agile_modbus_t *ctx, uint8_t *msg,
-                                                   int msg_length, agile_modbus_msg_type_t msg_type)
-{
-    int function = msg[ctx->backend->header_length];
-    int length;
-
-    if (msg_type == AGILE_MODBUS_MSG_INDICATION) {
-        length = 0;
-        if (function == AGILE_MODBUS_FC_TRANS_FILE)
-            length = (msg[ctx->backend->header_length + 3] << 8) + msg[ctx->backend->header_length + 4];
-    } else {
-        /* MSG_CONFIRMATION */
-        length = 0;
-    }
-
-    return length;
-}
+static int _window = FILETRANS_WINDOW_DEFAULT;
+static int _options = 0;
 
 static void print_progress(size_t cur_size, size_t total_size)
 {
@@ -156,17 +117,7 @@ static char *normalize_path(char *fullpath)
 
 static int trans_file(int slave, char *file_path)
 {
-    uint8_t ctx_send_buf[2048];
-    uint8_t ctx_read_buf[50];
-    uint8_t raw_req[2048];
-    int raw_req_len = 0;
-
-    agile_modbus_rtu_t ctx_rtu;
-    agile_modbus_t *ctx = &ctx_rtu._ctx;
-    agile_modbus_rtu_init(&ctx_rtu, ctx_send_buf, sizeof(ctx_send_buf), ctx_read_buf, sizeof(ctx_read_buf));
-    agile_modbus_set_slave(ctx, slave);
-    agile_modbus_set_compute_meta_length_after_function_cb(ctx, compute_meta_length_after_function_callback);
-    agile_modbus_set_compute_data_length_after_meta_cb(ctx, compute_data_length_after_meta_callback);
+    struct filetrans_master master;
 
     if (normalize_path(file_path) == NULL)
         return -1;
@@ -187,109 +138,29 @@ static int trans_file(int slave, char *file_path)
     if (!S_ISREG(s.st_mode))
         return -1;
 
-    int file_size = s.st_size;
-
-    LOG_I("file name:%s, file size:%d", file_name, file_size);
+    LOG_I("file name:%s, file size:%d", file_name, (int)s.st_size);
     printf("\r\n\r\n");
 
-    FILE *fp = fopen(file_path, "rb");
-    if (fp == NULL)
-        return -1;
-
-    int ret = 0;
-    int write_file_size = 0;
-    int step = 0;
-
-    raw_req[0] = slave;
-    raw_req[1] = AGILE_MODBUS_FC_TRANS_FILE;
-
-    while (1) {
-        usleep(10000);
-
-        raw_req_len = 2;
-
-        switch (step) {
-        case 0: {
-            step = 1;
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_START >> 8);
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_START & 0xFF);
-            int nb = 5 + strlen(file_name);
-            raw_req[raw_req_len++] = nb >> 8;
-            raw_req[raw_req_len++] = nb & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 24) & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 16) & 0xFF;
-            raw_req[raw_req_len++] = (file_size >> 8) & 0xFF;
-            raw_req[raw_req_len++] = file_size & 0xFF;
-            memcpy(raw_req + raw_req_len, file_name, strlen(file_name));
-            raw_req_len += strlen(file_name);
-            raw_req[raw_req_len++] = '\0';
-        } break;
-
-        case 1: {
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_DATA >> 8);
-            raw_req[raw_req_len++] = ((uint16_t)TRANS_FILE_CMD_DATA & 0xFF);
-            int nb_pos = raw_req_len;
-            raw_req_len += 3;
-            int recv_bytes = fread(raw_req + raw_req_len, 1, 1024, fp);
-            raw_req_len += recv_bytes;
-            write_file_size += recv_bytes;
-            int nb = recv_bytes + 1;
-            raw_req[nb_pos] = nb >> 8;
-            raw_req[nb_pos + 1] = nb & 0xFF;
-            if (recv_bytes < 1024) {
-                raw_req[nb_pos + 2] = TRANS_FILE_FLAG_END;
-                step = 2;
-            } else
-                raw_req[nb_pos + 2] = TRANS_FILE_FLAG_NOT_END;
-        } break;
-
-        default:
-            break;
-        }
-
-        if (ret < 0)
-            break;
-
-        serial_flush(_fd);
-        int send_len = agile_modbus_serialize_raw_request(ctx, raw_req, raw_req_len);
-        serial_send(_fd, ctx->send_buf, send_len);
-        int read_len = serial_receive(_fd, ctx->read_buf, ctx->read_bufsz, 1000);
-        if (read_len < 0) {
-            LOG_E("Receive error.");
-            ret = -1;
-            break;
-        }
-
-        if (read_len == 0) {
-            LOG_W("Receive timeout.");
-            ret = -1;
-            break;
-        }
+    filetrans_master_init(&master, _fd, slave);
+    master.window = _window;
+    master.options = _options;
+    master.progress = print_progress;
 
-        int rc = agile_modbus_deserialize_raw_response(ctx, read_len);
-        if (rc < 0) {
-            LOG_W("Receive failed.");
-            ret = -1;
-            break;
-        }
+    uint32_t tick = rt_tick_get();
+    int ret = filetrans_master_send(&master, file_path, file_name);
+    int ms = (int)((int64_t)(rt_tick_get() - tick) * 1000 / RT_TICK_PER_SECOND);
 
-        int flag = ctx->read_buf[ctx->backend->header_length + 3];
-        if (flag != 0x01) {
-            LOG_W("ack flag is failed.");
-            ret = -1;
-            break;
-        }
-
-        print_progress(write_file_size, file_size);
-
-        if (step == 2)
-            break;
+    printf("\r\n\r\n");
+    if (ret < 0) {
+        LOG_W("transfer failed.");
+        return -1;
     }
 
-    fclose(fp);
-    fp = NULL;
+    LOG_I("%d bytes in %d ms, %u chunks, %u retransmits, %u ack polls, %u chunks resumed.", (int)s.st_size, ms,
+          master.stat.chunks, master.stat.retransmits, master.stat.polls, master.stat.resumed);
+    LOG_I("%u bytes of chunks sent.", master.stat.bytes);
 
-    return ret;
+    return 0;
 }
 
 static void *cycle_entry(void *param)
@@ -322,10 +193,16 @@ static void *cycle_entry(void *param)
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
-        LOG_E("Please enter p2p_master [dev]!");
+        LOG_E("Please enter p2p_master [dev] [window] [lz]!");
         return -1;
     }
 
+    if (argc > 2)
+        _window = atoi(argv[2]);
+
+    if (argc > 3 && strcmp(argv[3], "lz") == 0)
+        _options |= FILETRANS_OPTION_LZ;
+
     _fd = serial_init(argv[1], 115200, 'N', 8, 1, &_old_tios);
     if (_fd < 0) {
         LOG_E("Open %s failed!", argv[1]);
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include "agile_modbus.h"
+#include "agile_modbus_rtu.h"
+#include "agile_modbus_tcp.h"
+#include "agile_modbus_slave_util.h"
+#include "agile_modbus_slave_router.h"
+#include "mbtcp_gateway.h"
+#include "rt_tick.h"
+#include "tcp.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "selftest"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define SELFTEST_GATEWAY_PORT 15020
+#define SELFTEST_BUS_DELAY    200
+
+static int _failed = 0;
+
+#define CHECK(cond)                                          \
+    do {                                                     \
+        if (!(cond)) {                                       \
+            LOG_E("%s:%d: %s", __func__, __LINE__, #cond);   \
+            _failed++;                                       \
+        }                                                    \
+    } while (0)
+
+/* Master and slave RTU contexts wired back to back, no transport in between */
+static agile_modbus_rtu_t _master;
+static agile_modbus_rtu_t _slave;
+static uint8_t _master_send_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+static uint8_t _master_read_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+static uint8_t _slave_send_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+static uint8_t _slave_read_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+
+static void loopback_init(int slave)
+{
+    agile_modbus_rtu_init(&_master, _master_send_buf, sizeof(_master_send_buf), _master_read_buf, sizeof(_master_read_buf));
+    agile_modbus_rtu_init(&_slave, _slave_send_buf, sizeof(_slave_send_buf), _slave_read_buf, sizeof(_slave_read_buf));
+    agile_modbus_set_slave(&_master._ctx, slave);
+    agile_modbus_set_slave(&_slave._ctx, slave);
+}
+
+/* Hand the request to the slave and its response back to the master, return the response length */
+static int loopback(int send_len, agile_modbus_slave_callback_t slave_cb, const void *slave_data)
+{
+    if (send_len < 0)
+        return -1;
+
+    memcpy(_slave_read_buf, _master_send_buf, send_len);
+    int rsp_len = agile_modbus_slave_handle(&_slave._ctx, send_len, 0, slave_cb, slave_data, NULL);
+    if (rsp_len > 0)
+        memcpy(_master_read_buf, _slave_send_buf, rsp_len);
+
+    return rsp_len;
+}
+
+/* Exception code of a failed deserialize, 0 otherwise */
+static int exception_of(int rc)
+{
+    return rc < -128 ? -128 - rc : 0;
+}
+
+/* 0x07 is answered by the library for ctx->slave only, other units are left to the router */
+static void check_exception_status(void)
+{
+    static const agile_modbus_slave_util_t unit2 = {0};
+    static const int units[] = {1, 2, 5, AGILE_MODBUS_BROADCAST_ADDRESS};
+    agile_modbus_slave_router_t router;
+    volatile uint8_t status = 0x5A;
+
+    loopback_init(1);
+    agile_modbus_set_exception_status(&_slave._ctx, &status);
+    agile_modbus_slave_router_init(&router, NULL);
+    agile_modbus_slave_router_add(&router, 2, &unit2);
+
+    for (int i = 0; i < (int)(sizeof(units) / sizeof(units[0])); i++) {
+        int unit = units[i];
+        agile_modbus_set_slave(&_master._ctx, unit);
+
+        int rsp_len = loopback(agile_modbus_serialize_read_exception_status(&_master._ctx),
+                               agile_modbus_slave_router_callback, &router);
+        if (unit == 1)
+            CHECK(agile_modbus_deserialize_read_exception_status(&_master._ctx, rsp_len) == 0x5A);
+        else if (unit == 2)
+            CHECK(exception_of(agile_modbus_deserialize_read_exception_status(&_master._ctx, rsp_len)) ==
+                  AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+        else
+            CHECK(rsp_len == 0);
+    }
+}
+
+/* 0x08 is answered by the library for ctx->slave only, other units are left to the router */
+static void check_diagnostics(void)
+{
+    static const agile_modbus_slave_util_t unit2 = {0};
+    static const int units[] = {1, 2, 5, AGILE_MODBUS_BROADCAST_ADDRESS};
+    agile_modbus_slave_router_t router;
+    agile_modbus_diag_t diag = {0};
+    uint16_t echo = 0;
+
+    loopback_init(1);
+    agile_modbus_set_diag(&_slave._ctx, &diag);
+    agile_modbus_slave_router_init(&router, NULL);
+    agile_modbus_slave_router_add(&router, 2, &unit2);
+
+    for (int i = 0; i < (int)(sizeof(units) / sizeof(units[0])); i++) {
+        int unit = units[i];
+        agile_modbus_set_slave(&_master._ctx, unit);
+
+        int rsp_len = loopback(agile_modbus_serialize_diagnostics(&_master._ctx, AGILE_MODBUS_DIAG_RETURN_QUERY_DATA, 0x1234),
+                               agile_modbus_slave_router_callback, &router);
+        if (unit == 1) {
+            CHECK(agile_modbus_deserialize_diagnostics(&_master._ctx, rsp_len, &echo) >= 0);
+            CHECK(echo == 0x1234);
+        } else if (unit == 2) {
+            CHECK(exception_of(agile_modbus_deserialize_diagnostics(&_master._ctx, rsp_len, &echo)) ==
+                  AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+        } else {
+            CHECK(rsp_len == 0);
+        }
+    }
+
+    /* Every frame is on the bus, unit 1 and the broadcast are for the server, the broadcast unanswered */
+    CHECK(diag.bus_message == 4);
+    CHECK(diag.server_message == 2);
+    CHECK(diag.server_no_response == 1);
+}
+
+/* Read FIFO Queue leaves the queue as it is until the master acknowledges, and refuses more than 31 registers */
+static void check_fifo(void)
+{
+    static uint16_t buf[64];
+    static agile_modbus_slave_util_fifo_t fifo = {0x0400, buf, sizeof(buf) / sizeof(buf[0]), 0, 0, 0, 0, NULL, NULL};
+    static const agile_modbus_slave_util_t util = {.tab_fifos = &fifo, .nb_fifos = 1};
+    uint16_t values[AGILE_MODBUS_MAX_FIFO_COUNT];
+    uint16_t events[45];
+    uint16_t acked = 10;
+
+    for (int i = 0; i < 45; i++)
+        events[i] = i;
+
+    loopback_init(1);
+    agile_modbus_slave_util_fifo_push(&fifo, events, 10);
+
+    for (int i = 0; i < 2; i++) {
+        int rsp_len = loopback(agile_modbus_serialize_read_fifo_queue(&_master._ctx, 0x0400), agile_modbus_slave_util_callback, &util);
+        CHECK(agile_modbus_deserialize_read_fifo_queue(&_master._ctx, rsp_len, values) == 10);
+        CHECK(values[0] == 0 && values[9] == 9);
+    }
+
+    /* The ack takes out what the read returned, the same ack again takes nothing */
+    agile_modbus_slave_util_fifo_push(&fifo, events + 10, 5);
+    int rsp_len = loopback(agile_modbus_serialize_write_register(&_master._ctx, 0x0400, acked), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_write_register(&_master._ctx, rsp_len) >= 0);
+    CHECK(fifo.count == 5);
+
+    rsp_len = loopback(agile_modbus_serialize_write_registers(&_master._ctx, 0x0400, 1, &acked), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_write_registers(&_master._ctx, rsp_len) >= 0);
+    CHECK(fifo.count == 5);
+
+    rsp_len = loopback(agile_modbus_serialize_read_fifo_queue(&_master._ctx, 0x0400), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_read_fifo_queue(&_master._ctx, rsp_len, values) == 5);
+    CHECK(values[0] == 10 && values[4] == 14);
+
+    /* A refused read returned nothing to acknowledge */
+    agile_modbus_slave_util_fifo_push(&fifo, events + 15, 30);
+    rsp_len = loopback(agile_modbus_serialize_read_fifo_queue(&_master._ctx, 0x0400), agile_modbus_slave_util_callback, &util);
+    CHECK(exception_of(agile_modbus_deserialize_read_fifo_queue(&_master._ctx, rsp_len, values)) ==
+          AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    rsp_len = loopback(agile_modbus_serialize_write_register(&_master._ctx, 0x0400, AGILE_MODBUS_MAX_FIFO_COUNT),
+                       agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_write_register(&_master._ctx, rsp_len) >= 0);
+    CHECK(fifo.count == 35);
+
+    CHECK(agile_modbus_slave_util_fifo_pop(&fifo, NULL, 20) == 20);
+    rsp_len = loopback(agile_modbus_serialize_read_fifo_queue(&_master._ctx, 0x0400), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_read_fifo_queue(&_master._ctx, rsp_len, values) == 15);
+    CHECK(values[0] == 30 && values[14] == 44);
+}
+
+static uint16_t _records[10];
+
+static int records_get(int index, int len, uint16_t *buf)
+{
+    memcpy(buf, &_records[index], len * sizeof(uint16_t));
+    return 0;
+}
+
+static int records_set(int index, int len, const uint16_t *buf)
+{
+    memcpy(&_records[index], buf, len * sizeof(uint16_t));
+    return 0;
+}
+
+/* Records past the end of the file or past record 9999 are an illegal data address */
+static void check_file_record(void)
+{
+    static const agile_modbus_slave_util_file_map_t files[1] = {{1, 10, records_get, records_set}};
+    static const agile_modbus_slave_util_t util = {.tab_files = files, .nb_files = 1};
+    uint16_t data[4] = {0x1111, 0x2222, 0x3333, 0x4444};
+    agile_modbus_file_record_t record = {1, 8, 2, data};
+
+    loopback_init(1);
+
+    int rsp_len = loopback(agile_modbus_serialize_write_file_record(&_master._ctx, &record, 1), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_write_file_record(&_master._ctx, rsp_len) >= 0);
+    CHECK(_records[8] == 0x1111 && _records[9] == 0x2222);
+
+    record.nb = 4;
+    rsp_len = loopback(agile_modbus_serialize_read_file_record(&_master._ctx, &record, 1), agile_modbus_slave_util_callback, &util);
+    CHECK(exception_of(agile_modbus_deserialize_read_file_record(&_master._ctx, rsp_len, &record, 1)) ==
+          AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    rsp_len = loopback(agile_modbus_serialize_write_file_record(&_master._ctx, &record, 1), agile_modbus_slave_util_callback, &util);
+    CHECK(exception_of(agile_modbus_deserialize_write_file_record(&_master._ctx, rsp_len)) ==
+          AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    CHECK(_records[9] == 0x2222);
+
+    /* The master refuses records past 9999, the slave must as well */
+    record.record = AGILE_MODBUS_MAX_FILE_RECORD_NUMBER - 1;
+    CHECK(agile_modbus_serialize_read_file_record(&_master._ctx, &record, 1) < 0);
+
+    record.record = 0;
+    int send_len = agile_modbus_serialize_read_file_record(&_master._ctx, &record, 1);
+    _master_send_buf[6] = (AGILE_MODBUS_MAX_FILE_RECORD_NUMBER - 1) >> 8;
+    _master_send_buf[7] = (AGILE_MODBUS_MAX_FILE_RECORD_NUMBER - 1) & 0xFF;
+    uint16_t crc = agile_modbus_rtu_crc16(_master_send_buf, send_len - 2);
+    _master_send_buf[send_len - 2] = crc >> 8;
+    _master_send_buf[send_len - 1] = crc & 0xFF;
+    rsp_len = loopback(send_len, agile_modbus_slave_util_callback, &util);
+    CHECK(exception_of(agile_modbus_deserialize_read_file_record(&_master._ctx, rsp_len, &record, 1)) ==
+          AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+}
+
+static uint16_t _registers[10];
+static uint64_t _registers_version = 1;
+
+static int registers_get(void *buf, int bufsz)
+{
+    (void)bufsz;
+    memcpy(buf, _registers, sizeof(_registers));
+    return 0;
+}
+
+static int registers_set(int index, int len, void *buf, int bufsz)
+{
+    (void)bufsz;
+    memcpy(&_registers[index], (uint16_t *)buf + index, len * sizeof(uint16_t));
+    return 0;
+}
+
+static uint64_t registers_version(void)
+{
+    return _registers_version;
+}
+
+/* Cached reads are dropped by a write through the slave and by a change of version */
+static void check_cache(void)
+{
+    static agile_modbus_slave_util_cache_entry_t entries[4];
+    static agile_modbus_slave_util_cache_t cache = {
+        .entries = entries,
+        .nb_entries = sizeof(entries) / sizeof(entries[0]),
+        .version = registers_version,
+        .lock = NULL,
+        .unlock = NULL,
+        .hits = 0,
+        .misses = 0};
+    static const agile_modbus_slave_util_map_t maps[1] = {{0, 9, registers_get, registers_set}};
+    static const agile_modbus_slave_util_t util = {.tab_registers = maps, .nb_registers = 1, .cache = &cache};
+    uint16_t values[4];
+
+    loopback_init(1);
+
+    for (int i = 0; i < 2; i++) {
+        int rsp_len = loopback(agile_modbus_serialize_read_registers(&_master._ctx, 0, 4), agile_modbus_slave_util_callback, &util);
+        CHECK(agile_modbus_deserialize_read_registers(&_master._ctx, rsp_len, values) == 4);
+    }
+    CHECK(cache.misses == 1 && cache.hits == 1);
+
+    int rsp_len = loopback(agile_modbus_serialize_write_register(&_master._ctx, 1, 0x55), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_write_register(&_master._ctx, rsp_len) >= 0);
+
+    rsp_len = loopback(agile_modbus_serialize_read_registers(&_master._ctx, 0, 4), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_read_registers(&_master._ctx, rsp_len, values) == 4);
+    CHECK(values[1] == 0x55);
+    CHECK(cache.misses == 2);
+
+    /* Changed behind the slave, only the version tells */
+    _registers[2] = 0x66;
+    _registers_version++;
+    rsp_len = loopback(agile_modbus_serialize_read_registers(&_master._ctx, 0, 4), agile_modbus_slave_util_callback, &util);
+    CHECK(agile_modbus_deserialize_read_registers(&_master._ctx, rsp_len, values) == 4);
+    CHECK(values[2] == 0x66);
+    CHECK(cache.misses == 3);
+}
+
+/* RTU slave on the far side of a pseudo terminal, reads take SELFTEST_BUS_DELAY ms */
+static volatile int _bus_running;
+static uint16_t _bus_register;
+
+static int bus_get(void *buf, int bufsz)
+{
+    (void)bufsz;
+    usleep(SELFTEST_BUS_DELAY * 1000);
+    *(uint16_t *)buf = _bus_register;
+    return 0;
+}
+
+static int bus_set(int index, int len, void *buf, int bufsz)
+{
+    (void)index;
+    (void)len;
+    (void)bufsz;
+    _bus_register = *(uint16_t *)buf;
+    return 0;
+}
+
+static void *bus_entry(void *param)
+{
+    static const agile_modbus_slave_util_map_t maps[1] = {{0, 0, bus_get, bus_set}};
+    static const agile_modbus_slave_util_t util = {.tab_registers = maps, .nb_registers = 1};
+    uint8_t send_buf[AGILE_MODBUS_RTU_MAX_ADU_LENGTH];
+    uint8_t read_buf[AGILE_MODBUS_RTU_MAX_ADU_LENGTH];
+    agile_modbus_rtu_t ctx_rtu;
+    agile_modbus_t *ctx = &ctx_rtu._ctx;
+    int fd = *(int *)param;
+    int len = 0;
+
+    agile_modbus_rtu_init(&ctx_rtu, send_buf, sizeof(send_buf), read_buf, sizeof(read_buf));
+    agile_modbus_set_slave(ctx, 1);
+
+    while (_bus_running) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        int rc = read(fd, read_buf + len, sizeof(read_buf) - len);
+        if (rc <= 0)
+            continue;
+        len += rc;
+
+        int frame_length = 0;
+        rc = agile_modbus_slave_handle(ctx, len, 1, agile_modbus_slave_util_callback, &util, &frame_length);
+        if (rc < 0)
+            continue;
+        if (rc > 0 && write(fd, send_buf, rc) != rc)
+            break;
+
+        len -= frame_length;
+        memmove(read_buf, read_buf + frame_length, len);
+    }
+
+    return NULL;
+}
+
+struct gateway_client {
+    int sock;
+    agile_modbus_tcp_t ctx_tcp;
+    uint8_t send_buf[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+    uint8_t read_buf[AGILE_MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+static int client_open(struct gateway_client *client)
+{
+    agile_modbus_tcp_init(&client->ctx_tcp, client->send_buf, sizeof(client->send_buf), client->read_buf,
+                          sizeof(client->read_buf));
+    agile_modbus_set_slave(&client->ctx_tcp._ctx, 1);
+    client->sock = tcp_connect("127.0.0.1", SELFTEST_GATEWAY_PORT);
+
+    return client->sock;
+}
+
+static int client_send(struct gateway_client *client, int send_len)
+{
+    return send_len > 0 ? tcp_send(client->sock, client->send_buf, send_len) : -1;
+}
+
+/* Register 0 as read through the gateway, -1 on failure */
+static int client_read_result(struct gateway_client *client)
+{
+    uint16_t value;
+
+    int read_len = tcp_receive(client->sock, client->read_buf, sizeof(client->read_buf), 2000);
+    if (agile_modbus_deserialize_read_registers(&client->ctx_tcp._ctx, read_len, &value) != 1)
+        return -1;
+
+    return value;
+}
+
+static void *gateway_entry(void *param)
+{
+    mbtcp_gateway_run(param);
+
+    return NULL;
+}
+
+/* A read never shares a response taken before a write to its unit was queued */
+static void check_gateway(void)
+{
+    static struct mbtcp_gateway gateway;
+    static struct mbtcp_gateway_port port;
+    struct gateway_client clients[3];
+    struct mbtcp_gateway_stat stat;
+    pthread_t bus_tid, gateway_tid;
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        LOG_E("Open pseudo terminal failed!");
+        _failed++;
+        return;
+    }
+
+    _bus_running = 1;
+    pthread_create(&bus_tid, NULL, bus_entry, &fd);
+
+    mbtcp_gateway_port_init(&port, ptsname(fd), 115200, 1, 1);
+    if (mbtcp_gateway_init(&gateway, SELFTEST_GATEWAY_PORT, 8, 10000, &port, 1) < 0) {
+        LOG_E("Gateway init failed!");
+        _failed++;
+        goto _exit;
+    }
+    pthread_create(&gateway_tid, NULL, gateway_entry, &gateway);
+    usleep(200000);
+
+    for (int i = 0; i < 3; i++)
+        CHECK(client_open(&clients[i]) >= 0);
+
+    /* A reads, B writes while A is on the bus, C reads after the write was queued */
+    client_send(&clients[0], agile_modbus_serialize_read_registers(&clients[0].ctx_tcp._ctx, 0, 1));
+    usleep(SELFTEST_BUS_DELAY * 1000 / 4);
+    client_send(&clients[1], agile_modbus_serialize_write_register(&clients[1].ctx_tcp._ctx, 0, 7));
+    client_send(&clients[2], agile_modbus_serialize_read_registers(&clients[2].ctx_tcp._ctx, 0, 1));
+
+    CHECK(client_read_result(&clients[0]) == 0);
+    int read_len = tcp_receive(clients[1].sock, clients[1].read_buf, sizeof(clients[1].read_buf), 2000);
+    CHECK(agile_modbus_deserialize_write_register(&clients[1].ctx_tcp._ctx, read_len) >= 0);
+    CHECK(client_read_result(&clients[2]) == 7);
+
+    mbtcp_gateway_port_stat(&port, &stat);
+    CHECK(stat.deduped == 0);
+
+    /* Without a write in between the same read is shared */
+    client_send(&clients[0], agile_modbus_serialize_read_registers(&clients[0].ctx_tcp._ctx, 0, 1));
+    usleep(SELFTEST_BUS_DELAY * 1000 / 4);
+    client_send(&clients[2], agile_modbus_serialize_read_registers(&clients[2].ctx_tcp._ctx, 0, 1));
+
+    CHECK(client_read_result(&clients[0]) == 7);
+    CHECK(client_read_result(&clients[2]) == 7);
+
+    mbtcp_gateway_port_stat(&port, &stat);
+    CHECK(stat.deduped == 1);
+
+    for (int i = 0; i < 3; i++)
+        tcp_close(clients[i].sock);
+
+    mbtcp_gateway_stop(&gateway);
+    pthread_join(gateway_tid, NULL);
+    mbtcp_gateway_deinit(&gateway);
+
+_exit:
+    _bus_running = 0;
+    pthread_join(bus_tid, NULL);
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        void (*check)(void);
+    } checks[] = {
+        {"read exception status (0x07)", check_exception_status},
+        {"diagnostics (0x08)", check_diagnostics},
+        {"read FIFO queue (0x18)", check_fifo},
+        {"file record bounds (0x14 / 0x15)", check_file_record},
+        {"response cache", check_cache},
+        {"gateway read after write", check_gateway},
+    };
+
+    (void)argc;
+    (void)argv;
+
+    rt_tick_init();
+
+    for (int i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+        int failed = _failed;
+
+        checks[i].check();
+        if (_failed == failed)
+            LOG_I("%s: passed.", checks[i].name);
+        else
+            LOG_E("%s: %d checks failed!", checks[i].name, _failed - failed);
+    }
+
+    return _failed ? 1 : 0;
+}
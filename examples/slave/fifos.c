@@ -0,0 +1,63 @@
+#include "slave.h"
+#include <unistd.h>
+
+static pthread_mutex_t _fifo_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* No more than a response holds, so the queue is always readable and the overflow is reported by bit 0 */
+static uint16_t _fifo_buf[AGILE_MODBUS_MAX_FIFO_COUNT];
+
+static void fifo_lock(void)
+{
+    pthread_mutex_lock(&_fifo_mtx);
+}
+
+static void fifo_unlock(void)
+{
+    pthread_mutex_unlock(&_fifo_mtx);
+}
+
+agile_modbus_slave_util_fifo_t fifo_maps[1] = {
+    {0x0400, _fifo_buf, sizeof(_fifo_buf) / sizeof(_fifo_buf[0]), 0, 0, 0, 0, fifo_lock, fifo_unlock}};
+
+/* Queue an event number every 50ms, a master reads the pending ones with Read FIFO Queue and acknowledges them */
+static void *event_entry(void *param)
+{
+    agile_modbus_slave_util_fifo_t *fifo = &fifo_maps[0];
+    uint16_t event = 0;
+    uint32_t reported_overflows = 0;
+    int drop_ticks = 0;
+
+    (void)param;
+
+    while (1) {
+        usleep(50000);
+        agile_modbus_slave_util_fifo_push(fifo, &event, 1);
+        event++;
+
+        /* Bit 0 holds for 1s after the last drop so polling masters see it, then clears */
+        fifo_lock();
+        if (fifo->overflows != reported_overflows) {
+            reported_overflows = fifo->overflows;
+            drop_ticks = 20;
+        } else if (drop_ticks > 0) {
+            drop_ticks--;
+        }
+        /* Whole byte at once, served by Read Exception Status without locking */
+        uint8_t status = (drop_ticks > 0 ? 0x01 : 0) | (fifo->count > fifo->size / 2 ? 0x02 : 0);
+        fifo_unlock();
+        slave_exception_status = status;
+    }
+
+    return NULL;
+}
+
+int fifo_maps_init(void)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, event_entry, NULL) != 0)
+        return -1;
+
+    pthread_detach(tid);
+
+    return 0;
+}
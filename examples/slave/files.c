@@ -0,0 +1,25 @@
+#include "slave.h"
+
+/* File 1, records 0 ~ 9999, the whole record number range of a file */
+static uint16_t _file_records[AGILE_MODBUS_MAX_FILE_RECORD_NUMBER + 1];
+
+static int get_file_records(int index, int len, uint16_t *buf)
+{
+    pthread_mutex_lock(&slave_mtx);
+    memcpy(buf, _file_records + index, len * sizeof(uint16_t));
+    pthread_mutex_unlock(&slave_mtx);
+
+    return 0;
+}
+
+static int set_file_records(int index, int len, const uint16_t *buf)
+{
+    pthread_mutex_lock(&slave_mtx);
+    memcpy(_file_records + index, buf, len * sizeof(uint16_t));
+    pthread_mutex_unlock(&slave_mtx);
+
+    return 0;
+}
+
+const agile_modbus_slave_util_file_map_t file_maps[1] = {
+    {1, sizeof(_file_records) / sizeof(_file_records[0]), get_file_records, set_file_records}};
@@ -1,19 +1,20 @@
 #include "slave.h"
 
-static uint16_t _tab_input_registers[10] = {0, 1, 2, 3, 4, 9, 8, 7, 6, 5};
+static const uint16_t _init_input_registers[10] = {0, 1, 2, 3, 4, 9, 8, 7, 6, 5};
 
-static int get_map_buf(void *buf, int bufsz)
+REGIMAGE_MAP_DEFINE(input_register_map, &slave_regimage, 0xFFF6, 10)
+
+int input_register_maps_init(void)
 {
-    uint16_t *ptr = (uint16_t *)buf;
+    uint16_t *regs = regimage_begin(&slave_regimage, 1);
+    if (regs == NULL)
+        return -1;
 
-    pthread_mutex_lock(&slave_mtx);
-    for (int i = 0; i < sizeof(_tab_input_registers) / sizeof(_tab_input_registers[0]); i++) {
-        ptr[i] = _tab_input_registers[i];
-    }
-    pthread_mutex_unlock(&slave_mtx);
+    memcpy(regs + 0xFFF6, _init_input_registers, sizeof(_init_input_registers));
+    regimage_publish(&slave_regimage);
 
     return 0;
 }
 
 const agile_modbus_slave_util_map_t input_register_maps[1] = {
-    {0xFFF6, 0xFFFF, get_map_buf, NULL}};
+    {0xFFF6, 0xFFFF, input_register_map_get, NULL}};
@@ -13,6 +13,7 @@
 
 static int _fd = -1;
 static struct termios _old_tios = {0};
+static agile_modbus_diag_t _diag = {0};
 
 static void *rtu_entry(void *param)
 {
@@ -23,6 +24,8 @@ static void *rtu_entry(void *param)
     agile_modbus_t *ctx = &ctx_rtu._ctx;
     agile_modbus_rtu_init(&ctx_rtu, ctx_send_buf, sizeof(ctx_send_buf), ctx_read_buf, sizeof(ctx_read_buf));
     agile_modbus_set_slave(ctx, 1);
+    agile_modbus_set_diag(ctx, &_diag);
+    agile_modbus_set_exception_status(ctx, &slave_exception_status);
 
     LOG_I("Running.");
 
@@ -36,7 +39,7 @@ static void *rtu_entry(void *param)
         if (read_len == 0)
             continue;
 
-        int send_len = agile_modbus_slave_handle(ctx, read_len, 0, agile_modbus_slave_util_callback, &slave_util, NULL);
+        int send_len = agile_modbus_slave_handle(ctx, read_len, 0, agile_modbus_slave_router_callback, &slave_router, NULL);
         serial_flush(_fd);
         if (send_len > 0)
             serial_send(_fd, ctx->send_buf, send_len);
@@ -1,6 +1,9 @@
 #include "slave.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include "rt_tick.h"
 
 #define DBG_ENABLE
@@ -13,21 +16,167 @@ extern const agile_modbus_slave_util_map_t bit_maps[1];
 extern const agile_modbus_slave_util_map_t input_bit_maps[1];
 extern const agile_modbus_slave_util_map_t register_maps[1];
 extern const agile_modbus_slave_util_map_t input_register_maps[1];
+extern const agile_modbus_slave_util_file_map_t file_maps[1];
+extern agile_modbus_slave_util_fifo_t fifo_maps[1];
+
+extern int register_maps_init(void);
+extern int input_register_maps_init(void);
+extern int fifo_maps_init(void);
 
 extern int rtu_slave_init(const char *dev, pthread_t *tid);
-extern int tcp_slave_init(int port, pthread_t *tid);
+extern int tcp_slave_init(int port, int nb_shards, pthread_t *tid);
+extern int udp_slave_init(int port, pthread_t *tid);
 
 pthread_mutex_t slave_mtx;
+struct regbank slave_regbank;
+struct regimage slave_regimage;
+/* Read Exception Status (0x07), bit 0: events were dropped, bit 1: event FIFO more than half full */
+volatile uint8_t slave_exception_status = 0;
+
+static pthread_mutex_t _cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static agile_modbus_slave_util_cache_entry_t _cache_entries[32];
+
+/* Both counters only move up, packed side by side the version never repeats */
+static uint64_t cache_version(void)
+{
+    return ((uint64_t)regbank_version(&slave_regbank) << 32) | regimage_epoch(&slave_regimage);
+}
+
+static void cache_lock(void)
+{
+    pthread_mutex_lock(&_cache_mtx);
+}
+
+static void cache_unlock(void)
+{
+    pthread_mutex_unlock(&_cache_mtx);
+}
+
+static agile_modbus_slave_util_cache_t _cache = {
+    .entries = _cache_entries,
+    .nb_entries = sizeof(_cache_entries) / sizeof(_cache_entries[0]),
+    .version = cache_version,
+    .lock = cache_lock,
+    .unlock = cache_unlock,
+    .hits = 0,
+    .misses = 0};
+
+agile_modbus_slave_router_t slave_router;
+
+static pthread_mutex_t _dirty_mtx = PTHREAD_MUTEX_INITIALIZER;
+static agile_modbus_slave_util_dirty_range_t _dirty_ranges[16];
+static int _dirty_fd = -1;
+
+static void dirty_lock(void)
+{
+    pthread_mutex_lock(&_dirty_mtx);
+}
+
+static void dirty_unlock(void)
+{
+    pthread_mutex_unlock(&_dirty_mtx);
+}
+
+static void dirty_notify(void *arg)
+{
+    uint64_t value = 1;
+    if (write(_dirty_fd, &value, sizeof(value)) != sizeof(value))
+        LOG_W("Written range notify failed.");
+}
+
+static agile_modbus_slave_util_dirty_t _dirty = {
+    _dirty_ranges,
+    sizeof(_dirty_ranges) / sizeof(_dirty_ranges[0]),
+    0,
+    0,
+    dirty_notify,
+    NULL,
+    dirty_lock,
+    dirty_unlock};
+
+static void *dirty_entry(void *param)
+{
+    agile_modbus_slave_util_dirty_range_t ranges[8];
+    uint64_t value;
+
+    while (read(_dirty_fd, &value, sizeof(value)) == sizeof(value)) {
+        int nb, overflow;
+
+        do {
+            nb = agile_modbus_slave_util_dirty_drain(&_dirty, ranges, sizeof(ranges) / sizeof(ranges[0]), &overflow);
+            if (overflow)
+                LOG_W("Written range log overflowed, rescan all registers.");
+
+            for (int i = 0; i < nb; i++) {
+                LOG_I("Slave %d wrote %s 0x%04X ~ 0x%04X", ranges[i].slave,
+                      (ranges[i].function == AGILE_MODBUS_FC_READ_COILS) ? "coils" : "registers",
+                      ranges[i].address, ranges[i].address + ranges[i].nb - 1);
+            }
+        } while (nb == sizeof(ranges) / sizeof(ranges[0]));
+    }
+
+    return NULL;
+}
+
+/* Identification objects, serialized once at start up */
+static uint8_t _device_id_buf[1024];
+static agile_modbus_device_id_t _device_id;
+
+static int device_id_add_string(int id, const char *value)
+{
+    return agile_modbus_device_id_add(&_device_id, id, value, strlen(value));
+}
+
+static int device_id_init(void)
+{
+    char buf[AGILE_MODBUS_MAX_DEVICE_ID_OBJECT_LENGTH + 1];
+    int rc = 0;
+
+    agile_modbus_device_id_init(&_device_id, _device_id_buf, sizeof(_device_id_buf));
+
+    /* Basic */
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_VENDOR_NAME, "loogg");
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_PRODUCT_CODE, "AGILE-MODBUS-SLAVE");
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION, AGILE_MODBUS_VERSION_STRING);
+
+    /* Regular */
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_VENDOR_URL, "https://github.com/loogg/agile_modbus");
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_PRODUCT_NAME, "Agile Modbus example slave");
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_MODEL_NAME, "ModbusSlave");
+    rc |= device_id_add_string(AGILE_MODBUS_DEVICE_ID_USER_APPLICATION_NAME, "slave");
+
+    /* Extended, one object per data area, more than one response holds */
+    snprintf(buf, sizeof(buf), "coils 0x%04X-0x%04X, discrete inputs 0x%04X-0x%04X",
+             bit_maps[0].start_addr, bit_maps[0].end_addr, input_bit_maps[0].start_addr, input_bit_maps[0].end_addr);
+    rc |= device_id_add_string(0x80, buf);
+    snprintf(buf, sizeof(buf), "holding registers 0x%04X-0x%04X, input registers 0x%04X-0x%04X",
+             register_maps[0].start_addr, register_maps[0].end_addr, input_register_maps[0].start_addr, input_register_maps[0].end_addr);
+    rc |= device_id_add_string(0x81, buf);
+    snprintf(buf, sizeof(buf), "file %d of %d records, FIFO queue 0x%04X of %d registers",
+             file_maps[0].file, file_maps[0].nb_records, fifo_maps[0].address, fifo_maps[0].size);
+    rc |= device_id_add_string(0x82, buf);
+
+    return rc;
+}
 
 static int addr_check(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info)
 {
-    int slave = slave_info->sft->slave;
-    if ((slave != ctx->slave) && (slave != AGILE_MODBUS_BROADCAST_ADDRESS) && (slave != 0xFF))
-        return -AGILE_MODBUS_EXCEPTION_UNKNOW;
+    /* Unit identifiers are filtered by slave_router */
+
+    /* Serve the whole request from one input register epoch */
+    if (slave_info->sft->function == AGILE_MODBUS_FC_READ_INPUT_REGISTERS)
+        regimage_pin(&slave_regimage);
 
     return 0;
 }
 
+static int done(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, int ret)
+{
+    regimage_unpin(&slave_regimage);
+
+    return ret;
+}
+
 const agile_modbus_slave_util_t slave_util = {
     bit_maps,
     sizeof(bit_maps) / sizeof(bit_maps[0]),
@@ -39,24 +188,72 @@ const agile_modbus_slave_util_t slave_util = {
     sizeof(input_register_maps) / sizeof(input_register_maps[0]),
     addr_check,
     NULL,
-    NULL};
+    done,
+    &_cache,
+    &_dirty,
+    file_maps,
+    sizeof(file_maps) / sizeof(file_maps[0]),
+    fifo_maps,
+    sizeof(fifo_maps) / sizeof(fifo_maps[0]),
+    &_device_id};
 
 int main(int argc, char *argv[])
 {
     if (argc < 3) {
-        LOG_E("Please enter ModbusSlave [dev] [port]!");
+        LOG_E("Please enter ModbusSlave [dev] [port] [shards]!");
         return -1;
     }
 
     pthread_mutex_init(&slave_mtx, NULL);
 
+    /* Holding registers cover the whole address space, indexed by register address */
+    if (regbank_init(&slave_regbank, 0x10000) < 0) {
+        LOG_E("Register bank init failed!");
+        return -1;
+    }
+    register_maps_init();
+
+    /* Input registers are published by a producer as whole snapshots */
+    if (regimage_init(&slave_regimage, 0x10000, REGIMAGE_MIN_BUFS) < 0) {
+        LOG_E("Register image init failed!");
+        return -1;
+    }
+    input_register_maps_init();
+
+    /* Events are queued by a producer thread in a FIFO queue */
+    fifo_maps_init();
+
+    /* Identification objects never change, serialize them before any request comes in */
+    if (device_id_init() < 0) {
+        LOG_E("Device identification init failed!");
+        return -1;
+    }
+
+    /* Answer as unit 1, broadcast and 0xFF, stay silent for all other units */
+    agile_modbus_slave_router_init(&slave_router, NULL);
+    agile_modbus_slave_router_add(&slave_router, 1, &slave_util);
+    agile_modbus_slave_router_add(&slave_router, AGILE_MODBUS_BROADCAST_ADDRESS, &slave_util);
+    agile_modbus_slave_router_add(&slave_router, 0xFF, &slave_util);
+
+    /* Written ranges are handed to a consumer thread, woken through an eventfd */
+    _dirty_fd = eventfd(0, EFD_CLOEXEC);
+    if (_dirty_fd >= 0) {
+        pthread_t dirty_tid;
+        pthread_create(&dirty_tid, NULL, dirty_entry, NULL);
+        pthread_detach(dirty_tid);
+    } else {
+        _dirty.notify = NULL;
+    }
+
     rt_tick_init();
 
     pthread_t rtu_tid;
     pthread_t tcp_tid;
+    pthread_t udp_tid;
 
     int rc1 = rtu_slave_init(argv[1], &rtu_tid);
-    int rc2 = tcp_slave_init(atoi(argv[2]), &tcp_tid);
+    int rc2 = tcp_slave_init(atoi(argv[2]), (argc > 3) ? atoi(argv[3]) : 1, &tcp_tid);
+    int rc3 = udp_slave_init(atoi(argv[2]), &udp_tid);
 
     if (rc1 == 0)
         pthread_join(rtu_tid, NULL);
@@ -64,5 +261,8 @@ int main(int argc, char *argv[])
     if (rc2 == 0)
         pthread_join(tcp_tid, NULL);
 
+    if (rc3 == 0)
+        pthread_join(udp_tid, NULL);
+
     return 0;
 }
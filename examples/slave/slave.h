@@ -7,11 +7,19 @@ extern "C" {
 
 #include <stdint.h>
 #include <pthread.h>
+#include <string.h>
 #include "agile_modbus.h"
 #include "agile_modbus_slave_util.h"
+#include "agile_modbus_slave_router.h"
+#include "regbank.h"
+#include "regimage.h"
 
 extern pthread_mutex_t slave_mtx;
+extern struct regbank slave_regbank;
+extern struct regimage slave_regimage;
+extern volatile uint8_t slave_exception_status;
 extern const agile_modbus_slave_util_t slave_util;
+extern agile_modbus_slave_router_t slave_router;
 
 #ifdef __cplusplus
 }
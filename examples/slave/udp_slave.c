@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mbudp_server.h"
+#include "slave.h"
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "udp_slave"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+static int _listen_port = 0;
+static struct mbudp_server _server;
+
+static void *mbudp_entry(void *param)
+{
+    while (1) {
+        if (mbudp_server_init(&_server, _listen_port, agile_modbus_slave_router_callback, &slave_router) == 0) {
+            agile_modbus_set_exception_status(&_server.ctx_udp._ctx, &slave_exception_status);
+            mbudp_server_run(&_server);
+            mbudp_server_deinit(&_server);
+        }
+
+        LOG_W("mbudp server go wrong, now wait restarting...");
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+int udp_slave_init(int port, pthread_t *tid)
+{
+    if (port <= 0) {
+        LOG_E("Port must be greater than 0!");
+        return -1;
+    }
+
+    _listen_port = port;
+
+    pthread_create(tid, NULL, mbudp_entry, NULL);
+
+    return 0;
+}
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include "agile_modbus.h"
+#include "agile_modbus_slave_util.h"
+#include "mbtcp_server.h"
+#include "regbank.h"
+#include "rt_tick.h"
+#include "tcp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "tcp_bench"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define BENCH_REGISTERS       10
+#define BENCH_REQUEST_LENGTH  12
+#define BENCH_RESPONSE_LENGTH (9 + BENCH_REGISTERS * 2)
+
+static struct regbank _bank;
+
+REGBANK_MAP_DEFINE(register_map, &_bank, 0, 125)
+
+static const agile_modbus_slave_util_map_t _register_maps[1] = {
+    {0, 124, register_map_get, register_map_set}};
+
+static const agile_modbus_slave_util_t _slave_util = {
+    NULL,
+    0,
+    NULL,
+    0,
+    _register_maps,
+    sizeof(_register_maps) / sizeof(_register_maps[0]),
+    NULL,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL};
+
+static uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Thread-per-session server, the design tcp_slave.c used before mbtcp_server,
+ * without its session cap.
+ */
+static int _thread_running = 0;
+static int _thread_listen_fd = -1;
+
+/* tcp_receive() with poll, select can't watch descriptors past FD_SETSIZE */
+static int thread_receive(int s, uint8_t *buf, int bufsz, int timeout)
+{
+    struct pollfd pfd = {.fd = s, .events = POLLIN};
+    int len = 0;
+
+    while (bufsz > 0) {
+        int rc = poll(&pfd, 1, timeout);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+
+        rc = recv(s, buf + len, bufsz, MSG_DONTWAIT);
+        if (rc < 0)
+            return -1;
+        if (rc == 0)
+            return (len == 0) ? -1 : len;
+
+        len += rc;
+        bufsz -= rc;
+
+        timeout = 50;
+    }
+
+    return len;
+}
+
+static void *thread_session_entry(void *param)
+{
+    int fd = (int)(intptr_t)param;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    uint8_t ctx_send_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+    uint8_t ctx_read_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
+
+    agile_modbus_tcp_t ctx_tcp;
+    agile_modbus_t *ctx = &ctx_tcp._ctx;
+    agile_modbus_tcp_init(&ctx_tcp, ctx_send_buf, sizeof(ctx_send_buf), ctx_read_buf, sizeof(ctx_read_buf));
+    agile_modbus_set_slave(ctx, 1);
+
+    while (__atomic_load_n(&_thread_running, __ATOMIC_ACQUIRE)) {
+        int rc = thread_receive(fd, ctx->read_buf, ctx->read_bufsz, 1000);
+        if (rc < 0)
+            break;
+        if (rc > 0) {
+            int send_len = agile_modbus_slave_handle(ctx, rc, 0, agile_modbus_slave_util_callback, &_slave_util, NULL);
+            tcp_flush(fd);
+            if (send_len > 0) {
+                if (tcp_send(fd, ctx->send_buf, send_len) != send_len)
+                    break;
+            }
+        }
+    }
+
+    tcp_close(fd);
+
+    return NULL;
+}
+
+static void *thread_server_entry(void *param)
+{
+    struct pollfd pfd = {.fd = _thread_listen_fd, .events = POLLIN};
+
+    while (__atomic_load_n(&_thread_running, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        int fd = accept4(_thread_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        int option = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, thread_session_entry, (void *)(intptr_t)fd) != 0) {
+            tcp_close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+static void *server_entry(void *param)
+{
+    mbtcp_server_run((struct mbtcp_server *)param);
+
+    return NULL;
+}
+
+static void *group_server_entry(void *param)
+{
+    mbtcp_server_group_run((struct mbtcp_server_group *)param);
+
+    return NULL;
+}
+
+/*
+ * Clients
+ */
+static int bench_request(uint8_t *buf, uint16_t tid)
+{
+    buf[0] = tid >> 8;
+    buf[1] = tid & 0xFF;
+    buf[2] = 0;
+    buf[3] = 0;
+    buf[4] = 0;
+    buf[5] = 6;
+    buf[6] = 1;
+    buf[7] = AGILE_MODBUS_FC_READ_HOLDING_REGISTERS;
+    buf[8] = 0;
+    buf[9] = 0;
+    buf[10] = 0;
+    buf[11] = BENCH_REGISTERS;
+
+    return BENCH_REQUEST_LENGTH;
+}
+
+static int bench_connect(int port)
+{
+    int s = tcp_connect("127.0.0.1", port);
+    if (s < 0)
+        return -1;
+
+    /* Reset on close, so the client side doesn't run out of ports in TIME_WAIT */
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(s, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    return s;
+}
+
+static int bench_receive(int s, uint8_t *buf, int len, int timeout)
+{
+    struct pollfd pfd = {.fd = s, .events = POLLIN};
+    int pos = 0;
+
+    while (pos < len) {
+        if (poll(&pfd, 1, timeout) <= 0)
+            return -1;
+
+        int rc = recv(s, buf + pos, len - pos, 0);
+        if (rc <= 0)
+            return -1;
+
+        pos += rc;
+    }
+
+    return pos;
+}
+
+/* Connect, do one request and close, as fast as possible */
+static double bench_connections(int port, int seconds)
+{
+    uint8_t req[BENCH_REQUEST_LENGTH];
+    uint8_t rsp[BENCH_RESPONSE_LENGTH];
+    uint64_t start = bench_now_us();
+    uint64_t deadline = start + (uint64_t)seconds * 1000000;
+    int count = 0;
+    int failed = 0;
+
+    while (bench_now_us() < deadline) {
+        int s = bench_connect(port);
+        if (s < 0) {
+            failed++;
+            continue;
+        }
+
+        int len = bench_request(req, count);
+        if (tcp_send(s, req, len) == len && bench_receive(s, rsp, sizeof(rsp), 1000) == sizeof(rsp))
+            count++;
+        else
+            failed++;
+
+        close(s);
+    }
+
+    if (failed)
+        LOG_W("%d connections failed.", failed);
+
+    return count * 1000000.0 / (bench_now_us() - start);
+}
+
+struct bench_client {
+    int fd;
+    uint16_t tid;
+    int rx_len;
+    uint64_t sent;
+    uint8_t rx_buf[BENCH_RESPONSE_LENGTH];
+};
+
+struct bench_load {
+    int port;
+    int nb;
+    int seconds;
+    uint64_t count;
+    uint64_t latency;
+    uint64_t elapsed;
+};
+
+/* Keep one request outstanding on each of `nb` connections */
+static void *bench_load_entry(void *param)
+{
+    struct bench_load *load = (struct bench_load *)param;
+    struct bench_client *clients = calloc(load->nb, sizeof(struct bench_client));
+    struct epoll_event events[64];
+    uint8_t req[BENCH_REQUEST_LENGTH];
+    int nb = 0;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (clients == NULL || epfd < 0)
+        goto _exit;
+
+    for (; nb < load->nb; nb++) {
+        struct bench_client *client = &clients[nb];
+
+        client->fd = bench_connect(load->port);
+        if (client->fd < 0) {
+            LOG_E("Connect %d failed.", nb);
+            goto _exit;
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &ev);
+    }
+
+    uint64_t start = bench_now_us();
+    uint64_t deadline = start + (uint64_t)load->seconds * 1000000;
+
+    for (int i = 0; i < nb; i++) {
+        clients[i].sent = bench_now_us();
+        tcp_send(clients[i].fd, req, bench_request(req, clients[i].tid));
+    }
+
+    while (1) {
+        uint64_t now = bench_now_us();
+        if (now >= deadline)
+            break;
+
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), (deadline - now) / 1000 + 1);
+        for (int i = 0; i < n; i++) {
+            struct bench_client *client = (struct bench_client *)events[i].data.ptr;
+
+            int rc = recv(client->fd, client->rx_buf + client->rx_len, sizeof(client->rx_buf) - client->rx_len, MSG_DONTWAIT);
+            if (rc <= 0) {
+                if (rc < 0 && errno == EAGAIN)
+                    continue;
+                LOG_E("Connection %d lost.", (int)(client - clients));
+                goto _exit;
+            }
+
+            client->rx_len += rc;
+            if (client->rx_len < BENCH_RESPONSE_LENGTH)
+                continue;
+
+            if (((client->rx_buf[0] << 8) | client->rx_buf[1]) != client->tid) {
+                LOG_E("Transaction identifier mismatch.");
+                goto _exit;
+            }
+
+            now = bench_now_us();
+            load->latency += now - client->sent;
+            load->count++;
+
+            client->rx_len = 0;
+            client->tid++;
+            client->sent = now;
+            tcp_send(client->fd, req, bench_request(req, client->tid));
+        }
+    }
+
+    load->elapsed = bench_now_us() - start;
+
+_exit:
+    for (int i = 0; i < nb; i++)
+        close(clients[i].fd);
+    if (epfd >= 0)
+        close(epfd);
+    free(clients);
+
+    return NULL;
+}
+
+/* Spread `nb` connections over `nb_threads` client threads */
+static double bench_requests(int port, int nb, int seconds, int nb_threads, double *latency)
+{
+    struct bench_load loads[nb_threads];
+    pthread_t tids[nb_threads];
+    uint64_t count = 0;
+    uint64_t total_latency = 0;
+    uint64_t elapsed = 0;
+
+    memset(loads, 0, sizeof(loads));
+
+    for (int i = 0; i < nb_threads; i++) {
+        loads[i].port = port;
+        loads[i].nb = nb / nb_threads + ((i < nb % nb_threads) ? 1 : 0);
+        loads[i].seconds = seconds;
+        pthread_create(&tids[i], NULL, bench_load_entry, &loads[i]);
+    }
+
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(tids[i], NULL);
+
+        /* A thread that failed reports no time, its requests don't count */
+        if (loads[i].elapsed == 0)
+            continue;
+
+        count += loads[i].count;
+        total_latency += loads[i].latency;
+        if (loads[i].elapsed > elapsed)
+            elapsed = loads[i].elapsed;
+    }
+
+    *latency = count ? (double)total_latency / count : 0;
+
+    return elapsed ? count * 1000000.0 / elapsed : 0;
+}
+
+static void bench_run(const char *name, int port, int nb, int seconds)
+{
+    double latency = 0;
+
+    usleep(100000);
+
+    double conn_rate = bench_connections(port, seconds);
+    double req_rate = bench_requests(port, nb, seconds, 1, &latency);
+
+    printf("%-20s %12.0f %12.0f %12.1f\r\n", name, conn_rate, req_rate, latency);
+}
+
+static int bench_server(const char *name, int port, int nb, int seconds, int uring)
+{
+    struct mbtcp_server server;
+    pthread_t tid;
+
+    if (mbtcp_server_init(&server, port, nb + 16, 0, agile_modbus_slave_util_callback, &_slave_util) < 0) {
+        LOG_E("Server init failed!");
+        return -1;
+    }
+
+#ifdef MBTCP_SERVER_USING_URING
+    server.uring = uring;
+#else
+    (void)uring;
+#endif
+
+    pthread_create(&tid, NULL, server_entry, &server);
+    bench_run(name, port, nb, seconds);
+    mbtcp_server_stop(&server);
+    pthread_join(tid, NULL);
+    mbtcp_server_deinit(&server);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nb = (argc > 1) ? atoi(argv[1]) : 100;
+    int seconds = (argc > 2) ? atoi(argv[2]) : 3;
+    int port = (argc > 3) ? atoi(argv[3]) : 1502;
+    int max_shards = (argc > 4) ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (nb <= 0 || seconds <= 0 || port <= 0 || max_shards <= 0) {
+        LOG_E("Please enter TcpBench [connections] [seconds] [port] [max_shards]!");
+        return -1;
+    }
+
+    rt_tick_init();
+
+    if (regbank_init(&_bank, 125) < 0) {
+        LOG_E("Register bank init failed!");
+        return -1;
+    }
+
+    LOG_I("%d connections, %d s per test, port %d.", nb, seconds, port);
+    printf("%-20s %12s %12s %12s\r\n", "server", "conn/s", "req/s", "latency(us)");
+
+    /* Thread per session */
+    pthread_t tid;
+
+    _thread_listen_fd = tcp_listen(port, MBTCP_SERVER_BACKLOG);
+    if (_thread_listen_fd < 0) {
+        LOG_E("Listen on port %d failed!", port);
+        return -1;
+    }
+
+    _thread_running = 1;
+    pthread_create(&tid, NULL, thread_server_entry, NULL);
+    bench_run("thread-per-session", port, nb, seconds);
+    __atomic_store_n(&_thread_running, 0, __ATOMIC_RELEASE);
+    pthread_join(tid, NULL);
+    tcp_close(_thread_listen_fd);
+
+    /* mbtcp_server, on each backend that was built */
+    if (bench_server("epoll", port, nb, seconds, 0) < 0)
+        return -1;
+#ifdef MBTCP_SERVER_USING_URING
+    if (bench_server("io_uring", port, nb, seconds, 1) < 0)
+        return -1;
+#endif
+
+    /* SO_REUSEPORT shards sharing the register bank, one client thread per shard, default backend */
+    printf("\r\n%-20s %12s %12s\r\n", "shards", "req/s", "latency(us)");
+
+    for (int nb_shards = 1;; nb_shards *= 2) {
+        struct mbtcp_server_group group;
+        double latency = 0;
+
+        if (nb_shards > max_shards)
+            nb_shards = max_shards;
+
+        if (mbtcp_server_group_init(&group, nb_shards, port, nb + 16, 0, agile_modbus_slave_util_callback, &_slave_util) < 0) {
+            LOG_E("Server group init failed!");
+            return -1;
+        }
+
+        pthread_create(&tid, NULL, group_server_entry, &group);
+        usleep(100000);
+        double req_rate = bench_requests(port, nb, seconds, nb_shards, &latency);
+        mbtcp_server_group_stop(&group);
+        pthread_join(tid, NULL);
+        mbtcp_server_group_deinit(&group);
+
+        printf("%-20d %12.0f %12.1f\r\n", nb_shards, req_rate, latency);
+
+        if (nb_shards == max_shards)
+            break;
+    }
+
+    regbank_deinit(&_bank);
+
+    return 0;
+}
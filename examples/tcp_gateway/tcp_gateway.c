@@ -0,0 +1,114 @@
+#include "mbtcp_gateway.h"
+#include "rt_tick.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "tcp_gateway"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define GATEWAY_MAX_CONNS 1024
+#define GATEWAY_TIMEOUT   60
+#define GATEWAY_REPORT    10
+
+static struct mbtcp_gateway _gateway;
+
+static void *gateway_entry(void *param)
+{
+    mbtcp_gateway_run(&_gateway);
+
+    return NULL;
+}
+
+/* device:baudrate:first-last */
+static int parse_port(struct mbtcp_gateway_port *port, char *arg)
+{
+    char *baud = strchr(arg, ':');
+    if (baud == NULL)
+        return -1;
+    *baud++ = '\0';
+
+    char *units = strchr(baud, ':');
+    if (units == NULL)
+        return -1;
+    *units++ = '\0';
+
+    int unit_min, unit_max;
+    if (sscanf(units, "%d-%d", &unit_min, &unit_max) != 2 || unit_min < 1 || unit_max > 255 || unit_min > unit_max)
+        return -1;
+
+    if (atoi(baud) <= 0)
+        return -1;
+
+    mbtcp_gateway_port_init(port, arg, atoi(baud), unit_min, unit_max);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ttl = 0;
+    int relay = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rt:")) != -1) {
+        if (opt == 't')
+            ttl = atoi(optarg);
+        else if (opt == 'r')
+            relay = 1;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3) {
+        LOG_E("Please enter TcpGateway [-r] [-t cache ttl(ms)] [port] [device:baudrate:first-last]...!");
+        return -1;
+    }
+
+    int nb_ports = argc - 2;
+    struct mbtcp_gateway_port *ports = calloc(nb_ports, sizeof(struct mbtcp_gateway_port));
+    if (ports == NULL)
+        return -1;
+
+    for (int i = 0; i < nb_ports; i++) {
+        if (parse_port(&ports[i], argv[i + 2]) < 0) {
+            LOG_E("Invalid port %s!", argv[i + 2]);
+            return -1;
+        }
+    }
+
+    rt_tick_init();
+
+    if (mbtcp_gateway_init(&_gateway, atoi(argv[1]), GATEWAY_MAX_CONNS, GATEWAY_TIMEOUT * 1000, ports, nb_ports) < 0) {
+        LOG_E("Gateway init failed!");
+        return -1;
+    }
+    _gateway.dedup_ttl = ttl;
+    _gateway.relay = relay;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, gateway_entry, NULL);
+
+    while (1) {
+        sleep(GATEWAY_REPORT);
+
+        for (int i = 0; i < nb_ports; i++) {
+            struct mbtcp_gateway_stat stat;
+            mbtcp_gateway_port_stat(&ports[i], &stat);
+
+            uint32_t done = stat.responses + stat.timeouts + stat.errors;
+            LOG_I("%s: depth %d (max %d), requests %u, responses %u, timeouts %u, errors %u, rejected %u.",
+                  ports[i].device, stat.depth, stat.max_depth, stat.requests, stat.responses, stat.timeouts,
+                  stat.errors, stat.rejected);
+            LOG_I("%s: deduplicated %u, from cache %u.", ports[i].device, stat.deduped, stat.cached);
+            if (done > 0 && stat.responses > 0)
+                LOG_I("%s: wait %u us (max %u), bus %u us (max %u).", ports[i].device, (uint32_t)(stat.wait_sum / done),
+                      stat.wait_max, (uint32_t)(stat.bus_sum / stat.responses), stat.bus_max);
+        }
+    }
+}
@@ -14,11 +14,193 @@
 
 static int _sock = -1;
 
+static int transfer(agile_modbus_t *ctx, int send_len)
+{
+    if (send_len < 0) {
+        LOG_E("Serialize failed.");
+        return -1;
+    }
+
+    tcp_flush(_sock);
+    tcp_send(_sock, ctx->send_buf, send_len);
+    int read_len = tcp_receive(_sock, ctx->read_buf, ctx->read_bufsz, 1000);
+    if (read_len == 0)
+        LOG_W("Receive timeout.");
+
+    return read_len;
+}
+
+/* Write records 0 ~ 3 of file 1, read them back together with records 100 ~ 101 in one request */
+static int file_record_cycle(agile_modbus_t *ctx, uint16_t seq)
+{
+    uint16_t written[4] = {seq, seq + 1, seq + 2, seq + 3};
+    uint16_t first[4];
+    uint16_t second[2];
+    agile_modbus_file_record_t records[2] = {
+        {1, 0, 4, written},
+        {1, 100, 2, second}};
+
+    int read_len = transfer(ctx, agile_modbus_serialize_write_file_record(ctx, records, 1));
+    if (read_len <= 0)
+        return read_len;
+
+    int rc = agile_modbus_deserialize_write_file_record(ctx, read_len);
+    if (rc < 0) {
+        LOG_W("Write file record failed.");
+        if (rc != -1)
+            LOG_W("Error code:%d", -128 - rc);
+
+        return 0;
+    }
+
+    records[0].data = first;
+    read_len = transfer(ctx, agile_modbus_serialize_read_file_record(ctx, records, 2));
+    if (read_len <= 0)
+        return read_len;
+
+    rc = agile_modbus_deserialize_read_file_record(ctx, read_len, records, 2);
+    if (rc < 0) {
+        LOG_W("Read file record failed.");
+        if (rc != -1)
+            LOG_W("Error code:%d", -128 - rc);
+
+        return 0;
+    }
+
+    LOG_I("File 1 records 0 ~ 3: 0x%04X 0x%04X 0x%04X 0x%04X, 100 ~ 101: 0x%04X 0x%04X",
+          first[0], first[1], first[2], first[3], second[0], second[1]);
+
+    return read_len;
+}
+
+/* Read the pending events of the FIFO at 0x0400 and their count, then acknowledge them for the slave to take them out */
+static int fifo_cycle(agile_modbus_t *ctx)
+{
+    uint16_t events[AGILE_MODBUS_MAX_FIFO_COUNT];
+
+    int read_len = transfer(ctx, agile_modbus_serialize_read_fifo_queue(ctx, 0x0400));
+    if (read_len <= 0)
+        return read_len;
+
+    int rc = agile_modbus_deserialize_read_fifo_queue(ctx, read_len, events);
+    if (rc < 0) {
+        LOG_W("Read FIFO queue failed.");
+        if (rc != -1)
+            LOG_W("Error code:%d", -128 - rc);
+
+        return 0;
+    }
+
+    if (rc == 0) {
+        LOG_I("FIFO: empty");
+        return read_len;
+    }
+
+    LOG_I("FIFO: %d events, %u ~ %u", rc, events[0], events[rc - 1]);
+
+    /* Until the ack the events stay queued, a lost response or ack gets them read again */
+    read_len = transfer(ctx, agile_modbus_serialize_write_register(ctx, 0x0400, rc));
+    if (read_len <= 0)
+        return read_len;
+
+    rc = agile_modbus_deserialize_write_register(ctx, read_len);
+    if (rc < 0) {
+        LOG_W("Acknowledge FIFO queue failed.");
+        if (rc != -1)
+            LOG_W("Error code:%d", -128 - rc);
+    }
+
+    return read_len;
+}
+
+/* Echo `seq` with return query data, then read how many requests the server took and how many it refused */
+static int diag_cycle(agile_modbus_t *ctx, uint16_t seq)
+{
+    static const int sub_functions[] = {AGILE_MODBUS_DIAG_RETURN_QUERY_DATA, AGILE_MODBUS_DIAG_SERVER_MESSAGE_COUNT,
+                                        AGILE_MODBUS_DIAG_BUS_EXCEPTION_ERROR_COUNT};
+    uint16_t values[3];
+
+    for (int i = 0; i < 3; i++) {
+        int read_len = transfer(ctx, agile_modbus_serialize_diagnostics(ctx, sub_functions[i], i ? 0 : seq));
+        if (read_len <= 0)
+            return read_len;
+
+        int rc = agile_modbus_deserialize_diagnostics(ctx, read_len, &values[i]);
+        if (rc < 0) {
+            LOG_W("Diagnostics failed.");
+            if (rc != -1)
+                LOG_W("Error code:%d", -128 - rc);
+
+            return 0;
+        }
+    }
+
+    LOG_I("Diagnostics: echo %s, server messages %u, exceptions %u", values[0] == seq ? "ok" : "mismatch", values[1], values[2]);
+
+    return 1;
+}
+
+/* Poll the exception status byte, the cheapest status request there is */
+static int exception_status_cycle(agile_modbus_t *ctx)
+{
+    int read_len = transfer(ctx, agile_modbus_serialize_read_exception_status(ctx));
+    if (read_len <= 0)
+        return read_len;
+
+    int rc = agile_modbus_deserialize_read_exception_status(ctx, read_len);
+    if (rc < 0) {
+        LOG_W("Read exception status failed.");
+        if (rc != -1)
+            LOG_W("Error code:%d", -128 - rc);
+
+        return 0;
+    }
+
+    LOG_I("Exception status: 0x%02X", rc);
+
+    return read_len;
+}
+
+/* Read every identification object of the slave, in as many requests as the objects need */
+static int read_device_id(agile_modbus_t *ctx)
+{
+    agile_modbus_device_id_object_t objects[16];
+    int conformity = 0;
+    int object_id = 0;
+
+    do {
+        int read_len = transfer(ctx, agile_modbus_serialize_read_device_id(ctx, AGILE_MODBUS_READ_DEVICE_ID_EXTENDED, object_id));
+        if (read_len <= 0)
+            return read_len;
+
+        int rc = agile_modbus_deserialize_read_device_id(ctx, read_len, &conformity, &object_id, objects,
+                                                         sizeof(objects) / sizeof(objects[0]));
+        if (rc < 0) {
+            LOG_W("Read device identification failed.");
+            if (rc != -1)
+                LOG_W("Error code:%d", -128 - rc);
+
+            return 0;
+        }
+
+        if (rc > (int)(sizeof(objects) / sizeof(objects[0])))
+            rc = sizeof(objects) / sizeof(objects[0]);
+
+        for (int i = 0; i < rc; i++)
+            LOG_I("Object 0x%02X: %.*s", objects[i].id, objects[i].length, (const char *)objects[i].value);
+    } while (object_id);
+
+    LOG_I("Conformity level: 0x%02X", conformity);
+
+    return 1;
+}
+
 static void *cycle_entry(void *param)
 {
     uint8_t ctx_send_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
     uint8_t ctx_read_buf[AGILE_MODBUS_MAX_ADU_LENGTH];
     uint16_t hold_register[10];
+    uint16_t seq = 0;
 
     agile_modbus_tcp_t ctx_tcp;
     agile_modbus_t *ctx = &ctx_tcp._ctx;
@@ -27,6 +209,12 @@ static void *cycle_entry(void *param)
 
     LOG_I("Running.");
 
+    if (read_device_id(ctx) < 0) {
+        LOG_E("Receive error, now exit.");
+        tcp_close(_sock);
+        return NULL;
+    }
+
     while (1) {
         usleep(100000);
 
@@ -57,10 +245,19 @@ static void *cycle_entry(void *param)
         for (int i = 0; i < 10; i++)
             LOG_I("Register [%d]: 0x%04X", i, hold_register[i]);
 
+        if (file_record_cycle(ctx, seq) < 0 || fifo_cycle(ctx) < 0 || diag_cycle(ctx, seq) < 0 ||
+            exception_status_cycle(ctx) < 0) {
+            LOG_E("Receive error, now exit.");
+            break;
+        }
+        seq += 4;
+
         printf("\r\n\r\n\r\n");
     }
 
     tcp_close(_sock);
+
+    return NULL;
 }
 
 int main(int argc, char *argv[])
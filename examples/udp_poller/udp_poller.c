@@ -0,0 +1,131 @@
+#include "mbudp_master.h"
+#include "rt_tick.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DBG_ENABLE
+#define DBG_COLOR
+#define DBG_SECTION_NAME "udp_poller"
+#define DBG_LEVEL        DBG_LOG
+#include "dbg_log.h"
+
+#define POLLER_NB_REGISTERS 10
+#define POLLER_TIMEOUT      300
+#define POLLER_RETRIES      2
+#define POLLER_REPORT       5
+
+struct meter {
+    struct mbudp_device dev;
+    struct mbudp_request req;
+    uint16_t registers[POLLER_NB_REGISTERS];
+    int busy;
+};
+
+static struct mbudp_master _master;
+
+static void *master_entry(void *param)
+{
+    mbudp_master_run(&_master);
+
+    return NULL;
+}
+
+/* Runs on the master thread */
+static void meter_done(struct mbudp_device *dev, struct mbudp_request *req, int rc)
+{
+    struct meter *meter = req->arg;
+
+    if (rc < -128)
+        LOG_W("slave %d exception %d.", dev->slave, -128 - rc);
+
+    __atomic_store_n(&meter->busy, 0, __ATOMIC_RELEASE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        LOG_E("Please enter UdpPoller [ip] [port] [devices] [period(ms)]!");
+        return -1;
+    }
+
+    int port = atoi(argv[2]);
+    int nb = argc > 3 ? atoi(argv[3]) : 800;
+    int period = argc > 4 ? atoi(argv[4]) : 1000;
+    if (nb <= 0 || period <= 0) {
+        LOG_E("Devices and period must be greater than 0!");
+        return -1;
+    }
+
+    rt_tick_init();
+
+    if (mbudp_master_init(&_master) < 0) {
+        LOG_E("Master init failed!");
+        return -1;
+    }
+
+    struct meter *meters = calloc(nb, sizeof(struct meter));
+    if (meters == NULL)
+        return -1;
+
+    for (int i = 0; i < nb; i++) {
+        if (mbudp_device_init(&meters[i].dev, argv[1], port, 1) < 0) {
+            LOG_E("Invalid address %s!", argv[1]);
+            return -1;
+        }
+        mbudp_master_add(&_master, &meters[i].dev);
+
+        struct mbudp_request *req = &meters[i].req;
+        req->function = AGILE_MODBUS_FC_READ_HOLDING_REGISTERS;
+        req->address = 0;
+        req->nb = POLLER_NB_REGISTERS;
+        req->data = meters[i].registers;
+        req->timeout = POLLER_TIMEOUT;
+        req->retries = POLLER_RETRIES;
+        req->cb = meter_done;
+        req->arg = &meters[i];
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, master_entry, NULL);
+
+    LOG_I("Polling %d device(s) every %d ms.", nb, period);
+
+    uint32_t tick_report = rt_tick_get();
+    int skipped = 0;
+
+    while (1) {
+        usleep(period * 1000);
+
+        /* A meter still waiting for its last answer skips this round */
+        for (int i = 0; i < nb; i++) {
+            if (__atomic_load_n(&meters[i].busy, __ATOMIC_ACQUIRE)) {
+                skipped++;
+                continue;
+            }
+
+            meters[i].busy = 1;
+            if (mbudp_master_submit(&meters[i].dev, &meters[i].req) < 0)
+                meters[i].busy = 0;
+        }
+
+        if (rt_tick_get() - tick_report < rt_tick_from_millisecond(POLLER_REPORT * 1000))
+            continue;
+        tick_report = rt_tick_get();
+
+        /* Counters are only written by the master thread, a racy snapshot is fine for a report */
+        uint32_t responses = 0, retransmits = 0, timeouts = 0, errors = 0;
+        for (int i = 0; i < nb; i++) {
+            struct mbudp_device *dev = &meters[i].dev;
+            responses += dev->stat.responses;
+            retransmits += dev->stat.retransmits;
+            timeouts += dev->stat.timeouts;
+            errors += dev->stat.errors;
+        }
+
+        LOG_I("responses %u, retransmits %u, timeouts %u, errors %u, duplicates %u, skipped %d.", responses,
+              retransmits, timeouts, errors, _master.duplicates, skipped);
+    }
+}
@@ -52,11 +52,16 @@ extern "C" {
 #define AGILE_MODBUS_FC_WRITE_SINGLE_COIL        0x05
 #define AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER    0x06
 #define AGILE_MODBUS_FC_READ_EXCEPTION_STATUS    0x07
+#define AGILE_MODBUS_FC_DIAGNOSTICS              0x08
 #define AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS     0x0F
 #define AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS 0x10
 #define AGILE_MODBUS_FC_REPORT_SLAVE_ID          0x11
+#define AGILE_MODBUS_FC_READ_FILE_RECORD         0x14
+#define AGILE_MODBUS_FC_WRITE_FILE_RECORD        0x15
 #define AGILE_MODBUS_FC_MASK_WRITE_REGISTER      0x16
 #define AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS 0x17
+#define AGILE_MODBUS_FC_READ_FIFO_QUEUE          0x18
+#define AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE   0x2B
 /**
  * @}
  */
@@ -104,6 +109,98 @@ extern "C" {
  * @}
  */
 
+/** @name File record limits
+ @verbatim
+    Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 14 page 32)
+    Reference Type (1 byte): 6
+    Record number (2 bytes): 0x0000 to 0x270F
+    Byte Count of the read request (1 byte): 0x07 to 0xF5, 7 bytes per sub-request
+    (chapter 6 section 15 page 34)
+    Request data length of the write request (1 byte): 0x09 to 0xFB
+
+ @endverbatim
+ * @{
+ */
+#define AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE 6
+#define AGILE_MODBUS_MAX_FILE_RECORD_NUMBER     0x270F
+#define AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH  7
+#define AGILE_MODBUS_MAX_READ_FILE_RECORDS      35
+/**
+ * @}
+ */
+
+/** @name FIFO queue limit
+ @verbatim
+    Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 18 page 41)
+    FIFO Count (2 bytes): <= 31
+
+ @endverbatim
+ * @{
+ */
+#define AGILE_MODBUS_MAX_FIFO_COUNT 31
+/**
+ * @}
+ */
+
+/** @name Diagnostics sub-functions
+ @verbatim
+    Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 8 page 20)
+    Sub-function (2 bytes) + Data (2 bytes, N bytes for return query data)
+    The counters are 16 bits, they wrap and are cleared by 0x0A.
+
+ @endverbatim
+ * @{
+ */
+#define AGILE_MODBUS_DIAG_RETURN_QUERY_DATA         0x00
+#define AGILE_MODBUS_DIAG_CLEAR_COUNTERS            0x0A
+#define AGILE_MODBUS_DIAG_BUS_MESSAGE_COUNT         0x0B
+#define AGILE_MODBUS_DIAG_BUS_COMM_ERROR_COUNT      0x0C
+#define AGILE_MODBUS_DIAG_BUS_EXCEPTION_ERROR_COUNT 0x0D
+#define AGILE_MODBUS_DIAG_SERVER_MESSAGE_COUNT      0x0E
+#define AGILE_MODBUS_DIAG_SERVER_NO_RESPONSE_COUNT  0x0F
+#define AGILE_MODBUS_DIAG_SERVER_NAK_COUNT          0x10
+#define AGILE_MODBUS_DIAG_SERVER_BUSY_COUNT         0x11
+#define AGILE_MODBUS_DIAG_BUS_CHAR_OVERRUN_COUNT    0x12
+#define AGILE_MODBUS_DIAG_CLEAR_OVERRUN_COUNTER     0x14
+/**
+ * @}
+ */
+
+/** @name Read device identification
+ @verbatim
+    Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 21 page 43)
+    MEI Type (1 byte): 0x0E
+    Read Device ID code (1 byte): 01 basic / 02 regular / 03 extended stream access, 04 one specific object
+    Object Id (1 byte): 0x00 ~ 0x02 basic, 0x03 ~ 0x7F regular, 0x80 ~ 0xFF extended
+
+ @endverbatim
+ * @{
+ */
+#define AGILE_MODBUS_MEI_READ_DEVICE_ID 0x0E
+
+#define AGILE_MODBUS_READ_DEVICE_ID_BASIC    0x01
+#define AGILE_MODBUS_READ_DEVICE_ID_REGULAR  0x02
+#define AGILE_MODBUS_READ_DEVICE_ID_EXTENDED 0x03
+#define AGILE_MODBUS_READ_DEVICE_ID_SPECIFIC 0x04
+
+#define AGILE_MODBUS_DEVICE_ID_VENDOR_NAME           0x00
+#define AGILE_MODBUS_DEVICE_ID_PRODUCT_CODE          0x01
+#define AGILE_MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION  0x02
+#define AGILE_MODBUS_DEVICE_ID_VENDOR_URL            0x03
+#define AGILE_MODBUS_DEVICE_ID_PRODUCT_NAME          0x04
+#define AGILE_MODBUS_DEVICE_ID_MODEL_NAME            0x05
+#define AGILE_MODBUS_DEVICE_ID_USER_APPLICATION_NAME 0x06
+
+#define AGILE_MODBUS_DEVICE_ID_MORE_FOLLOWS 0xFF
+
+/* Function code, MEI type, read device ID code, conformity level, more follows, next object id and number of objects */
+#define AGILE_MODBUS_DEVICE_ID_HEADER_LENGTH 7
+/* An object with its id and length must fit one response */
+#define AGILE_MODBUS_MAX_DEVICE_ID_OBJECT_LENGTH (AGILE_MODBUS_MAX_PDU_LENGTH - AGILE_MODBUS_DEVICE_ID_HEADER_LENGTH - 2)
+/**
+ * @}
+ */
+
 /**
  @verbatim
     The size of the MODBUS PDU is limited by the size constraint inherited from
@@ -163,7 +260,8 @@ enum {
  */
 typedef enum {
     AGILE_MODBUS_BACKEND_TYPE_RTU = 0, /**< RTU */
-    AGILE_MODBUS_BACKEND_TYPE_TCP      /**< TCP */
+    AGILE_MODBUS_BACKEND_TYPE_TCP,     /**< TCP */
+    AGILE_MODBUS_BACKEND_TYPE_UDP      /**< UDP */
 } agile_modbus_backend_type_t;
 
 /**
@@ -190,6 +288,39 @@ typedef struct agile_modbus_sft {
     int t_id;     /**< Transaction identifier */
 } agile_modbus_sft_t;
 
+/**
+ * @brief   File record sub-request structure (function codes 0x14 / 0x15)
+ */
+typedef struct agile_modbus_file_record {
+    uint16_t file;   /**< File number */
+    uint16_t record; /**< Starting record number */
+    uint16_t nb;     /**< Record length, number of registers */
+    uint16_t *data;  /**< Record data, `nb` registers */
+} agile_modbus_file_record_t;
+
+/**
+ * @brief   Device identification object structure (function code 0x2B / MEI type 0x0E)
+ */
+typedef struct agile_modbus_device_id_object {
+    uint8_t id;           /**< Object id */
+    uint8_t length;       /**< Object length */
+    const uint8_t *value; /**< Object value, points into the receive buffer */
+} agile_modbus_device_id_object_t;
+
+/**
+ * @brief   Diagnostics counters (function code 0x08)
+ */
+typedef struct agile_modbus_diag {
+    uint16_t bus_message;        /**< Frames received (0x0B) */
+    uint16_t bus_comm_error;     /**< Frames with a CRC error (0x0C) */
+    uint16_t exception;          /**< Exception responses (0x0D) */
+    uint16_t server_message;     /**< Frames addressed to ctx->slave or broadcast (0x0E) */
+    uint16_t server_no_response; /**< Of those, frames that got no response (0x0F) */
+    uint16_t server_nak;         /**< NEGATIVE_ACKNOWLEDGE exception responses (0x10) */
+    uint16_t server_busy;        /**< SLAVE_OR_SERVER_BUSY exception responses (0x11) */
+    uint16_t bus_char_overrun;   /**< Frames longer than the receive buffer (0x12) */
+} agile_modbus_diag_t;
+
 typedef struct agile_modbus agile_modbus_t; /**< Agile Modbus structure */
 
 /**
@@ -226,6 +357,8 @@ struct agile_modbus {
                                           int msg_length, agile_modbus_msg_type_t msg_type); /**< Customized calculation data length interface */
     const agile_modbus_backend_t *backend;                                                   /**< Backend interface */
     void *backend_data;                                                                      /**< Backend data, pointing to RTU or TCP structure */
+    agile_modbus_diag_t *diag;                                                               /**< Diagnostics counters, NULL if not used */
+    const volatile uint8_t *exception_status;                                                /**< Exception status byte (0x07), NULL if not used */
 };
 
 /**
@@ -264,6 +397,16 @@ struct agile_modbus_slave_info {
  */
 typedef int (*agile_modbus_slave_callback_t)(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const void *data);
 
+/**
+ * @brief   Device identification objects, serialized once when they are configured
+ */
+typedef struct agile_modbus_device_id {
+    uint8_t *buf;       /**< Serialized objects (object id, object length, object value) in ascending object id order */
+    int bufsz;          /**< Buffer size */
+    int length;         /**< Length of the serialized objects */
+    uint8_t conformity; /**< Conformity level */
+} agile_modbus_device_id_t;
+
 /**
  * @}
  */
@@ -283,6 +426,8 @@ void agile_modbus_set_compute_meta_length_after_function_cb(agile_modbus_t *ctx,
 void agile_modbus_set_compute_data_length_after_meta_cb(agile_modbus_t *ctx,
                                                         int (*cb)(agile_modbus_t *ctx, uint8_t *msg,
                                                                   int msg_length, agile_modbus_msg_type_t msg_type));
+void agile_modbus_set_diag(agile_modbus_t *ctx, agile_modbus_diag_t *diag);
+void agile_modbus_set_exception_status(agile_modbus_t *ctx, const volatile uint8_t *status);
 int agile_modbus_receive_judge(agile_modbus_t *ctx, int msg_length, agile_modbus_msg_type_t msg_type);
 /**
  * @}
@@ -318,8 +463,21 @@ int agile_modbus_serialize_write_and_read_registers(agile_modbus_t *ctx,
                                                     const uint16_t *src,
                                                     int read_addr, int read_nb);
 int agile_modbus_deserialize_write_and_read_registers(agile_modbus_t *ctx, int msg_length, uint16_t *dest);
+int agile_modbus_serialize_read_exception_status(agile_modbus_t *ctx);
+int agile_modbus_deserialize_read_exception_status(agile_modbus_t *ctx, int msg_length);
 int agile_modbus_serialize_report_slave_id(agile_modbus_t *ctx);
 int agile_modbus_deserialize_report_slave_id(agile_modbus_t *ctx, int msg_length, int max_dest, uint8_t *dest);
+int agile_modbus_serialize_read_file_record(agile_modbus_t *ctx, const agile_modbus_file_record_t *records, int nb_records);
+int agile_modbus_deserialize_read_file_record(agile_modbus_t *ctx, int msg_length, agile_modbus_file_record_t *records, int nb_records);
+int agile_modbus_serialize_write_file_record(agile_modbus_t *ctx, const agile_modbus_file_record_t *records, int nb_records);
+int agile_modbus_deserialize_write_file_record(agile_modbus_t *ctx, int msg_length);
+int agile_modbus_serialize_read_fifo_queue(agile_modbus_t *ctx, int addr);
+int agile_modbus_deserialize_read_fifo_queue(agile_modbus_t *ctx, int msg_length, uint16_t *dest);
+int agile_modbus_serialize_diagnostics(agile_modbus_t *ctx, int sub_function, uint16_t data);
+int agile_modbus_deserialize_diagnostics(agile_modbus_t *ctx, int msg_length, uint16_t *data);
+int agile_modbus_serialize_read_device_id(agile_modbus_t *ctx, int read_code, int object_id);
+int agile_modbus_deserialize_read_device_id(agile_modbus_t *ctx, int msg_length, int *conformity, int *next_object_id,
+                                            agile_modbus_device_id_object_t *objects, int max_objects);
 /**
  * @}
  */
@@ -329,6 +487,8 @@ int agile_modbus_deserialize_report_slave_id(agile_modbus_t *ctx, int msg_length
  */
 int agile_modbus_compute_response_length_from_request(agile_modbus_t *ctx, uint8_t *req);
 int agile_modbus_serialize_raw_request(agile_modbus_t *ctx, const uint8_t *raw_req, int raw_req_length);
+uint8_t *agile_modbus_raw_request_data(agile_modbus_t *ctx, int slave, int function, int *max_length);
+int agile_modbus_serialize_raw_request_in_place(agile_modbus_t *ctx, int data_length);
 int agile_modbus_deserialize_raw_response(agile_modbus_t *ctx, int msg_length);
 /**
  * @}
@@ -351,6 +511,9 @@ void agile_modbus_slave_io_set(uint8_t *buf, int index, int status);
 uint8_t agile_modbus_slave_io_get(uint8_t *buf, int index);
 void agile_modbus_slave_register_set(uint8_t *buf, int index, uint16_t data);
 uint16_t agile_modbus_slave_register_get(uint8_t *buf, int index);
+void agile_modbus_device_id_init(agile_modbus_device_id_t *dev_id, uint8_t *buf, int bufsz);
+int agile_modbus_device_id_add(agile_modbus_device_id_t *dev_id, int id, const void *value, int len);
+int agile_modbus_slave_device_id_handle(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_device_id_t *dev_id);
 /**
  * @}
  */
@@ -66,6 +66,7 @@ typedef struct agile_modbus_rtu {
  * @{
  */
 int agile_modbus_rtu_init(agile_modbus_rtu_t *ctx, uint8_t *send_buf, int send_bufsz, uint8_t *read_buf, int read_bufsz);
+uint16_t agile_modbus_rtu_crc16(const uint8_t *buffer, uint16_t buffer_length);
 /**
  * @}
  */
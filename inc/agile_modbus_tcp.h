@@ -62,6 +62,11 @@ typedef struct agile_modbus_tcp {
                          with the request. This identifier is unique on each TCP connection. */
 } agile_modbus_tcp_t;
 
+/**
+ * @brief   UDP structure, MBAP framing with one ADU per datagram
+ */
+typedef agile_modbus_tcp_t agile_modbus_udp_t;
+
 /**
  * @}
  */
@@ -70,6 +75,7 @@ typedef struct agile_modbus_tcp {
  * @{
  */
 int agile_modbus_tcp_init(agile_modbus_tcp_t *ctx, uint8_t *send_buf, int send_bufsz, uint8_t *read_buf, int read_bufsz);
+int agile_modbus_udp_init(agile_modbus_udp_t *ctx, uint8_t *send_buf, int send_bufsz, uint8_t *read_buf, int read_bufsz);
 /**
  * @}
  */
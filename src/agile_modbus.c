@@ -99,8 +99,21 @@ static uint8_t agile_modbus_compute_meta_length_after_function(agile_modbus_t *c
             length = 6;
         } else if (function == AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS) {
             length = 9;
+        } else if (function == AGILE_MODBUS_FC_READ_FILE_RECORD ||
+                   function == AGILE_MODBUS_FC_WRITE_FILE_RECORD) {
+            length = 1;
+        } else if (function == AGILE_MODBUS_FC_READ_FIFO_QUEUE) {
+            length = 2;
+        } else if (function == AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE) {
+            /* MEI type */
+            length = 1;
+        } else if (function == AGILE_MODBUS_FC_DIAGNOSTICS) {
+            /* Sub-function */
+            length = 2;
+        } else if (function == AGILE_MODBUS_FC_READ_EXCEPTION_STATUS) {
+            length = 0;
         } else {
-            /* MODBUS_FC_READ_EXCEPTION_STATUS, MODBUS_FC_REPORT_SLAVE_ID */
+            /* MODBUS_FC_REPORT_SLAVE_ID */
             length = 0;
             if (ctx->compute_meta_length_after_function)
                 length = ctx->compute_meta_length_after_function(ctx, function, msg_type);
@@ -113,6 +126,8 @@ static uint8_t agile_modbus_compute_meta_length_after_function(agile_modbus_t *c
         case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
         case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
         case AGILE_MODBUS_FC_REPORT_SLAVE_ID:
+        case AGILE_MODBUS_FC_READ_FILE_RECORD:
+        case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
         case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
             length = 1;
             break;
@@ -128,6 +143,25 @@ static uint8_t agile_modbus_compute_meta_length_after_function(agile_modbus_t *c
             length = 6;
             break;
 
+        case AGILE_MODBUS_FC_READ_FIFO_QUEUE:
+            length = 2;
+            break;
+
+        case AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE:
+            /* MEI type */
+            length = 1;
+            break;
+
+        case AGILE_MODBUS_FC_DIAGNOSTICS:
+            /* Sub-function */
+            length = 2;
+            break;
+
+        case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
+            /* Exception status */
+            length = 1;
+            break;
+
         default:
             length = 1;
             if (ctx->compute_meta_length_after_function)
@@ -138,6 +172,58 @@ static uint8_t agile_modbus_compute_meta_length_after_function(agile_modbus_t *c
     return length;
 }
 
+/**
+ * @brief   The length of a diagnostics request or response after the sub-function
+ * @note    Return query data echoes any number of bytes, they are the rest of the message.
+ * @param   ctx modbus handle
+ * @param   msg message pointer
+ * @param   msg_length message length
+ * @return  data length
+ */
+static int agile_modbus_compute_diag_length(agile_modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    int offset = ctx->backend->header_length;
+    int sub_function = (msg[offset + 1] << 8) + msg[offset + 2];
+
+    if (sub_function != AGILE_MODBUS_DIAG_RETURN_QUERY_DATA)
+        return 2;
+
+    int length = msg_length - (offset + 3) - ctx->backend->checksum_length;
+    if (length < 0)
+        length = 0;
+
+    return length;
+}
+
+/**
+ * @brief   The length of a read device identification response after the MEI type
+ * @note    The response has no byte count, the objects are walked as far as they are received.
+ *          A truncated response gives a length beyond `msg_length`.
+ * @param   ctx modbus handle
+ * @param   msg message pointer
+ * @param   msg_length message length
+ * @return  data length
+ */
+static int agile_modbus_compute_device_id_length(agile_modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    /* Read device ID code, conformity level, more follows, next object id, number of objects */
+    int start = ctx->backend->header_length + 2;
+    int pos = start + 5;
+
+    if (msg_length < pos)
+        return pos - start;
+
+    int nb_objects = msg[pos - 1];
+    for (int i = 0; i < nb_objects; i++) {
+        if (msg_length < pos + 2)
+            return pos + 2 - start;
+
+        pos += 2 + msg[pos + 1];
+    }
+
+    return pos - start;
+}
+
 /**
  * @brief The length of data to be received after calculating the data element
  @verbatim
@@ -190,6 +276,32 @@ static int agile_modbus_compute_data_length_after_meta(agile_modbus_t *ctx, uint
             length = msg[ctx->backend->header_length + 9];
             break;
 
+        case AGILE_MODBUS_FC_READ_FILE_RECORD:
+        case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+            length = msg[ctx->backend->header_length + 1];
+            break;
+
+        case AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE:
+            if (msg[ctx->backend->header_length + 1] == AGILE_MODBUS_MEI_READ_DEVICE_ID) {
+                /* Read device ID code and object id */
+                length = 2;
+                break;
+            }
+
+            /* Other MEI types are custom */
+            length = 0;
+            if (ctx->compute_data_length_after_meta)
+                length = ctx->compute_data_length_after_meta(ctx, msg, msg_length, msg_type);
+            break;
+
+        case AGILE_MODBUS_FC_DIAGNOSTICS:
+            length = agile_modbus_compute_diag_length(ctx, msg, msg_length);
+            break;
+
+        case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
+            length = 0;
+            break;
+
         default:
             length = 0;
             if (ctx->compute_data_length_after_meta)
@@ -199,8 +311,20 @@ static int agile_modbus_compute_data_length_after_meta(agile_modbus_t *ctx, uint
         /* MSG_CONFIRMATION */
         if (function <= AGILE_MODBUS_FC_READ_INPUT_REGISTERS ||
             function == AGILE_MODBUS_FC_REPORT_SLAVE_ID ||
+            function == AGILE_MODBUS_FC_READ_FILE_RECORD ||
+            function == AGILE_MODBUS_FC_WRITE_FILE_RECORD ||
             function == AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS) {
             length = msg[ctx->backend->header_length + 1];
+        } else if (function == AGILE_MODBUS_FC_READ_FIFO_QUEUE) {
+            /* Two bytes byte count */
+            length = (msg[ctx->backend->header_length + 1] << 8) + msg[ctx->backend->header_length + 2];
+        } else if (function == AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE &&
+                   msg[ctx->backend->header_length + 1] == AGILE_MODBUS_MEI_READ_DEVICE_ID) {
+            length = agile_modbus_compute_device_id_length(ctx, msg, msg_length);
+        } else if (function == AGILE_MODBUS_FC_DIAGNOSTICS) {
+            length = agile_modbus_compute_diag_length(ctx, msg, msg_length);
+        } else if (function == AGILE_MODBUS_FC_READ_EXCEPTION_STATUS) {
+            length = 0;
         } else {
             length = 0;
             if (ctx->compute_data_length_after_meta)
@@ -301,6 +425,34 @@ void agile_modbus_set_compute_data_length_after_meta_cb(agile_modbus_t *ctx,
     ctx->compute_data_length_after_meta = cb;
 }
 
+/**
+ * @brief   sets the diagnostics counters of the modbus object
+ * @note    The counters are updated by `agile_modbus_slave_handle` and the RTU CRC check. With counters set,
+ *          `agile_modbus_slave_handle` answers function code 0x08 to the slave address of the context itself, without
+ *          the slave callback; other units are left to the callback and a broadcast is not answered.
+ *          Contexts sharing counters must be used from one thread.
+ * @param   ctx modbus handle
+ * @param   diag diagnostics counters, NULL to stop counting
+ */
+void agile_modbus_set_diag(agile_modbus_t *ctx, agile_modbus_diag_t *diag)
+{
+    ctx->diag = diag;
+}
+
+/**
+ * @brief   sets the exception status byte of the modbus object
+ * @note    `agile_modbus_slave_handle` answers function code 0x07 to the slave address of the context with the byte as
+ *          it is at that moment, without the slave callback; other units are left to the callback and a broadcast is
+ *          not answered. Producers update it with a single byte store, never a read-modify-write in place, so that
+ *          the byte is always consistent whichever thread writes it.
+ * @param   ctx modbus handle
+ * @param   status exception status byte, NULL to pass 0x07 to the slave callback
+ */
+void agile_modbus_set_exception_status(agile_modbus_t *ctx, const volatile uint8_t *status)
+{
+    ctx->exception_status = status;
+}
+
 /**
  * @brief   Verify the correctness of received data
  * @note    This API returns the modbus data frame length, for example, 8 bytes of modbus data frame + 2 bytes of dirty data, returns 8
@@ -405,6 +557,30 @@ static int agile_modbus_check_confirmation(agile_modbus_t *ctx, uint8_t *req,
             req_nb_value = rsp_nb_value = rsp[offset + 1];
             break;
 
+        case AGILE_MODBUS_FC_READ_FILE_RECORD:
+            /* Response data length of the sub-responses asked for */
+            req_nb_value = rsp_length_computed - offset - 2 - ctx->backend->checksum_length;
+            rsp_nb_value = rsp[offset + 1];
+            break;
+
+        case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+            /* Echo of the request data length */
+            req_nb_value = req[offset + 1];
+            rsp_nb_value = rsp[offset + 1];
+            break;
+
+        case AGILE_MODBUS_FC_READ_FIFO_QUEUE:
+            /* Byte count covers the FIFO count and the values */
+            req_nb_value = (rsp[offset + 1] << 8) + rsp[offset + 2];
+            rsp_nb_value = 2 + 2 * ((rsp[offset + 3] << 8) + rsp[offset + 4]);
+            break;
+
+        case AGILE_MODBUS_FC_DIAGNOSTICS:
+            /* Echo of the sub-function */
+            req_nb_value = (req[offset + 1] << 8) + req[offset + 2];
+            rsp_nb_value = (rsp[offset + 1] << 8) + rsp[offset + 2];
+            break;
+
         default:
             /* 1 Write functions & others */
             req_nb_value = rsp_nb_value = 1;
@@ -918,6 +1094,41 @@ int agile_modbus_deserialize_write_and_read_registers(agile_modbus_t *ctx, int m
     return rc;
 }
 
+int agile_modbus_serialize_read_exception_status(agile_modbus_t *ctx)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    int req_length = 0;
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_READ_EXCEPTION_STATUS, 0, 0, ctx->send_buf);
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
+}
+
+int agile_modbus_deserialize_read_exception_status(agile_modbus_t *ctx, int msg_length)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
+
+    int rc = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (rc < 0)
+        return -1;
+
+    rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+    if (rc < 0)
+        return rc;
+
+    /* The exception status byte */
+    return ctx->read_buf[ctx->backend->header_length + 1];
+}
+
 int agile_modbus_serialize_report_slave_id(agile_modbus_t *ctx)
 {
     int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
@@ -965,97 +1176,142 @@ int agile_modbus_deserialize_report_slave_id(agile_modbus_t *ctx, int msg_length
     return rc;
 }
 
-/**
- * @}
- */
+int agile_modbus_serialize_read_file_record(agile_modbus_t *ctx, const agile_modbus_file_record_t *records, int nb_records)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
 
-/** @defgroup Master_Raw_Operation_Functions Master Raw Operation Functions
- * @{
- */
+    if (nb_records < 1 || nb_records > AGILE_MODBUS_MAX_READ_FILE_RECORDS)
+        return -1;
 
-/**
- * @brief   Calculate the expected response data length
- * @note    If it is a special function code, AGILE_MODBUS_MSG_LENGTH_UNDEFINED is returned, but this does not mean an exception.
- *          When agile_modbus_check_confirmation calls this API processing, it is considered that the return value of AGILE_MODBUS_MSG_LENGTH_UNDEFINED is also valid.
- * @param   ctx modbus handle
- * @param   req request data pointer
- * @return  expected response data length
- */
-int agile_modbus_compute_response_length_from_request(agile_modbus_t *ctx, uint8_t *req)
-{
-    int length;
-    const int offset = ctx->backend->header_length;
+    int i;
+    int req_length;
+    int rsp_data_length = 0;
 
-    switch (req[offset]) {
-    case AGILE_MODBUS_FC_READ_COILS:
-    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS: {
-        /* Header + nb values (code from write_bits) */
-        int nb = (req[offset + 3] << 8) | req[offset + 4];
-        length = 2 + (nb / 8) + ((nb % 8) ? 1 : 0);
-    } break;
+    for (i = 0; i < nb_records; i++) {
+        if (records[i].nb < 1 || records[i].record + records[i].nb - 1 > AGILE_MODBUS_MAX_FILE_RECORD_NUMBER)
+            return -1;
 
-    case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
-    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
-    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
-        /* Header + 2 * nb values */
-        length = 2 + 2 * (req[offset + 3] << 8 | req[offset + 4]);
-        break;
+        rsp_data_length += 2 + records[i].nb * 2;
+    }
 
-    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
-    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
-    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
-    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-        length = 5;
-        break;
+    /* The sub-responses must fit one response PDU as well */
+    if (2 + rsp_data_length > AGILE_MODBUS_MAX_PDU_LENGTH)
+        return -1;
 
-    case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
-        length = 7;
-        break;
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_READ_FILE_RECORD, 0, 0, ctx->send_buf);
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
 
-    default:
-        /* The response is device specific (the header provides the
-            length) */
-        return AGILE_MODBUS_MSG_LENGTH_UNDEFINED;
+    min_req_length = req_length + 1 + nb_records * AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    ctx->send_buf[req_length++] = nb_records * AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH;
+    for (i = 0; i < nb_records; i++) {
+        ctx->send_buf[req_length++] = AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE;
+        ctx->send_buf[req_length++] = records[i].file >> 8;
+        ctx->send_buf[req_length++] = records[i].file & 0x00ff;
+        ctx->send_buf[req_length++] = records[i].record >> 8;
+        ctx->send_buf[req_length++] = records[i].record & 0x00ff;
+        ctx->send_buf[req_length++] = records[i].nb >> 8;
+        ctx->send_buf[req_length++] = records[i].nb & 0x00ff;
     }
 
-    return offset + length + ctx->backend->checksum_length;
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
 }
 
-/**
- * @brief   Pack the original data into a request message
- * @param   ctx modbus handle
- * @param   raw_req original message (PDU + Slave address)
- * @param   raw_req_length original message length
- * @return  >0: Request data length; Others: Exception
- */
-int agile_modbus_serialize_raw_request(agile_modbus_t *ctx, const uint8_t *raw_req, int raw_req_length)
+int agile_modbus_deserialize_read_file_record(agile_modbus_t *ctx, int msg_length, agile_modbus_file_record_t *records, int nb_records)
 {
-    if (raw_req_length < 2) {
-        /* The raw request must contain function and slave at least and
-           must not be longer than the maximum pdu length plus the slave
-           address. */
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
 
+    int rc = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (rc < 0)
         return -1;
+
+    rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+    if (rc < 0)
+        return rc;
+
+    int i, j;
+    int offset;
+    int nb_subs;
+    const uint8_t *sub;
+
+    offset = ctx->backend->header_length + 2;
+    sub = ctx->send_buf + offset;
+    nb_subs = ctx->send_buf[ctx->backend->header_length + 1] / AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH;
+
+    /* The total length was checked against the request, check each sub-response and
+       copy the records. Truncate copy to nb_records. */
+    for (i = 0; i < nb_subs; i++, sub += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH) {
+        int nb = (sub[5] << 8) | sub[6];
+
+        if (ctx->read_buf[offset] != 1 + nb * 2 || ctx->read_buf[offset + 1] != AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE)
+            return -1;
+
+        offset += 2;
+        if (i < nb_records) {
+            for (j = 0; j < nb; j++)
+                records[i].data[j] = (ctx->read_buf[offset + (j << 1)] << 8) | ctx->read_buf[offset + 1 + (j << 1)];
+        }
+        offset += nb * 2;
     }
 
-    int min_req_length = ctx->backend->header_length + 1 + ctx->backend->checksum_length + raw_req_length - 2;
+    return nb_subs;
+}
+
+int agile_modbus_serialize_write_file_record(agile_modbus_t *ctx, const agile_modbus_file_record_t *records, int nb_records)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
     if (ctx->send_bufsz < min_req_length)
         return -1;
 
-    agile_modbus_sft_t sft;
+    if (nb_records < 1)
+        return -1;
+
+    int i, j;
     int req_length;
+    int data_length = 0;
 
-    sft.slave = raw_req[0];
-    sft.function = raw_req[1];
-    /* The t_id is left to zero */
-    sft.t_id = 0;
-    /* This response function only set the header so it's convenient here */
-    req_length = ctx->backend->build_response_basis(&sft, ctx->send_buf);
+    for (i = 0; i < nb_records; i++) {
+        if (records[i].nb < 1 || records[i].record + records[i].nb - 1 > AGILE_MODBUS_MAX_FILE_RECORD_NUMBER)
+            return -1;
 
-    if (raw_req_length > 2) {
-        /* Copy data after function code */
-        memcpy(ctx->send_buf + req_length, raw_req + 2, raw_req_length - 2);
-        req_length += raw_req_length - 2;
+        data_length += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH + records[i].nb * 2;
+    }
+
+    if (2 + data_length > AGILE_MODBUS_MAX_PDU_LENGTH)
+        return -1;
+
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_WRITE_FILE_RECORD, 0, 0, ctx->send_buf);
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+
+    min_req_length = req_length + 1 + data_length + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    ctx->send_buf[req_length++] = data_length;
+    for (i = 0; i < nb_records; i++) {
+        ctx->send_buf[req_length++] = AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE;
+        ctx->send_buf[req_length++] = records[i].file >> 8;
+        ctx->send_buf[req_length++] = records[i].file & 0x00ff;
+        ctx->send_buf[req_length++] = records[i].record >> 8;
+        ctx->send_buf[req_length++] = records[i].record & 0x00ff;
+        ctx->send_buf[req_length++] = records[i].nb >> 8;
+        ctx->send_buf[req_length++] = records[i].nb & 0x00ff;
+        for (j = 0; j < records[i].nb; j++) {
+            ctx->send_buf[req_length++] = records[i].data[j] >> 8;
+            ctx->send_buf[req_length++] = records[i].data[j] & 0x00FF;
+        }
     }
 
     req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
@@ -1063,14 +1319,7 @@ int agile_modbus_serialize_raw_request(agile_modbus_t *ctx, const uint8_t *raw_r
     return req_length;
 }
 
-/**
- * @brief    parses the original response data
- * @param   ctx modbus handle
- * @param   msg_length received data length
- * @return  >=0: The length of the corresponding function code response object (such as 03 function code, the value represents the number of registers);
- *          Others: exception (-1: message error; others: exception code can be obtained according to `-128 -$return value`)
- */
-int agile_modbus_deserialize_raw_response(agile_modbus_t *ctx, int msg_length)
+int agile_modbus_deserialize_write_file_record(agile_modbus_t *ctx, int msg_length)
 {
     int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
     if (ctx->send_bufsz < min_req_length)
@@ -1083,17 +1332,369 @@ int agile_modbus_deserialize_raw_response(agile_modbus_t *ctx, int msg_length)
         return -1;
 
     rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+    if (rc < 0)
+        return rc;
+
+    /* The response is an echo of the request */
+    int offset = ctx->backend->header_length + 2;
+    if (memcmp(ctx->read_buf + offset, ctx->send_buf + offset, rc) != 0)
+        return -1;
 
     return rc;
 }
 
-/**
- * @}
- */
-
-/**
- * @}
- */
+int agile_modbus_serialize_read_fifo_queue(agile_modbus_t *ctx, int addr)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    int req_length = 0;
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_READ_FIFO_QUEUE, addr, 0, ctx->send_buf);
+    /* HACKISH, count is not used */
+    req_length -= 2;
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
+}
+
+int agile_modbus_deserialize_read_fifo_queue(agile_modbus_t *ctx, int msg_length, uint16_t *dest)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
+
+    int rc = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (rc < 0)
+        return -1;
+
+    rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+    if (rc < 0)
+        return rc;
+
+    int offset;
+    int i;
+    int nb = (rc - 2) / 2;
+
+    if (nb > AGILE_MODBUS_MAX_FIFO_COUNT)
+        return -1;
+
+    /* Skip byte count and FIFO count */
+    offset = ctx->backend->header_length + 5;
+    for (i = 0; i < nb; i++) {
+        /* shift reg hi_byte to temp OR with lo_byte */
+        dest[i] = (ctx->read_buf[offset + (i << 1)] << 8) | ctx->read_buf[offset + 1 + (i << 1)];
+    }
+
+    return nb;
+}
+
+int agile_modbus_serialize_diagnostics(agile_modbus_t *ctx, int sub_function, uint16_t data)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    int req_length = 0;
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_DIAGNOSTICS, sub_function, data, ctx->send_buf);
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
+}
+
+int agile_modbus_deserialize_diagnostics(agile_modbus_t *ctx, int msg_length, uint16_t *data)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
+
+    int frame_length = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (frame_length < 0)
+        return -1;
+
+    int rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, frame_length);
+    if (rc < 0)
+        return rc;
+
+    int offset = ctx->backend->header_length;
+
+    /* Sub-function and one data word, a counter or the echoed query data */
+    if (frame_length < (int)(offset + 5 + ctx->backend->checksum_length))
+        return -1;
+
+    *data = (ctx->read_buf[offset + 3] << 8) + ctx->read_buf[offset + 4];
+
+    return 0;
+}
+
+int agile_modbus_serialize_read_device_id(agile_modbus_t *ctx, int read_code, int object_id)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    if (read_code < AGILE_MODBUS_READ_DEVICE_ID_BASIC || read_code > AGILE_MODBUS_READ_DEVICE_ID_SPECIFIC)
+        return -1;
+
+    int req_length = 0;
+    req_length = ctx->backend->build_request_basis(ctx, AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE, 0, 0, ctx->send_buf);
+    /* HACKISH, addr and count are not used */
+    req_length -= 4;
+
+    ctx->send_buf[req_length++] = AGILE_MODBUS_MEI_READ_DEVICE_ID;
+    ctx->send_buf[req_length++] = read_code;
+    ctx->send_buf[req_length++] = object_id;
+
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
+}
+
+int agile_modbus_deserialize_read_device_id(agile_modbus_t *ctx, int msg_length, int *conformity, int *next_object_id,
+                                            agile_modbus_device_id_object_t *objects, int max_objects)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
+
+    int rc = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (rc < 0)
+        return -1;
+
+    rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+    if (rc < 0)
+        return rc;
+
+    int i;
+    int offset = ctx->backend->header_length + 1;
+    const uint8_t *rsp = ctx->read_buf;
+
+    /* MEI type and read device ID code are echoed */
+    if (rsp[offset] != AGILE_MODBUS_MEI_READ_DEVICE_ID || rsp[offset + 1] != ctx->send_buf[offset + 1])
+        return -1;
+
+    if (conformity)
+        *conformity = rsp[offset + 2];
+    if (next_object_id)
+        *next_object_id = (rsp[offset + 3] == AGILE_MODBUS_DEVICE_ID_MORE_FOLLOWS) ? rsp[offset + 4] : 0;
+
+    int nb_objects = rsp[offset + 5];
+    int pos = offset + 6;
+
+    for (i = 0; i < nb_objects; i++) {
+        if (i < max_objects) {
+            objects[i].id = rsp[pos];
+            objects[i].length = rsp[pos + 1];
+            objects[i].value = &rsp[pos + 2];
+        }
+        pos += 2 + rsp[pos + 1];
+    }
+
+    return nb_objects;
+}
+
+/**
+ * @}
+ */
+
+/** @defgroup Master_Raw_Operation_Functions Master Raw Operation Functions
+ * @{
+ */
+
+/**
+ * @brief   Calculate the expected response data length
+ * @note    If it is a special function code, AGILE_MODBUS_MSG_LENGTH_UNDEFINED is returned, but this does not mean an exception.
+ *          When agile_modbus_check_confirmation calls this API processing, it is considered that the return value of AGILE_MODBUS_MSG_LENGTH_UNDEFINED is also valid.
+ * @param   ctx modbus handle
+ * @param   req request data pointer
+ * @return  expected response data length
+ */
+int agile_modbus_compute_response_length_from_request(agile_modbus_t *ctx, uint8_t *req)
+{
+    int length;
+    const int offset = ctx->backend->header_length;
+
+    switch (req[offset]) {
+    case AGILE_MODBUS_FC_READ_COILS:
+    case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS: {
+        /* Header + nb values (code from write_bits) */
+        int nb = (req[offset + 3] << 8) | req[offset + 4];
+        length = 2 + (nb / 8) + ((nb % 8) ? 1 : 0);
+    } break;
+
+    case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
+    case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
+    case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
+        /* Header + 2 * nb values */
+        length = 2 + 2 * (req[offset + 3] << 8 | req[offset + 4]);
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        length = 5;
+        break;
+
+    case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
+        length = 7;
+        break;
+
+    case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
+        /* Function + exception status */
+        length = 2;
+        break;
+
+    case AGILE_MODBUS_FC_READ_FILE_RECORD: {
+        /* Header + per sub-request: file response length, reference type and 2 * record length */
+        int byte_count = req[offset + 1];
+        length = 2;
+        for (int i = 0; i + AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH <= byte_count; i += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH) {
+            const uint8_t *sub = req + offset + 2 + i;
+            length += 2 + 2 * ((sub[5] << 8) | sub[6]);
+        }
+    } break;
+
+    case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+        /* Echo of the request */
+        length = 2 + req[offset + 1];
+        break;
+
+    default:
+        /* The response is device specific (the header provides the
+            length) */
+        return AGILE_MODBUS_MSG_LENGTH_UNDEFINED;
+    }
+
+    return offset + length + ctx->backend->checksum_length;
+}
+
+/**
+ * @brief   Pack the original data into a request message
+ * @param   ctx modbus handle
+ * @param   raw_req original message (PDU + Slave address)
+ * @param   raw_req_length original message length
+ * @return  >0: Request data length; Others: Exception
+ */
+int agile_modbus_serialize_raw_request(agile_modbus_t *ctx, const uint8_t *raw_req, int raw_req_length)
+{
+    if (raw_req_length < 2) {
+        /* The raw request must contain function and slave at least and
+           must not be longer than the maximum pdu length plus the slave
+           address. */
+
+        return -1;
+    }
+
+    int min_req_length = ctx->backend->header_length + 1 + ctx->backend->checksum_length + raw_req_length - 2;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+
+    agile_modbus_sft_t sft;
+    int req_length;
+
+    sft.slave = raw_req[0];
+    sft.function = raw_req[1];
+    /* The t_id is left to zero */
+    sft.t_id = 0;
+    /* This response function only set the header so it's convenient here */
+    req_length = ctx->backend->build_response_basis(&sft, ctx->send_buf);
+
+    if (raw_req_length > 2) {
+        /* Copy data after function code */
+        memcpy(ctx->send_buf + req_length, raw_req + 2, raw_req_length - 2);
+        req_length += raw_req_length - 2;
+    }
+
+    req_length = ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+
+    return req_length;
+}
+
+/**
+ * @brief   Start a raw request directly in the send buffer
+ * @note    The header and function code are written, the data after the function code is filled in by the caller
+ *          and the request finished by `agile_modbus_serialize_raw_request_in_place`, so that it is not copied
+ * @param   ctx modbus handle
+ * @param   slave slave address
+ * @param   function function code
+ * @param   max_length the maximum data length that fits the send buffer, may be NULL
+ * @return  !=NULL: where the data goes; NULL: the send buffer is too small
+ */
+uint8_t *agile_modbus_raw_request_data(agile_modbus_t *ctx, int slave, int function, int *max_length)
+{
+    int header_length = ctx->backend->header_length + 1;
+    if (ctx->send_bufsz < (int)(header_length + ctx->backend->checksum_length))
+        return NULL;
+
+    agile_modbus_sft_t sft;
+
+    sft.slave = slave;
+    sft.function = function;
+    /* The t_id is left to zero */
+    sft.t_id = 0;
+    ctx->backend->build_response_basis(&sft, ctx->send_buf);
+
+    if (max_length)
+        *max_length = ctx->send_bufsz - header_length - ctx->backend->checksum_length;
+
+    return ctx->send_buf + header_length;
+}
+
+/**
+ * @brief   Finish the raw request started by `agile_modbus_raw_request_data`
+ * @note    The length of the MBAP header or the CRC is set in place
+ * @param   ctx modbus handle
+ * @param   data_length length of the data written after the function code
+ * @return  >0: Request data length; Others: Exception
+ */
+int agile_modbus_serialize_raw_request_in_place(agile_modbus_t *ctx, int data_length)
+{
+    int req_length = ctx->backend->header_length + 1 + data_length;
+
+    if (data_length < 0 || ctx->send_bufsz < (int)(req_length + ctx->backend->checksum_length))
+        return -1;
+
+    return ctx->backend->send_msg_pre(ctx->send_buf, req_length);
+}
+
+/**
+ * @brief    parses the original response data
+ * @param   ctx modbus handle
+ * @param   msg_length received data length
+ * @return  >=0: The length of the corresponding function code response object (such as 03 function code, the value represents the number of registers);
+ *          Others: exception (-1: message error; others: exception code can be obtained according to `-128 -$return value`)
+ */
+int agile_modbus_deserialize_raw_response(agile_modbus_t *ctx, int msg_length)
+{
+    int min_req_length = ctx->backend->header_length + 5 + ctx->backend->checksum_length;
+    if (ctx->send_bufsz < min_req_length)
+        return -1;
+    if ((msg_length <= 0) || (msg_length > ctx->read_bufsz))
+        return -1;
+
+    int rc = agile_modbus_receive_msg_judge(ctx, ctx->read_buf, msg_length, AGILE_MODBUS_MSG_CONFIRMATION);
+    if (rc < 0)
+        return -1;
+
+    rc = agile_modbus_check_confirmation(ctx, ctx->send_buf, ctx->read_buf, rc);
+
+    return rc;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
 
 /** @defgroup Modbus_Slave Modbus Slave
  * @{
@@ -1114,6 +1715,14 @@ static int agile_modbus_serialize_response_exception(agile_modbus_t *ctx, agile_
 {
     int rsp_length;
 
+    if (ctx->diag) {
+        ctx->diag->exception++;
+        if (exception_code == AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE)
+            ctx->diag->server_nak++;
+        else if (exception_code == AGILE_MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY)
+            ctx->diag->server_busy++;
+    }
+
     /* Build exception response */
     sft->function = sft->function + 0x80;
     rsp_length = ctx->backend->build_response_basis(sft, ctx->send_buf);
@@ -1122,6 +1731,161 @@ static int agile_modbus_serialize_response_exception(agile_modbus_t *ctx, agile_
     return rsp_length;
 }
 
+/**
+ * @brief   Complete a read FIFO queue response
+ * @note    The callback stores the FIFO count at `send_index` and the values after it, the byte count follows from the FIFO count.
+ * @param   ctx modbus handle
+ * @param   sft modbus information header
+ * @param   fifo_index index of the FIFO count in the send buffer
+ * @return  response data length
+ */
+static int agile_modbus_complete_fifo_response(agile_modbus_t *ctx, agile_modbus_sft_t *sft, int fifo_index)
+{
+    int count = agile_modbus_slave_register_get(ctx->send_buf + fifo_index, 0);
+    if (count > AGILE_MODBUS_MAX_FIFO_COUNT)
+        return agile_modbus_serialize_response_exception(ctx, sft, AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    if (ctx->send_bufsz < (int)(fifo_index + 2 + count * 2 + ctx->backend->checksum_length))
+        return agile_modbus_serialize_response_exception(ctx, sft, AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE);
+
+    agile_modbus_slave_register_set(ctx->send_buf + fifo_index - 2, 0, 2 + count * 2);
+
+    return fifo_index + 2 + count * 2;
+}
+
+/**
+ * @brief   Answer a diagnostics request from the diagnostics counters
+ * @param   ctx modbus handle
+ * @param   sft modbus information header
+ * @param   data sub-function and data of the request
+ * @param   length length of `data`
+ * @param   rsp_length stores the response length
+ * @return  0: success; others: exception code
+ */
+static int agile_modbus_diag_response(agile_modbus_t *ctx, agile_modbus_sft_t *sft, const uint8_t *data, int length, int *rsp_length)
+{
+    agile_modbus_diag_t *diag = ctx->diag;
+    int sub_function = (data[0] << 8) + data[1];
+    uint16_t *counter = NULL;
+
+    /* The data of every sub-function but return query data is 0x0000 */
+    if (sub_function != AGILE_MODBUS_DIAG_RETURN_QUERY_DATA && (data[2] || data[3]))
+        return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    switch (sub_function) {
+    case AGILE_MODBUS_DIAG_RETURN_QUERY_DATA:
+        break;
+
+    case AGILE_MODBUS_DIAG_CLEAR_COUNTERS:
+        memset(diag, 0, sizeof(agile_modbus_diag_t));
+        break;
+
+    case AGILE_MODBUS_DIAG_BUS_MESSAGE_COUNT:
+        counter = &diag->bus_message;
+        break;
+
+    case AGILE_MODBUS_DIAG_BUS_COMM_ERROR_COUNT:
+        counter = &diag->bus_comm_error;
+        break;
+
+    case AGILE_MODBUS_DIAG_BUS_EXCEPTION_ERROR_COUNT:
+        counter = &diag->exception;
+        break;
+
+    case AGILE_MODBUS_DIAG_SERVER_MESSAGE_COUNT:
+        counter = &diag->server_message;
+        break;
+
+    case AGILE_MODBUS_DIAG_SERVER_NO_RESPONSE_COUNT:
+        counter = &diag->server_no_response;
+        break;
+
+    case AGILE_MODBUS_DIAG_SERVER_NAK_COUNT:
+        counter = &diag->server_nak;
+        break;
+
+    case AGILE_MODBUS_DIAG_SERVER_BUSY_COUNT:
+        counter = &diag->server_busy;
+        break;
+
+    case AGILE_MODBUS_DIAG_BUS_CHAR_OVERRUN_COUNT:
+        counter = &diag->bus_char_overrun;
+        break;
+
+    case AGILE_MODBUS_DIAG_CLEAR_OVERRUN_COUNTER:
+        diag->bus_char_overrun = 0;
+        break;
+
+    default:
+        return AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    int index = ctx->backend->build_response_basis(sft, ctx->send_buf);
+    if (ctx->send_bufsz < (int)(index + length + ctx->backend->checksum_length))
+        return AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+
+    /* Echo of the request, the counter in place of the data */
+    memcpy(ctx->send_buf + index, data, length);
+    if (counter)
+        agile_modbus_slave_register_set(ctx->send_buf + index + 2, 0, *counter);
+
+    *rsp_length = index + length;
+
+    return 0;
+}
+
+/**
+ * @brief   Check the sub-requests of a file record request
+ * @param   data first sub-request
+ * @param   length byte count / request data length
+ * @param   with_data 0: read sub-requests (0x14); 1: write sub-requests followed by their record data (0x15)
+ * @param   nb_records stores the number of sub-requests
+ * @param   rsp_data_length stores the response data length of a read
+ * @return  0: valid; others: exception code
+ */
+static int agile_modbus_check_file_record_request(const uint8_t *data, int length, int with_data, int *nb_records, int *rsp_data_length)
+{
+    int pos = 0;
+
+    *nb_records = 0;
+    *rsp_data_length = 0;
+
+    if (with_data) {
+        if (length < 9 || length > 0xFB)
+            return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    } else {
+        if (length < 7 || length > 0xF5 || (length % AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH))
+            return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    while (pos < length) {
+        const uint8_t *sub = data + pos;
+        if (length - pos < AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH)
+            return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+        int record = (sub[3] << 8) + sub[4];
+        int nb = (sub[5] << 8) + sub[6];
+        if (sub[0] != AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE || nb < 1 ||
+            record + nb - 1 > AGILE_MODBUS_MAX_FILE_RECORD_NUMBER)
+            return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+        pos += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH;
+        if (with_data) {
+            pos += nb * 2;
+            if (pos > length)
+                return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        }
+
+        (*nb_records)++;
+        *rsp_data_length += 2 + nb * 2;
+    }
+
+    /* Function code + response data length + sub-responses */
+    if (!with_data && 2 + *rsp_data_length > AGILE_MODBUS_MAX_PDU_LENGTH)
+        return AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    return 0;
+}
+
 /**
  * @}
  */
@@ -1188,6 +1952,170 @@ uint16_t agile_modbus_slave_register_get(uint8_t *buf, int index)
     return data;
 }
 
+/**
+ * @brief   Initialize device identification objects
+ * @param   dev_id device identification objects
+ * @param   buf buffer holding the serialized objects, 2 bytes per object plus the values
+ * @param   bufsz buffer size
+ */
+void agile_modbus_device_id_init(agile_modbus_device_id_t *dev_id, uint8_t *buf, int bufsz)
+{
+    dev_id->buf = buf;
+    dev_id->bufsz = bufsz;
+    dev_id->length = 0;
+    /* Individual access is always supported */
+    dev_id->conformity = 0x80;
+}
+
+/**
+ * @brief   Add or replace a device identification object
+ * @note    Objects are serialized here, in ascending object id order, so that a response is a copy of consecutive objects.
+ *          The conformity level follows the highest category added (0x81 basic, 0x82 regular, 0x83 extended).
+ * @param   dev_id device identification objects
+ * @param   id object id
+ * @param   value object value
+ * @param   len object length
+ * @return  0: success; -1: the object is too long or the buffer is full
+ */
+int agile_modbus_device_id_add(agile_modbus_device_id_t *dev_id, int id, const void *value, int len)
+{
+    if (id < 0 || id > 0xFF || len < 0 || len > AGILE_MODBUS_MAX_DEVICE_ID_OBJECT_LENGTH)
+        return -1;
+
+    uint8_t *buf = dev_id->buf;
+    int pos = 0;
+
+    while (pos < dev_id->length && buf[pos] < id)
+        pos += 2 + buf[pos + 1];
+
+    int old_length = 0;
+    if (pos < dev_id->length && buf[pos] == id)
+        old_length = 2 + buf[pos + 1];
+
+    if (dev_id->length - old_length + 2 + len > dev_id->bufsz)
+        return -1;
+
+    memmove(buf + pos + 2 + len, buf + pos + old_length, dev_id->length - pos - old_length);
+    buf[pos] = id;
+    buf[pos + 1] = len;
+    memcpy(buf + pos + 2, value, len);
+    dev_id->length += 2 + len - old_length;
+
+    int level = AGILE_MODBUS_READ_DEVICE_ID_BASIC;
+    if (id >= 0x80)
+        level = AGILE_MODBUS_READ_DEVICE_ID_EXTENDED;
+    else if (id > AGILE_MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION)
+        level = AGILE_MODBUS_READ_DEVICE_ID_REGULAR;
+
+    if ((dev_id->conformity & 0x7F) < level)
+        dev_id->conformity = 0x80 | level;
+
+    return 0;
+}
+
+/**
+ * @brief   Package a read device identification response (function code 0x2B / MEI type 0x0E) in a slave callback
+ @verbatim
+    Stream access (read device ID code 01 / 02 / 03) returns the objects from the requested object id up to the end
+    of the category, as many as fit the response. When they don't all fit, `more follows` is 0xFF and `next object
+    id` tells the master where to go on. An object id that isn't there restarts at the first object.
+
+    Individual access (read device ID code 04) returns the requested object, ILLEGAL_DATA_ADDRESS if it isn't there.
+
+ @endverbatim
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   dev_id device identification objects
+ * @return  =0: normal, `rsp_length` is updated;
+ *          <0: exception code
+ */
+int agile_modbus_slave_device_id_handle(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_device_id_t *dev_id)
+{
+    const uint8_t *req = slave_info->buf;
+    int read_code;
+    int object_id;
+    int last_id;
+
+    if (slave_info->nb < 3 || req[0] != AGILE_MODBUS_MEI_READ_DEVICE_ID)
+        return -AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+
+    read_code = req[1];
+    object_id = req[2];
+
+    switch (read_code) {
+    case AGILE_MODBUS_READ_DEVICE_ID_BASIC:
+        last_id = AGILE_MODBUS_DEVICE_ID_MAJOR_MINOR_REVISION;
+        break;
+
+    case AGILE_MODBUS_READ_DEVICE_ID_REGULAR:
+        last_id = 0x7F;
+        break;
+
+    case AGILE_MODBUS_READ_DEVICE_ID_EXTENDED:
+        last_id = 0xFF;
+        break;
+
+    case AGILE_MODBUS_READ_DEVICE_ID_SPECIFIC:
+        last_id = object_id;
+        break;
+
+    default:
+        return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    const uint8_t *buf = dev_id->buf;
+    int pos = 0;
+
+    while (pos < dev_id->length && buf[pos] < object_id)
+        pos += 2 + buf[pos + 1];
+
+    if (pos == dev_id->length || buf[pos] != object_id || object_id > last_id) {
+        if (read_code == AGILE_MODBUS_READ_DEVICE_ID_SPECIFIC)
+            return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+        pos = 0;
+    }
+
+    /* Objects that fit the send buffer and one PDU */
+    int room = ctx->send_bufsz - slave_info->send_index - ctx->backend->checksum_length;
+    if (room > AGILE_MODBUS_MAX_PDU_LENGTH - 1)
+        room = AGILE_MODBUS_MAX_PDU_LENGTH - 1;
+    room -= AGILE_MODBUS_DEVICE_ID_HEADER_LENGTH - 1;
+
+    int start = pos;
+    int nb_objects = 0;
+    int more_follows = 0;
+    int next_object_id = 0;
+
+    while (pos < dev_id->length && buf[pos] <= last_id) {
+        int object_length = 2 + buf[pos + 1];
+        if (pos - start + object_length > room) {
+            more_follows = AGILE_MODBUS_DEVICE_ID_MORE_FOLLOWS;
+            next_object_id = buf[pos];
+            break;
+        }
+
+        pos += object_length;
+        nb_objects++;
+    }
+
+    if (nb_objects == 0 && more_follows)
+        return -AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+
+    uint8_t *rsp = ctx->send_buf + slave_info->send_index;
+    rsp[0] = AGILE_MODBUS_MEI_READ_DEVICE_ID;
+    rsp[1] = read_code;
+    rsp[2] = dev_id->conformity;
+    rsp[3] = more_follows;
+    rsp[4] = next_object_id;
+    rsp[5] = nb_objects;
+    memcpy(rsp + 6, buf + start, pos - start);
+
+    *(slave_info->rsp_length) = slave_info->send_index + 6 + pos - start;
+
+    return 0;
+}
+
 /**
  * @brief   slave data processing
  * @param   ctx modbus handle
@@ -1208,10 +2136,17 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
         return -1;
 
     int req_length = agile_modbus_receive_judge(ctx, msg_length, AGILE_MODBUS_MSG_INDICATION);
-    if (req_length < 0)
+    if (req_length < 0) {
+        /* The receive buffer filled up without a frame in it, characters were lost */
+        if (ctx->diag && ctx->backend->backend_type == AGILE_MODBUS_BACKEND_TYPE_RTU && msg_length >= ctx->read_bufsz)
+            ctx->diag->bus_char_overrun++;
+
         return -1;
+    }
     if (frame_length)
         *frame_length = req_length;
+    if (ctx->diag)
+        ctx->diag->bus_message++;
 
     int offset;
     int slave;
@@ -1220,6 +2155,10 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
     int rsp_length = 0;
     int exception_code = 0;
     int reg_data = 0;
+    /* Answered by the library alone, the callback is not called */
+    int answered = 0;
+    /* Addressed to the unit of the context, the callback decides for the other units */
+    int own_unit;
     agile_modbus_sft_t sft;
     uint8_t *req = ctx->read_buf;
     uint8_t *rsp = ctx->send_buf;
@@ -1244,6 +2183,10 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
             return 0;
     }
 
+    own_unit = (slave == ctx->slave) || (slave == AGILE_MODBUS_BROADCAST_ADDRESS);
+    if (own_unit && ctx->diag)
+        ctx->diag->server_message++;
+
     switch (function) {
     case AGILE_MODBUS_FC_READ_COILS:
     case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS: {
@@ -1408,7 +2351,7 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
         /* Run indicator status to ON */
         rsp[rsp_length++] = 0xFF;
 
-        str_len = strlen(AGILE_MODBUS_VERSION_STRING);
+        str_len = sizeof(AGILE_MODBUS_VERSION_STRING) - 1;
         if (ctx->send_bufsz < (int)(rsp_length + ctx->backend->checksum_length + str_len)) {
             exception_code = AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
             break;
@@ -1418,9 +2361,53 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
         rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
     } break;
 
-    case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
-        exception_code = AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-        break;
+    case AGILE_MODBUS_FC_READ_FILE_RECORD: {
+        int nb_records;
+        int rsp_data_length;
+
+        exception_code = agile_modbus_check_file_record_request(&req[offset + 2], req[offset + 1], 0, &nb_records, &rsp_data_length);
+        if (exception_code)
+            break;
+
+        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+        if (ctx->send_bufsz < (int)(rsp_length + 1 + rsp_data_length + ctx->backend->checksum_length)) {
+            exception_code = AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+            break;
+        }
+
+        rsp[rsp_length++] = rsp_data_length;
+        slave_info.nb = nb_records;
+        slave_info.buf = &req[offset + 2];
+        slave_info.send_index = rsp_length;
+
+        /* Sub-response headers, the record data is filled in by the callback */
+        for (int i = 0; i < nb_records; i++) {
+            const uint8_t *sub = slave_info.buf + i * AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH;
+            int nb = (sub[5] << 8) + sub[6];
+
+            rsp[rsp_length++] = 1 + nb * 2;
+            rsp[rsp_length++] = AGILE_MODBUS_FILE_RECORD_REFERENCE_TYPE;
+            rsp_length += nb * 2;
+        }
+    } break;
+
+    case AGILE_MODBUS_FC_WRITE_FILE_RECORD: {
+        int nb_records;
+        int rsp_data_length;
+
+        exception_code = agile_modbus_check_file_record_request(&req[offset + 2], req[offset + 1], 1, &nb_records, &rsp_data_length);
+        if (exception_code)
+            break;
+
+        slave_info.nb = nb_records;
+        slave_info.buf = &req[offset + 2];
+        rsp_length = req_length;
+        if (ctx->send_bufsz < (int)(rsp_length + ctx->backend->checksum_length)) {
+            exception_code = AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+            break;
+        }
+        memcpy(rsp, req, req_length);
+    } break;
 
     case AGILE_MODBUS_FC_MASK_WRITE_REGISTER: {
         //! warning: comparison is always false due to limited range of data type [-Wtype-limits]
@@ -1470,6 +2457,45 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
         }
     } break;
 
+    case AGILE_MODBUS_FC_READ_FIFO_QUEUE: {
+        rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+        /* Byte count (2), the FIFO count and the values are filled in by the callback */
+        slave_info.send_index = rsp_length + 2;
+        rsp_length += 4;
+        if (ctx->send_bufsz < (int)(rsp_length + ctx->backend->checksum_length)) {
+            exception_code = AGILE_MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE;
+            break;
+        }
+
+        /* As many values as the send buffer holds */
+        slave_info.nb = (ctx->send_bufsz - rsp_length - ctx->backend->checksum_length) / 2;
+        if (slave_info.nb > AGILE_MODBUS_MAX_FIFO_COUNT)
+            slave_info.nb = AGILE_MODBUS_MAX_FIFO_COUNT;
+    } break;
+
+    case AGILE_MODBUS_FC_READ_EXCEPTION_STATUS:
+        if (ctx->exception_status && own_unit) {
+            /* Never answered to a broadcast */
+            if (slave != AGILE_MODBUS_BROADCAST_ADDRESS) {
+                rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+                rsp[rsp_length++] = *ctx->exception_status;
+            }
+            answered = 1;
+            break;
+        }
+        /* fall through */
+
+    case AGILE_MODBUS_FC_DIAGNOSTICS:
+        if (function == AGILE_MODBUS_FC_DIAGNOSTICS && ctx->diag && own_unit) {
+            /* Never answered to a broadcast */
+            if (slave != AGILE_MODBUS_BROADCAST_ADDRESS)
+                exception_code = agile_modbus_diag_response(ctx, &sft, &req[offset + 1], req_length - offset - 1, &rsp_length);
+            answered = 1;
+            break;
+        }
+        /* Other units, or no status byte or counters: a custom function code */
+        /* fall through */
+
     default: {
         if (slave_cb == NULL)
             exception_code = AGILE_MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
@@ -1485,8 +2511,10 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
     if (exception_code)
         rsp_length = agile_modbus_serialize_response_exception(ctx, &sft, exception_code);
     else {
-        if (slave_cb) {
-            int ret = slave_cb(ctx, &slave_info, slave_data);
+        int ret = 0;
+
+        if (slave_cb && !answered) {
+            ret = slave_cb(ctx, &slave_info, slave_data);
 
             if (ret < 0) {
                 if (ret == -AGILE_MODBUS_EXCEPTION_UNKNOW)
@@ -1495,15 +2523,21 @@ int agile_modbus_slave_handle(agile_modbus_t *ctx, int msg_length, uint8_t slave
                     rsp_length = agile_modbus_serialize_response_exception(ctx, &sft, -ret);
             }
         }
+
+        if (ret >= 0 && function == AGILE_MODBUS_FC_READ_FIFO_QUEUE)
+            rsp_length = agile_modbus_complete_fifo_response(ctx, &sft, slave_info.send_index);
     }
 
     if (rsp_length) {
         if ((ctx->backend->backend_type == AGILE_MODBUS_BACKEND_TYPE_RTU) && (slave == AGILE_MODBUS_BROADCAST_ADDRESS))
-            return 0;
-
-        rsp_length = ctx->backend->send_msg_pre(rsp, rsp_length);
+            rsp_length = 0;
+        else
+            rsp_length = ctx->backend->send_msg_pre(rsp, rsp_length);
     }
 
+    if (rsp_length == 0 && own_unit && ctx->diag)
+        ctx->diag->server_no_response++;
+
     return rsp_length;
 }
 
@@ -91,28 +91,6 @@ static const uint8_t _table_crc_lo[] =
  * @{
  */
 
-/**
- * @brief   RTU CRC16 calculation
- * @param   buffer data pointer
- * @param   buffer_length data length
- * @return  CRC16 value
- */
-static uint16_t agile_modbus_rtu_crc16(uint8_t *buffer, uint16_t buffer_length)
-{
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i;        /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-        crc_hi = crc_lo ^ _table_crc_hi[i];
-        crc_lo = _table_crc_lo[i];
-    }
-
-    return (crc_hi << 8 | crc_lo);
-}
-
 /**
  * @brief   RTU sets the address interface
  * @param   ctx modbus handle
@@ -204,7 +182,6 @@ static int agile_modbus_rtu_check_integrity(agile_modbus_t *ctx, uint8_t *msg, c
 {
     uint16_t crc_calculated;
     uint16_t crc_received;
-    (void)ctx;
     crc_calculated = agile_modbus_rtu_crc16(msg, msg_length - 2);
     crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
 
@@ -212,6 +189,9 @@ static int agile_modbus_rtu_check_integrity(agile_modbus_t *ctx, uint8_t *msg, c
     if (crc_calculated == crc_received)
         return msg_length;
 
+    if (ctx->diag)
+        ctx->diag->bus_comm_error++;
+
     return -1;
 }
 
@@ -288,6 +268,29 @@ int agile_modbus_rtu_init(agile_modbus_rtu_t *ctx, uint8_t *send_buf, int send_b
     return 0;
 }
 
+/**
+ * @brief   RTU CRC16 calculation
+ * @param   buffer data pointer
+ * @param   buffer_length data length
+ * @note    The value is sent high byte first. Used by relays that frame RTU ADUs without a handle
+ * @return  CRC16 value
+ */
+uint16_t agile_modbus_rtu_crc16(const uint8_t *buffer, uint16_t buffer_length)
+{
+    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
+    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
+    unsigned int i;        /* will index into CRC lookup */
+
+    /* pass through message buffer */
+    while (buffer_length--) {
+        i = crc_hi ^ *buffer++; /* calculate the CRC  */
+        crc_hi = crc_lo ^ _table_crc_hi[i];
+        crc_lo = _table_crc_lo[i];
+    }
+
+    return (crc_hi << 8 | crc_lo);
+}
+
 /**
  * @}
  */
@@ -148,6 +148,28 @@ static int agile_modbus_tcp_check_integrity(agile_modbus_t *ctx, uint8_t *msg, c
     return msg_length;
 }
 
+/**
+ * @brief   UDP check receiving data integrity interface
+ * @note    A datagram carries exactly one ADU, so the MBAP length must match the frame
+ *          and the protocol identifier must be Modbus.
+ * @param   ctx modbus handle
+ * @param   msg Receive data pointer
+ * @param   msg_length valid data length
+ * @return  >0: valid data length; -1: frame error
+ */
+static int agile_modbus_udp_check_integrity(agile_modbus_t *ctx, uint8_t *msg, const int msg_length)
+{
+    (void)ctx;
+
+    if (msg[2] != 0 || msg[3] != 0)
+        return -1;
+
+    if ((msg[4] << 8) + msg[5] != msg_length - 6)
+        return -1;
+
+    return msg_length;
+}
+
 /**
  * @brief   TCP pre-check confirmation interface (compare transaction identifier and protocol identifier)
  * @param   ctx modbus handle
@@ -197,6 +219,23 @@ static const agile_modbus_backend_t agile_modbus_tcp_backend =
         agile_modbus_tcp_check_integrity,
         agile_modbus_tcp_pre_check_confirmation};
 
+/**
+ * @brief   UDP backend interface
+ */
+static const agile_modbus_backend_t agile_modbus_udp_backend =
+    {
+        AGILE_MODBUS_BACKEND_TYPE_UDP,
+        AGILE_MODBUS_TCP_HEADER_LENGTH,
+        AGILE_MODBUS_TCP_CHECKSUM_LENGTH,
+        AGILE_MODBUS_TCP_MAX_ADU_LENGTH,
+        agile_modbus_tcp_set_slave,
+        agile_modbus_tcp_build_request_basis,
+        agile_modbus_tcp_build_response_basis,
+        agile_modbus_tcp_prepare_response_tid,
+        agile_modbus_tcp_send_msg_pre,
+        agile_modbus_udp_check_integrity,
+        agile_modbus_tcp_pre_check_confirmation};
+
 /**
  * @}
  */
@@ -225,6 +264,28 @@ int agile_modbus_tcp_init(agile_modbus_tcp_t *ctx, uint8_t *send_buf, int send_b
     return 0;
 }
 
+/**
+ * @brief   UDP initialization
+ * @note    Framing is that of TCP, the transaction identifier is what pairs a response
+ *          with its request. Retransmission is left to the transport.
+ * @param   ctx UDP handle
+ * @param   send_buf send buffer
+ * @param   send_bufsz send buffer size
+ * @param   read_buf receive buffer
+ * @param   read_bufsz receive buffer size
+ * @return  0: success
+ */
+int agile_modbus_udp_init(agile_modbus_udp_t *ctx, uint8_t *send_buf, int send_bufsz, uint8_t *read_buf, int read_bufsz)
+{
+    agile_modbus_common_init(&(ctx->_ctx), send_buf, send_bufsz, read_buf, read_bufsz);
+    ctx->_ctx.backend = &agile_modbus_udp_backend;
+    ctx->_ctx.backend_data = ctx;
+
+    ctx->t_id = 0;
+
+    return 0;
+}
+
 /**
  * @}
  */
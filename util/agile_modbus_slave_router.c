@@ -0,0 +1,131 @@
+/**
+ * @file    agile_modbus_slave_router.c
+ * @brief   Agile Modbus software package provides multi-unit slave router source files
+ * @date    2026-10-18
+ *
+ @verbatim
+    use:
+    Host many virtual slaves behind one connection / serial port.
+
+    1. `agile_modbus_slave_router_init` initializes the router with an optional default route
+    2. `agile_modbus_slave_router_add` binds a unit identifier to an `agile_modbus_slave_util_t`
+    3. `agile_modbus_slave_handle(ctx, read_len, 0, agile_modbus_slave_router_callback, &router, NULL)`
+
+    The lookup is a table index, so routing costs the same for 1 or 247 units.
+    The broadcast address is routed like any other unit identifier.
+    Statistics are updated without locking, they are meant for monitoring only.
+
+ @endverbatim
+ */
+
+#include "agile_modbus.h"
+#include "agile_modbus_slave_router.h"
+#include <string.h>
+
+/** @addtogroup UTIL
+ * @{
+ */
+
+/** @defgroup SLAVE_ROUTER Slave Router
+ * @{
+ */
+
+/** @defgroup SLAVE_ROUTER_Exported_Functions Slave Router Exported Functions
+ * @{
+ */
+
+/**
+ * @brief   Initialize the slave router
+ * @param   router slave router
+ * @param   default_route slave function structure of units without a route, NULL if none
+ */
+void agile_modbus_slave_router_init(agile_modbus_slave_router_t *router, const agile_modbus_slave_util_t *default_route)
+{
+    memset(router, 0, sizeof(agile_modbus_slave_router_t));
+    router->default_route = default_route;
+}
+
+/**
+ * @brief   Bind a unit identifier to a slave function structure
+ * @param   router slave router
+ * @param   slave unit identifier
+ * @param   slave_util slave function structure
+ * @return  0: success; -1: invalid unit identifier
+ */
+int agile_modbus_slave_router_add(agile_modbus_slave_router_t *router, int slave, const agile_modbus_slave_util_t *slave_util)
+{
+    if (slave < 0 || slave >= AGILE_MODBUS_SLAVE_ROUTER_MAX_UNITS)
+        return -1;
+
+    router->routes[slave] = slave_util;
+    memset(&router->stats[slave], 0, sizeof(agile_modbus_slave_router_stat_t));
+
+    return 0;
+}
+
+/**
+ * @brief   Remove the route of a unit identifier
+ * @param   router slave router
+ * @param   slave unit identifier
+ * @return  0: success; -1: invalid unit identifier
+ */
+int agile_modbus_slave_router_remove(agile_modbus_slave_router_t *router, int slave)
+{
+    if (slave < 0 || slave >= AGILE_MODBUS_SLAVE_ROUTER_MAX_UNITS)
+        return -1;
+
+    router->routes[slave] = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief   Slave callback function dispatching requests by unit identifier
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   data slave router (agile_modbus_slave_router_t)
+ * @return  =0: normal;
+ *          <0: Abnormal
+ *             (-AGILE_MODBUS_EXCEPTION_UNKNOW(-255): Unknown exception, the slave will not package the response data)
+ *             (Other negative exception codes: package exception response data from the opportunity)
+ */
+int agile_modbus_slave_router_callback(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const void *data)
+{
+    agile_modbus_slave_router_t *router = (agile_modbus_slave_router_t *)data;
+    int slave = slave_info->sft->slave & 0xFF;
+
+    const agile_modbus_slave_util_t *slave_util = router->routes[slave];
+    if (slave_util == NULL)
+        slave_util = router->default_route;
+
+    if (slave_util == NULL) {
+        router->unrouted++;
+        if (router->no_route_exception)
+            return -router->no_route_exception;
+
+        return -AGILE_MODBUS_EXCEPTION_UNKNOW;
+    }
+
+    agile_modbus_slave_router_stat_t *stat = &router->stats[slave];
+    stat->requests++;
+
+    int ret = agile_modbus_slave_util_callback(ctx, slave_info, slave_util);
+    if (ret == -AGILE_MODBUS_EXCEPTION_UNKNOW)
+        stat->no_responses++;
+    else if (ret < 0)
+        stat->exceptions++;
+
+    return ret;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
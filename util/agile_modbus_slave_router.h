@@ -0,0 +1,84 @@
+/**
+ * @file    agile_modbus_slave_router.h
+ * @brief   The multi-unit slave router header file provided by the Agile Modbus software package
+ * @date    2026-10-18
+ */
+
+#ifndef __PKG_AGILE_MODBUS_SLAVE_ROUTER_H
+#define __PKG_AGILE_MODBUS_SLAVE_ROUTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "agile_modbus_slave_util.h"
+
+/** @addtogroup UTIL
+ * @{
+ */
+
+/** @addtogroup SLAVE_ROUTER
+ * @{
+ */
+
+/** @defgroup SLAVE_ROUTER_Exported_Constants Slave Router Exported Constants
+ * @{
+ */
+#define AGILE_MODBUS_SLAVE_ROUTER_MAX_UNITS 256 /**< Number of unit identifiers */
+/**
+ * @}
+ */
+
+/** @defgroup SLAVE_ROUTER_Exported_Types Slave Router Exported Types
+ * @{
+ */
+
+/**
+ * @brief   slave router per unit statistics structure
+ */
+typedef struct agile_modbus_slave_router_stat {
+    uint32_t requests;     /**< Number of requests routed to the unit */
+    uint32_t exceptions;   /**< Number of exception responses */
+    uint32_t no_responses; /**< Number of requests left unanswered */
+} agile_modbus_slave_router_stat_t;
+
+/**
+ * @brief   slave router structure
+ */
+typedef struct agile_modbus_slave_router {
+    const agile_modbus_slave_util_t *routes[AGILE_MODBUS_SLAVE_ROUTER_MAX_UNITS]; /**< Slave function structure of each unit identifier */
+    const agile_modbus_slave_util_t *default_route;                               /**< Slave function structure of units without a route, NULL if none */
+    int no_route_exception;                                                       /**< Exception code for units without any route, 0: no response */
+    agile_modbus_slave_router_stat_t stats[AGILE_MODBUS_SLAVE_ROUTER_MAX_UNITS];  /**< Statistics of each unit identifier */
+    uint32_t unrouted;                                                            /**< Number of requests without any route */
+} agile_modbus_slave_router_t;
+
+/**
+ * @}
+ */
+
+/** @addtogroup SLAVE_ROUTER_Exported_Functions
+ * @{
+ */
+void agile_modbus_slave_router_init(agile_modbus_slave_router_t *router, const agile_modbus_slave_util_t *default_route);
+int agile_modbus_slave_router_add(agile_modbus_slave_router_t *router, int slave, const agile_modbus_slave_util_t *slave_util);
+int agile_modbus_slave_router_remove(agile_modbus_slave_router_t *router, int slave);
+int agile_modbus_slave_router_callback(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const void *data);
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PKG_AGILE_MODBUS_SLAVE_ROUTER_H */
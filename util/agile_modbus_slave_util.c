@@ -45,17 +45,256 @@ static const agile_modbus_slave_util_map_t *get_map_by_addr(const agile_modbus_s
     return NULL;
 }
 
+/**
+ * @brief   Get the file mapping object from the file mapping object array according to the file number
+ * @param   files file mapping object array
+ * @param   nb_files number of arrays
+ * @param   file file number
+ * @return  !=NULL: file mapping object; =NULL: failure
+ */
+static const agile_modbus_slave_util_file_map_t *get_file_map(const agile_modbus_slave_util_file_map_t *files, int nb_files, int file)
+{
+    for (int i = 0; i < nb_files; i++) {
+        if (files[i].file == file)
+            return &files[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief   Get the register range a write request modifies
+ * @param   slave_info slave information body
+ * @param   function stores the read function code of the written table
+ * @param   address stores the start address
+ * @param   nb stores the number of bits / registers
+ * @return  0: write request; -1: not a write request
+ */
+static int get_write_range(struct agile_modbus_slave_info *slave_info, int *function, int *address, int *nb)
+{
+    *address = slave_info->address;
+
+    switch (slave_info->sft->function) {
+    case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
+        *function = AGILE_MODBUS_FC_READ_COILS;
+        *nb = 1;
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        *function = AGILE_MODBUS_FC_READ_COILS;
+        *nb = slave_info->nb;
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
+        *function = AGILE_MODBUS_FC_READ_HOLDING_REGISTERS;
+        *nb = 1;
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        *function = AGILE_MODBUS_FC_READ_HOLDING_REGISTERS;
+        *nb = slave_info->nb;
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        *function = AGILE_MODBUS_FC_READ_HOLDING_REGISTERS;
+        *address = (slave_info->buf[2] << 8) + slave_info->buf[3];
+        *nb = (slave_info->buf[4] << 8) + slave_info->buf[5];
+        break;
+
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   Get the cache entry a read request maps to
+ * @param   cache response cache
+ * @param   slave unit identifier
+ * @param   function function code
+ * @param   address register address
+ * @param   nb number of bits / registers
+ * @return  cache entry
+ */
+static agile_modbus_slave_util_cache_entry_t *cache_slot(agile_modbus_slave_util_cache_t *cache, int slave, int function, int address, int nb)
+{
+    uint32_t hash = ((uint32_t)slave << 24) ^ ((uint32_t)function << 16) ^ ((uint32_t)address * 2654435761u) ^ (uint32_t)nb;
+
+    return &cache->entries[hash % (uint32_t)cache->nb_entries];
+}
+
+/**
+ * @brief   Copy a cached read response into the send buffer
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   cache response cache
+ * @param   length number of data bytes the response needs
+ * @param   version current register version
+ * @return  1: hit; 0: miss
+ */
+static int cache_get(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, agile_modbus_slave_util_cache_t *cache,
+                     int length, uint64_t version)
+{
+    int slave = slave_info->sft->slave;
+    int function = slave_info->sft->function;
+    int hit = 0;
+
+    if (cache->lock)
+        cache->lock();
+
+    agile_modbus_slave_util_cache_entry_t *entry = cache_slot(cache, slave, function, slave_info->address, slave_info->nb);
+    if (entry->valid && entry->slave == slave && entry->function == function &&
+        entry->address == slave_info->address && entry->nb == slave_info->nb &&
+        entry->length == length && entry->version == version) {
+        memcpy(ctx->send_buf + slave_info->send_index, entry->data, length);
+        hit = 1;
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+
+    if (cache->unlock)
+        cache->unlock();
+
+    return hit;
+}
+
+/**
+ * @brief   Store an encoded read response in the cache
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   cache response cache
+ * @param   length number of data bytes in the response
+ * @param   version register version read before the maps were accessed
+ */
+static void cache_put(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, agile_modbus_slave_util_cache_t *cache,
+                      int length, uint64_t version)
+{
+    int slave = slave_info->sft->slave;
+    int function = slave_info->sft->function;
+
+    if (length > (int)sizeof(cache->entries[0].data))
+        return;
+
+    if (cache->lock)
+        cache->lock();
+
+    agile_modbus_slave_util_cache_entry_t *entry = cache_slot(cache, slave, function, slave_info->address, slave_info->nb);
+    entry->valid = 1;
+    entry->slave = slave;
+    entry->function = function;
+    entry->length = length;
+    entry->address = slave_info->address;
+    entry->nb = slave_info->nb;
+    entry->version = version;
+    memcpy(entry->data, ctx->send_buf + slave_info->send_index, length);
+
+    if (cache->unlock)
+        cache->unlock();
+}
+
+/**
+ * @brief   Invalidate the cached responses overlapping a written range
+ * @param   cache response cache
+ * @param   function read function code of the written table
+ * @param   address start address
+ * @param   nb number of bits / registers written
+ */
+static void cache_invalidate(agile_modbus_slave_util_cache_t *cache, int function, int address, int nb)
+{
+    if (cache->lock)
+        cache->lock();
+
+    for (int i = 0; i < cache->nb_entries; i++) {
+        agile_modbus_slave_util_cache_entry_t *entry = &cache->entries[i];
+        if (!entry->valid || entry->function != function)
+            continue;
+
+        if (entry->address < address + nb && address < entry->address + entry->nb)
+            entry->valid = 0;
+    }
+
+    if (cache->unlock)
+        cache->unlock();
+}
+
+/**
+ * @brief   Record a written range
+ * @note    The range is merged into a pending range of the same table when they overlap or touch.
+ *          When the log is full it is marked as overflowed and the range is dropped.
+ * @param   dirty written range log
+ * @param   slave unit identifier
+ * @param   function read function code of the written table
+ * @param   address start address
+ * @param   nb number of bits / registers
+ */
+static void dirty_record(agile_modbus_slave_util_dirty_t *dirty, int slave, int function, int address, int nb)
+{
+    int notify = 0;
+
+    if (dirty->lock)
+        dirty->lock();
+
+    if (dirty->count == 0 && !dirty->overflow)
+        notify = 1;
+
+    int i;
+    for (i = 0; i < dirty->count; i++) {
+        agile_modbus_slave_util_dirty_range_t *range = &dirty->ranges[i];
+        if (range->slave != slave || range->function != function)
+            continue;
+
+        int start = range->address;
+        int end = range->address + range->nb;
+        if (address > end || address + nb < start)
+            continue;
+
+        if (address < start)
+            start = address;
+        if (address + nb > end)
+            end = address + nb;
+        if (end - start > 0xFFFF)
+            continue;
+
+        range->address = start;
+        range->nb = end - start;
+        break;
+    }
+
+    if (i == dirty->count) {
+        if (dirty->count < dirty->nb_ranges) {
+            agile_modbus_slave_util_dirty_range_t *range = &dirty->ranges[dirty->count++];
+            range->slave = slave;
+            range->function = function;
+            range->address = address;
+            range->nb = nb;
+        } else {
+            dirty->overflow = 1;
+        }
+    }
+
+    if (dirty->unlock)
+        dirty->unlock();
+
+    if (notify && dirty->notify)
+        dirty->notify(dirty->notify_arg);
+}
+
 /**
  * @brief   read register
  * @param   ctx modbus handle
  * @param   slave_info slave information body
  * @param   slave_util slave function structure
+ * @param   version register version sampled before the request was checked and the maps were read
  * @return  =0: normal;
  *          <0: Abnormal
  *             (-AGILE_MODBUS_EXCEPTION_UNKNOW(-255): Unknown exception, the slave will not package the response data)
  *             (Other negative exception codes: package exception response data from the opportunity)
  */
-static int read_registers(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util)
+static int read_registers(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util,
+                          uint64_t version)
 {
     uint8_t map_buf[AGILE_MODBUS_MAX_PDU_LENGTH];
     int function = slave_info->sft->function;
@@ -93,6 +332,19 @@ static int read_registers(agile_modbus_t *ctx, struct agile_modbus_slave_info *s
     if (maps == NULL)
         return 0;
 
+    agile_modbus_slave_util_cache_t *cache = slave_util->cache;
+    int length = 0;
+
+    if (cache && cache->nb_entries > 0) {
+        if (function == AGILE_MODBUS_FC_READ_COILS || function == AGILE_MODBUS_FC_READ_DISCRETE_INPUTS)
+            length = (nb / 8) + ((nb % 8) ? 1 : 0);
+        else
+            length = nb * 2;
+
+        if (cache_get(ctx, slave_info, cache, length, version))
+            return 0;
+    }
+
     for (int now_address = address, i = 0; now_address < address + nb; now_address++, i++) {
         const agile_modbus_slave_util_map_t *map = get_map_by_addr(maps, nb_maps, now_address);
         if (map == NULL)
@@ -125,6 +377,9 @@ static int read_registers(agile_modbus_t *ctx, struct agile_modbus_slave_info *s
         i += map_len - 1;
     }
 
+    if (length > 0)
+        cache_put(ctx, slave_info, cache, length, version);
+
     return 0;
 }
 
@@ -366,6 +621,205 @@ static int write_read_registers(agile_modbus_t *ctx, struct agile_modbus_slave_i
     return 0;
 }
 
+/**
+ * @brief   read file record
+ * @note    Sub-requests are 7 bytes (reference type, file number, record number, record length),
+ *          sub-responses are the file response length and reference type followed by the record data.
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   slave_util slave function structure
+ * @return  =0: normal;
+ *          <0: Abnormal
+ *             (-AGILE_MODBUS_EXCEPTION_UNKNOW(-255): Unknown exception, the slave will not package the response data)
+ *             (Other negative exception codes: package exception response data from the opportunity)
+ */
+static int read_file_record(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util)
+{
+    uint16_t records[AGILE_MODBUS_MAX_PDU_LENGTH / 2];
+    const uint8_t *sub = slave_info->buf;
+    uint8_t *ptr = ctx->send_buf + slave_info->send_index;
+
+    if (slave_util->tab_files == NULL)
+        return 0;
+
+    for (int i = 0; i < slave_info->nb; i++, sub += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH) {
+        int file = (sub[1] << 8) + sub[2];
+        int record = (sub[3] << 8) + sub[4];
+        int nb = (sub[5] << 8) + sub[6];
+
+        const agile_modbus_slave_util_file_map_t *map = get_file_map(slave_util->tab_files, slave_util->nb_files, file);
+        if (map == NULL || record + nb > map->nb_records)
+            return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+        ptr += 2;
+        if (map->get) {
+            int rc = map->get(record, nb, records);
+            if (rc != 0)
+                return rc;
+
+            for (int j = 0; j < nb; j++)
+                agile_modbus_slave_register_set(ptr, j, records[j]);
+        }
+        ptr += nb * 2;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   write file record
+ * @note    Sub-requests are 7 bytes (reference type, file number, record number, record length) followed by the record data.
+ *          Every sub-request is checked before the first one is written.
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   slave_util slave function structure
+ * @return  =0: normal;
+ *          <0: Abnormal
+ *             (-AGILE_MODBUS_EXCEPTION_UNKNOW(-255): Unknown exception, the slave will not package the response data)
+ *             (Other negative exception codes: package exception response data from the opportunity)
+ */
+static int write_file_record(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util)
+{
+    uint16_t records[AGILE_MODBUS_MAX_PDU_LENGTH / 2];
+    const uint8_t *sub;
+    (void)ctx;
+    if (slave_util->tab_files == NULL)
+        return 0;
+
+    sub = slave_info->buf;
+    for (int i = 0; i < slave_info->nb; i++) {
+        int file = (sub[1] << 8) + sub[2];
+        int record = (sub[3] << 8) + sub[4];
+        int nb = (sub[5] << 8) + sub[6];
+
+        const agile_modbus_slave_util_file_map_t *map = get_file_map(slave_util->tab_files, slave_util->nb_files, file);
+        if (map == NULL || record + nb > map->nb_records)
+            return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+        sub += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH + nb * 2;
+    }
+
+    sub = slave_info->buf;
+    for (int i = 0; i < slave_info->nb; i++) {
+        int file = (sub[1] << 8) + sub[2];
+        int record = (sub[3] << 8) + sub[4];
+        int nb = (sub[5] << 8) + sub[6];
+
+        const agile_modbus_slave_util_file_map_t *map = get_file_map(slave_util->tab_files, slave_util->nb_files, file);
+        if (map->set) {
+            for (int j = 0; j < nb; j++)
+                records[j] = agile_modbus_slave_register_get((uint8_t *)sub + AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH, j);
+
+            int rc = map->set(record, nb, records);
+            if (rc != 0)
+                return rc;
+        }
+
+        sub += AGILE_MODBUS_FILE_RECORD_HEADER_LENGTH + nb * 2;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   read FIFO queue
+ * @note    The queue is left as it is: the oldest queued registers are copied, as many as the response holds, and the
+ *          FIFO count is the number of queued registers. `agile_modbus_slave_handle` answers a count over 31 with
+ *          ILLEGAL_DATA_VALUE. The registers returned are taken out once the master acknowledges them, see
+ *          `ack_fifo_queue`.
+ * @param   ctx modbus handle
+ * @param   slave_info slave information body
+ * @param   slave_util slave function structure
+ * @return  =0: normal;
+ *          <0: Abnormal
+ *             (-AGILE_MODBUS_EXCEPTION_UNKNOW(-255): Unknown exception, the slave will not package the response data)
+ *             (Other negative exception codes: package exception response data from the opportunity)
+ */
+static int read_fifo_queue(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util)
+{
+    agile_modbus_slave_util_fifo_t *fifo = NULL;
+    uint8_t *ptr = ctx->send_buf + slave_info->send_index;
+
+    if (slave_util->tab_fifos == NULL)
+        return 0;
+
+    for (int i = 0; i < slave_util->nb_fifos; i++) {
+        if (slave_util->tab_fifos[i].address == slave_info->address) {
+            fifo = &slave_util->tab_fifos[i];
+            break;
+        }
+    }
+
+    if (fifo == NULL)
+        return -AGILE_MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    if (fifo->lock)
+        fifo->lock();
+
+    int count = fifo->count;
+    int nb = count;
+    if (nb > slave_info->nb)
+        nb = slave_info->nb;
+
+    int index = fifo->head;
+    for (int i = 0; i < nb; i++) {
+        agile_modbus_slave_register_set(ptr, 1 + i, fifo->buf[index]);
+        if (++index == fifo->size)
+            index = 0;
+    }
+
+    /* A queue the response doesn't hold is refused, nothing was returned */
+    fifo->returned = (nb == count) ? nb : 0;
+
+    if (fifo->unlock)
+        fifo->unlock();
+
+    /* FIFO count, the byte count is set by agile_modbus_slave_handle */
+    agile_modbus_slave_register_set(ptr, 0, count);
+
+    return 0;
+}
+
+/**
+ * @brief   acknowledge FIFO queue
+ * @note    A register written at a FIFO pointer address (0x06 / 0x10) is the number of registers the master got from
+ *          its last read. That many of the oldest are taken out, at most as many as the last read returned, so a write
+ *          repeated after a lost response takes nothing out again.
+ * @param   slave_info slave information body
+ * @param   slave_util slave function structure
+ */
+static void ack_fifo_queue(struct agile_modbus_slave_info *slave_info, const agile_modbus_slave_util_t *slave_util)
+{
+    int function = slave_info->sft->function;
+    int address = slave_info->address;
+    int nb = (function == AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER) ? 1 : slave_info->nb;
+
+    for (int i = 0; i < slave_util->nb_fifos; i++) {
+        agile_modbus_slave_util_fifo_t *fifo = &slave_util->tab_fifos[i];
+        if (fifo->address < address || fifo->address >= address + nb)
+            continue;
+
+        int acked;
+        if (function == AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER)
+            acked = *((int *)slave_info->buf);
+        else
+            acked = agile_modbus_slave_register_get(slave_info->buf, fifo->address - address);
+
+        if (fifo->lock)
+            fifo->lock();
+
+        if (acked > fifo->returned)
+            acked = fifo->returned;
+
+        fifo->head = (fifo->head + acked) % fifo->size;
+        fifo->count -= acked;
+        fifo->returned = 0;
+
+        if (fifo->unlock)
+            fifo->unlock();
+    }
+}
+
 /**
  * @}
  */
@@ -393,6 +847,15 @@ int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_sl
     if (slave_util == NULL)
         return 0;
 
+    /*
+     * Sample the cache version before addr_check, which may pin a snapshot of the registers: a change in between
+     * leaves the response stored under the older version, where it is never served.
+     */
+    uint64_t version = 0;
+    if (slave_util->cache && slave_util->cache->nb_entries > 0 && slave_util->cache->version &&
+        function >= AGILE_MODBUS_FC_READ_COILS && function <= AGILE_MODBUS_FC_READ_INPUT_REGISTERS)
+        version = slave_util->cache->version();
+
     if (slave_util->addr_check) {
         ret = slave_util->addr_check(ctx, slave_info);
         if (ret != 0)
@@ -404,14 +867,19 @@ int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_sl
     case AGILE_MODBUS_FC_READ_DISCRETE_INPUTS:
     case AGILE_MODBUS_FC_READ_HOLDING_REGISTERS:
     case AGILE_MODBUS_FC_READ_INPUT_REGISTERS:
-        ret = read_registers(ctx, slave_info, slave_util);
+        ret = read_registers(ctx, slave_info, slave_util, version);
         break;
 
     case AGILE_MODBUS_FC_WRITE_SINGLE_COIL:
     case AGILE_MODBUS_FC_WRITE_MULTIPLE_COILS:
+        ret = write_registers(ctx, slave_info, slave_util);
+        break;
+
     case AGILE_MODBUS_FC_WRITE_SINGLE_REGISTER:
     case AGILE_MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
         ret = write_registers(ctx, slave_info, slave_util);
+        if (ret == 0 && slave_util->tab_fifos)
+            ack_fifo_queue(slave_info, slave_util);
         break;
 
     case AGILE_MODBUS_FC_MASK_WRITE_REGISTER:
@@ -422,6 +890,26 @@ int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_sl
         ret = write_read_registers(ctx, slave_info, slave_util);
         break;
 
+    case AGILE_MODBUS_FC_READ_FILE_RECORD:
+        ret = read_file_record(ctx, slave_info, slave_util);
+        break;
+
+    case AGILE_MODBUS_FC_WRITE_FILE_RECORD:
+        ret = write_file_record(ctx, slave_info, slave_util);
+        break;
+
+    case AGILE_MODBUS_FC_READ_FIFO_QUEUE:
+        ret = read_fifo_queue(ctx, slave_info, slave_util);
+        break;
+
+    case AGILE_MODBUS_FC_ENCAPSULATED_INTERFACE:
+        if (slave_util->device_id && slave_info->nb >= 1 && slave_info->buf[0] == AGILE_MODBUS_MEI_READ_DEVICE_ID) {
+            ret = agile_modbus_slave_device_id_handle(ctx, slave_info, slave_util->device_id);
+            break;
+        }
+        /* Other MEI types are special functions */
+        /* fall through */
+
     default: {
         if (slave_util->special_function) {
             ret = slave_util->special_function(ctx, slave_info);
@@ -431,6 +919,18 @@ int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_sl
     } break;
     }
 
+    /* Only a write that succeeded changed registers */
+    if (ret == 0 && ((slave_util->cache && slave_util->cache->nb_entries > 0) || slave_util->dirty)) {
+        int table, address, nb;
+        if (get_write_range(slave_info, &table, &address, &nb) == 0) {
+            if (slave_util->cache && slave_util->cache->nb_entries > 0)
+                cache_invalidate(slave_util->cache, table, address, nb);
+
+            if (slave_util->dirty && slave_util->dirty->nb_ranges > 0)
+                dirty_record(slave_util->dirty, slave_info->sft->slave, table, address, nb);
+        }
+    }
+
     if (slave_util->done) {
         slave_util->done(ctx, slave_info, ret);
     }
@@ -438,6 +938,120 @@ int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_sl
     return ret;
 }
 
+/**
+ * @brief   Drop all responses held by a response cache
+ * @param   cache response cache
+ */
+void agile_modbus_slave_util_cache_flush(agile_modbus_slave_util_cache_t *cache)
+{
+    if (cache->lock)
+        cache->lock();
+
+    for (int i = 0; i < cache->nb_entries; i++)
+        cache->entries[i].valid = 0;
+
+    if (cache->unlock)
+        cache->unlock();
+}
+
+/**
+ * @brief   Queue registers in a FIFO queue
+ * @note    When the queue is full the registers that don't fit are dropped and counted in `overflows`.
+ * @param   fifo FIFO queue
+ * @param   values registers to queue
+ * @param   nb number of registers
+ * @return  number of registers queued
+ */
+int agile_modbus_slave_util_fifo_push(agile_modbus_slave_util_fifo_t *fifo, const uint16_t *values, int nb)
+{
+    if (fifo->lock)
+        fifo->lock();
+
+    int space = fifo->size - fifo->count;
+    if (nb > space) {
+        fifo->overflows += nb - space;
+        nb = space;
+    }
+
+    int tail = fifo->head + fifo->count;
+    for (int i = 0; i < nb; i++, tail++) {
+        if (tail >= fifo->size)
+            tail -= fifo->size;
+
+        fifo->buf[tail] = values[i];
+    }
+    fifo->count += nb;
+
+    if (fifo->unlock)
+        fifo->unlock();
+
+    return nb;
+}
+
+/**
+ * @brief   Take the oldest registers out of a FIFO queue
+ * @note    For the slave side, the registers a master read are taken out by its acknowledgement.
+ * @param   fifo FIFO queue
+ * @param   values stores the registers taken, NULL to drop them
+ * @param   nb maximum number of registers to take
+ * @return  number of registers taken
+ */
+int agile_modbus_slave_util_fifo_pop(agile_modbus_slave_util_fifo_t *fifo, uint16_t *values, int nb)
+{
+    if (fifo->lock)
+        fifo->lock();
+
+    if (nb > fifo->count)
+        nb = fifo->count;
+
+    for (int i = 0; i < nb; i++) {
+        if (values)
+            values[i] = fifo->buf[fifo->head];
+        if (++fifo->head == fifo->size)
+            fifo->head = 0;
+    }
+    fifo->count -= nb;
+    fifo->returned = (fifo->returned > nb) ? fifo->returned - nb : 0;
+
+    if (fifo->unlock)
+        fifo->unlock();
+
+    return nb;
+}
+
+/**
+ * @brief   Take pending written ranges out of a written range log
+ * @note    The notify interface only fires when the log becomes non-empty, drain until fewer than `max_ranges` ranges are returned.
+ * @param   dirty written range log
+ * @param   ranges stores the ranges
+ * @param   max_ranges maximum number of ranges to take
+ * @param   overflow stores whether ranges were dropped since the last drain (consumer must rescan), can be NULL
+ * @return  number of ranges taken
+ */
+int agile_modbus_slave_util_dirty_drain(agile_modbus_slave_util_dirty_t *dirty, agile_modbus_slave_util_dirty_range_t *ranges,
+                                        int max_ranges, int *overflow)
+{
+    if (dirty->lock)
+        dirty->lock();
+
+    int nb = dirty->count;
+    if (nb > max_ranges)
+        nb = max_ranges;
+
+    memcpy(ranges, dirty->ranges, nb * sizeof(agile_modbus_slave_util_dirty_range_t));
+    memmove(dirty->ranges, dirty->ranges + nb, (dirty->count - nb) * sizeof(agile_modbus_slave_util_dirty_range_t));
+    dirty->count -= nb;
+
+    if (overflow)
+        *overflow = dirty->overflow;
+    dirty->overflow = 0;
+
+    if (dirty->unlock)
+        dirty->unlock();
+
+    return nb;
+}
+
 /**
  * @}
  */
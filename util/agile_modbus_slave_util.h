@@ -42,6 +42,82 @@ typedef struct agile_modbus_slave_util_map {
     int (*set)(int index, int len, void *buf, int bufsz); /**< Set register data interface */
 } agile_modbus_slave_util_map_t;
 
+/**
+ * @brief   slave file mapping structure (function codes 0x14 / 0x15)
+ */
+typedef struct agile_modbus_slave_util_file_map {
+    int file;                                            /**< File number */
+    int nb_records;                                      /**< Number of records, record numbers 0 ~ nb_records - 1 */
+    int (*get)(int index, int len, uint16_t *buf);       /**< Read `len` records from record `index` interface */
+    int (*set)(int index, int len, const uint16_t *buf); /**< Write `len` records from record `index` interface */
+} agile_modbus_slave_util_file_map_t;
+
+/**
+ * @brief   slave FIFO queue structure (function code 0x18)
+ */
+typedef struct agile_modbus_slave_util_fifo {
+    int address;          /**< FIFO pointer address */
+    uint16_t *buf;        /**< Ring buffer storage */
+    int size;             /**< Number of registers the storage can hold */
+    int head;             /**< Index of the oldest queued register */
+    int count;            /**< Number of queued registers */
+    uint32_t overflows;   /**< Number of registers dropped because the queue was full */
+    int returned;         /**< Number of registers the last read returned, until the master acknowledges them */
+    void (*lock)(void);   /**< Lock interface, NULL if the queue is not shared between threads */
+    void (*unlock)(void); /**< Unlock interface */
+} agile_modbus_slave_util_fifo_t;
+
+/**
+ * @brief   slave response cache entry structure
+ */
+typedef struct agile_modbus_slave_util_cache_entry {
+    uint8_t valid;                                     /**< Entry holds a response */
+    uint8_t slave;                                     /**< Unit identifier */
+    uint8_t function;                                  /**< Function code */
+    uint8_t length;                                    /**< Number of cached data bytes */
+    uint16_t address;                                  /**< Start address */
+    uint16_t nb;                                       /**< Number of bits / registers */
+    uint64_t version;                                  /**< Register version the data was read at */
+    uint8_t data[AGILE_MODBUS_MAX_READ_REGISTERS * 2]; /**< Encoded response data after the byte count */
+} agile_modbus_slave_util_cache_entry_t;
+
+/**
+ * @brief   slave response cache structure
+ */
+typedef struct agile_modbus_slave_util_cache {
+    agile_modbus_slave_util_cache_entry_t *entries; /**< Cache entry array */
+    int nb_entries;                                 /**< Number of cache entries */
+    uint64_t (*version)(void);                      /**< Register version interface, must never repeat, invalidates entries read at another version */
+    void (*lock)(void);                             /**< Lock interface, NULL if the cache is not shared between threads */
+    void (*unlock)(void);                           /**< Unlock interface */
+    uint32_t hits;                                  /**< Number of requests answered from the cache */
+    uint32_t misses;                                /**< Number of requests read from the maps */
+} agile_modbus_slave_util_cache_t;
+
+/**
+ * @brief   slave written range structure
+ */
+typedef struct agile_modbus_slave_util_dirty_range {
+    uint8_t slave;    /**< Unit identifier */
+    uint8_t function; /**< Read function code of the written table (AGILE_MODBUS_FC_READ_COILS / AGILE_MODBUS_FC_READ_HOLDING_REGISTERS) */
+    uint16_t address; /**< Start address */
+    uint16_t nb;      /**< Number of bits / registers */
+} agile_modbus_slave_util_dirty_range_t;
+
+/**
+ * @brief   slave written range log structure
+ */
+typedef struct agile_modbus_slave_util_dirty {
+    agile_modbus_slave_util_dirty_range_t *ranges; /**< Range storage */
+    int nb_ranges;                                 /**< Number of ranges the storage can hold */
+    int count;                                     /**< Number of pending ranges */
+    uint8_t overflow;                              /**< Ranges were dropped, consumers must rescan all registers */
+    void (*notify)(void *arg);                     /**< Called when the log becomes non-empty, NULL if consumers poll */
+    void *notify_arg;                              /**< Notify interface private data */
+    void (*lock)(void);                            /**< Lock interface, NULL if the log is not shared between threads */
+    void (*unlock)(void);                          /**< Unlock interface */
+} agile_modbus_slave_util_dirty_t;
+
 /**
  * @brief   slave function structure
  */
@@ -57,6 +133,13 @@ typedef struct agile_modbus_slave_util {
     int (*addr_check)(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info);       /**< Address checking interface */
     int (*special_function)(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info); /**<Special function code processing interface */
     int (*done)(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, int ret);    /**< Processing end interface */
+    agile_modbus_slave_util_cache_t *cache;                                                   /**< Read response cache, NULL if not used */
+    agile_modbus_slave_util_dirty_t *dirty;                                                   /**< Written range log, NULL if not used */
+    const agile_modbus_slave_util_file_map_t *tab_files;                                      /**< File definition array */
+    int nb_files;                                                                             /**< Number of file definition arrays */
+    agile_modbus_slave_util_fifo_t *tab_fifos;                                                /**< FIFO queue array */
+    int nb_fifos;                                                                             /**< Number of FIFO queues */
+    const agile_modbus_device_id_t *device_id;                                                /**< Device identification objects (0x2B / 0x0E), NULL if not used */
 } agile_modbus_slave_util_t;
 
 /**
@@ -67,6 +150,11 @@ typedef struct agile_modbus_slave_util {
  * @{
  */
 int agile_modbus_slave_util_callback(agile_modbus_t *ctx, struct agile_modbus_slave_info *slave_info, const void *data);
+void agile_modbus_slave_util_cache_flush(agile_modbus_slave_util_cache_t *cache);
+int agile_modbus_slave_util_fifo_push(agile_modbus_slave_util_fifo_t *fifo, const uint16_t *values, int nb);
+int agile_modbus_slave_util_fifo_pop(agile_modbus_slave_util_fifo_t *fifo, uint16_t *values, int nb);
+int agile_modbus_slave_util_dirty_drain(agile_modbus_slave_util_dirty_t *dirty, agile_modbus_slave_util_dirty_range_t *ranges,
+                                        int max_ranges, int *overflow);
 /**
  * @}
  */